@@ -0,0 +1,342 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file bench.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Benchmarks of the hot loops of ActiveBrownian
+ *
+ * Time the minimum image convention in the loops over the pairs of
+ * neighbors (2d and 3d), and the time steps of State and State3d.
+ * Optionally, measure how the time steps and the correlations scale
+ * with the number of threads (std::thread pool or OpenMP).
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <boost/program_options.hpp>
+#include "../src/state.h"
+#include "../src/state3d.h"
+#include "../src/observables.h"
+#include "../src/ompPragma.h"
+
+namespace po = boost::program_options;
+typedef std::chrono::steady_clock Clock;
+
+//! Minimum image with std::round (generic version of pbcSym)
+struct PbcRound {
+	static const char *name() { return "round"; }
+	static const bool shifted = false;
+	static void apply(double &x, const double L) {
+		x -= L * std::round(x / L);
+	}
+};
+
+// Former version of pbcSym<double>: magic number through a union
+union i_cast {double d; int i[2];};
+#define double2int(i, d, t)  \
+    {volatile union i_cast u; u.d = (d) + 6755399441055744.0; \
+    (i) = (t)u.i[0];}
+
+//! Minimum image with the union trick (former pbcSym<double>)
+struct PbcUnion {
+	static const char *name() { return "union"; }
+	static const bool shifted = false;
+	static void apply(double &x, const double L) {
+		double d = x / L;
+		int i;
+		double2int(i, d, int);
+		x -= L * i;
+	}
+};
+
+//! Minimum image with comparisons (current pbcSym<double>)
+struct PbcBranchless {
+	static const char *name() { return "branchless"; }
+	static const bool shifted = false;
+	static void apply(double &x, const double L) {
+		pbcSym(x, L);
+	}
+};
+
+//! Shift of the image given by the boxes (current State and State3d)
+struct PbcShift {
+	static const char *name() { return "shift"; }
+	static const bool shifted = true;
+	static void apply(double &, const double) {}
+};
+
+/*!
+ * \brief Loop over the pairs of neighbors as in State and State3d
+ *
+ * The cutoff changes slightly from one call to the other so that
+ * the compiler cannot hoist the loop out of the repetitions.
+ *
+ * \return Number of pairs closer than the cutoff (to keep the loop alive)
+ */
+template<int DIM, typename Pbc>
+long pairLoop(const std::array<PartVector<double>, DIM> &pos,
+		      const std::array<double, DIM> &lens, const Boxes<DIM> &boxes,
+			  const double cutoff2) {
+	const std::vector< std::vector<long> > &nbrs_pos = boxes.getNbrsPos();
+	const std::vector< std::vector< std::array<double, DIM> > > &nbrs_shift = \
+		boxes.getNbrsShift();
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+	long n_close = 0;
+	for (long b1 = 0 ; b1 < boxes.getNBoxes() ; ++b1) {
+		for (size_t n = 0 ; n < nbrs_pos[b1].size() ; ++n) {
+			const long b2 = nbrs_pos[b1][n];
+			const std::array<double, DIM> shift = nbrs_shift[b1][n];
+			for (long i : parts_of_box[b1]) {
+				for (long j : parts_of_box[b2]) {
+					double dr2 = 0.;
+					for (int a = 0 ; a < DIM ; ++a) {
+						double d = pos[a][i] - pos[a][j];
+						if (Pbc::shifted) {
+							d -= shift[a];
+						} else {
+							Pbc::apply(d, lens[a]);
+						}
+						dr2 += d * d;
+					}
+					n_close += (dr2 < cutoff2);
+				}
+			}
+		}
+	}
+	return n_close;
+}
+
+/*!
+ * \brief Time the pair loop for a given minimum image convention
+ */
+template<int DIM, typename Pbc>
+void benchPairs(const std::array<PartVector<double>, DIM> &pos,
+		        const std::array<double, DIM> &lens, const Boxes<DIM> &boxes,
+				const long n_reps) {
+	long n_close = 0;
+	auto t0 = Clock::now();
+	for (long r = 0 ; r < n_reps ; ++r) {
+		n_close += pairLoop<DIM, Pbc>(pos, lens, boxes, 1.0 - 1e-9 * r);
+	}
+	double el = std::chrono::duration<double>(Clock::now() - t0).count();
+	std::cout << "  pairs " << DIM << "d, " << std::setw(10) << Pbc::name()
+		<< ": " << std::setw(8) << 1e3 * el / n_reps << " ms/loop"
+		<< " (" << n_close / n_reps << " close pairs)\n";
+}
+
+/*!
+ * \brief Time the pair loops with all the minimum image conventions
+ */
+template<int DIM>
+void benchPbc(const long n_parts, const double rho, const long n_reps) {
+	std::array<double, DIM> lens;
+	lens.fill(std::pow(n_parts / rho, 1.0 / DIM));
+	std::mt19937 rng(12345);
+	std::array<PartVector<double>, DIM> pos;
+	for (int a = 0 ; a < DIM ; ++a) {
+		std::uniform_real_distribution<double> rnd(0, lens[a]);
+		pos[a].resize(n_parts);
+		for (long i = 0 ; i < n_parts ; ++i) {
+			pos[a][i] = rnd(rng);
+		}
+	}
+	Boxes<DIM> boxes(lens, n_parts);
+	boxes.update(pos);
+
+	benchPairs<DIM, PbcRound>(pos, lens, boxes, n_reps);
+	benchPairs<DIM, PbcUnion>(pos, lens, boxes, n_reps);
+	benchPairs<DIM, PbcBranchless>(pos, lens, boxes, n_reps);
+	benchPairs<DIM, PbcShift>(pos, lens, boxes, n_reps);
+}
+
+/*!
+ * \brief Time the evolution of a state
+ */
+template<typename S>
+void benchEvolve(const char *name, S &state, const long n_parts,
+		         const long n_iters) {
+	state.evolve(); // Warm up
+	auto t0 = Clock::now();
+	for (long t = 0 ; t < n_iters ; ++t) {
+		state.evolve();
+	}
+	double el = std::chrono::duration<double>(Clock::now() - t0).count();
+	std::cout << "  " << name << ": " << std::setw(8)
+		<< 1e9 * el / (n_iters * n_parts) << " ns/particle/step\n";
+}
+
+/*!
+ * \brief Time the steps and the correlations for 1, 2, 4... threads
+ *
+ * The correlations are computed for fewer particles (n_obs), since
+ * their cost grows as the square of the number of particles.
+ */
+void benchScaling(const long n_parts, const double rho, const long n_iters,
+                  const long n_obs, const long n_reps, const int max_threads,
+				  const bool pin) {
+#ifdef USE_OPENMP
+	std::cout << "Scaling (OpenMP)\n";
+#else
+	std::cout << "Scaling (std::thread, serial correlations)\n";
+#endif
+	std::cout << "  threads   ns/particle/step  speedup   ms/correlations"
+		"  speedup\n";
+	double t_steps_1 = 0., t_obs_1 = 0.;
+	for (int n_threads = 1 ; n_threads <= max_threads ;
+		 n_threads = (2 * n_threads > max_threads && n_threads < max_threads)
+		             ? max_threads : 2 * n_threads) {
+#ifdef USE_OPENMP
+		omp_set_num_threads(n_threads);
+#endif
+		std::unique_ptr<Workers> workers;
+		if (n_threads > 1 || pin) {
+			workers.reset(new Workers(n_threads, pin));
+		}
+
+		double len = std::sqrt(n_parts / rho);
+		State state(len, len, n_parts, 1.0, 0.1, 1.0, 1.0, 1e-3, 1, false,
+		            WALLS_NONE, nullptr, 0.0, 1.0, false, 0.0, 0.0, nullptr,
+					false, workers.get());
+		state.evolve(); // Warm up
+		auto t0 = Clock::now();
+		for (long t = 0 ; t < n_iters ; ++t) {
+			state.evolve();
+		}
+		double t_steps = std::chrono::duration<double>(Clock::now() - t0)
+		                 .count() / (n_iters * n_parts);
+
+		double len_obs = std::sqrt(n_obs / rho);
+		State state_obs(len_obs, len_obs, n_obs, 1.0, 0.1, 1.0, 1.0, 1e-3, 1);
+		Observables obs(len_obs, len_obs, n_obs, 0.2, 40, false, false);
+		obs.compute(&state_obs); // Warm up
+		t0 = Clock::now();
+		for (long r = 0 ; r < n_reps ; ++r) {
+			obs.compute(&state_obs);
+		}
+		double t_obs = std::chrono::duration<double>(Clock::now() - t0)
+		               .count() / n_reps;
+
+		if (n_threads == 1) {
+			t_steps_1 = t_steps;
+			t_obs_1 = t_obs;
+		}
+		std::cout << "  " << std::setw(7) << n_threads << std::setw(19)
+			<< 1e9 * t_steps << std::setw(9) << t_steps_1 / t_steps
+			<< std::setw(18) << 1e3 * t_obs << std::setw(9)
+			<< t_obs_1 / t_obs << "\n";
+	}
+}
+
+int main(int argc, char **argv) {
+	long n_parts, n_iters, n_reps, n_obs;
+	int n_threads, max_threads;
+	bool pin;
+	std::string huge_pages_str;
+	double rho;
+
+	po::options_description opts("Options");
+	opts.add_options()
+		("parts,n", po::value<long>(&n_parts)->default_value(100000),
+		 "Number of particles")
+		("rho,r", po::value<double>(&rho)->default_value(0.5), "Density")
+		("iters,I", po::value<long>(&n_iters)->default_value(100),
+		 "Number of time steps")
+		("reps", po::value<long>(&n_reps)->default_value(20),
+		 "Number of repetitions of the pair loops")
+		("threads", po::value<int>(&n_threads)->default_value(1),
+		 "Number of threads for the forces (additional time steps)")
+		("pin", po::bool_switch(&pin), "Pin the threads to their CPUs")
+		("scaling", po::value<int>(&max_threads)->default_value(0),
+		 "Largest number of threads of the scaling benchmark (0 for none)")
+		("obsParts", po::value<long>(&n_obs)->default_value(2000),
+		 "Number of particles for the correlations (scaling benchmark)")
+		("hugePages",
+		 po::value<std::string>(&huge_pages_str)->default_value("none"),
+		 "Pages of the particle arrays: none, thp or explicit")
+		("help,h", "Print help message and exit")
+		;
+	try {
+		po::variables_map vars;
+		po::store(po::parse_command_line(argc, argv, opts), vars);
+		if (vars.count("help")) {
+			std::cout << "Usage: " << argv[0] << " options\n";
+			std::cout << opts << std::endl;
+			return 0;
+		}
+		po::notify(vars);
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	if (huge_pages_str == "thp") {
+		setHugePages(HUGE_PAGES_TRANSPARENT);
+	} else if (huge_pages_str == "explicit") {
+		setHugePages(HUGE_PAGES_EXPLICIT);
+	} else if (huge_pages_str != "none") {
+		std::cerr << "Error: unknown type of huge pages " << huge_pages_str
+			<< std::endl;
+		return 1;
+	}
+
+	std::cout << "# n_parts=" << n_parts << ", rho=" << rho
+		<< ", huge_pages=" << huge_pages_str << "\n";
+	std::cout << "Minimum image in the pair loops\n";
+	benchPbc<2>(n_parts, rho, n_reps);
+	benchPbc<3>(n_parts, rho, n_reps);
+
+	std::cout << "Time steps\n";
+	{
+		double len = std::sqrt(n_parts / rho);
+		State state(len, len, n_parts, 1.0, 0.1, 1.0, 1.0, 1e-3, 1);
+		benchEvolve("State (soft)", state, n_parts, n_iters);
+		printHugePages(std::cout);
+	}
+	{
+		double len = std::sqrt(n_parts / rho);
+		State state(len, len, n_parts, 1.0, 0.1, 1.0, 1.0, 1e-3, 1, false,
+		            WALLS_NONE, nullptr, 0.0, 1.0, false, 0.0, 0.0, nullptr,
+					true);
+		benchEvolve("State (soft, ghosts)", state, n_parts, n_iters);
+	}
+	if (n_threads > 1 || pin) {
+		double len = std::sqrt(n_parts / rho);
+		Workers workers(n_threads, pin);
+		workers.printTopology(std::cout);
+		State state(len, len, n_parts, 1.0, 0.1, 1.0, 1.0, 1e-3, 1, false,
+		            WALLS_NONE, nullptr, 0.0, 1.0, false, 0.0, 0.0, nullptr,
+					false, &workers);
+		benchEvolve("State (soft, threads)", state, n_parts, n_iters);
+	}
+	{
+		double len = std::cbrt(n_parts / rho);
+		State3d state({len, len, len}, n_parts, 1.0, 0.1, 1.0, 1.0, 1e-3, 1);
+		benchEvolve("State3d", state, n_parts, n_iters);
+	}
+
+	if (max_threads > 0) {
+		benchScaling(n_parts, rho, n_iters, n_obs, n_reps, max_threads, pin);
+	}
+
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file arena.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Arena allocator for the buffers rebuilt at each time step
+ *
+ * Implementation of the methods of the class Arena.
+ * When COUNT_ALLOCS is defined (debug builds), the global operator new
+ * is replaced to count the heap allocations.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include "arena.h"
+#include "partAllocator.h"
+
+#ifdef COUNT_ALLOCS
+#include <atomic>
+
+static std::atomic<long> n_heap_allocs(0); //!< Number of heap allocations
+//! The allocations of the calling thread are counted
+static thread_local bool count_thread = true;
+
+void * operator new(size_t n) {
+	if (count_thread) {
+		++n_heap_allocs;
+	}
+	void *p = std::malloc(n ? n : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	std::free(p);
+}
+
+long heapAllocCount() {
+	return n_heap_allocs;
+}
+
+void countHeapAllocs(const bool count) {
+	count_thread = count;
+}
+#else
+long heapAllocCount() {
+	return -1;
+}
+
+void countHeapAllocs(const bool) {
+}
+#endif
+
+/*!
+ * \brief Constructor of Arena
+ *
+ * \param _capacity Initial size of the block in bytes
+ */
+Arena::Arena(const size_t _capacity) :
+	block(nullptr), capacity(0), used(0), overflow_bytes(0),
+	high_water(_capacity) {
+	reset();
+}
+
+/*!
+ * \brief Destructor of Arena
+ */
+Arena::~Arena() {
+	for (char *p : overflow) {
+		delete[] p;
+	}
+	freeParts(block);
+}
+
+/*!
+ * \brief Free all the buffers at once.
+ *
+ * If some memory had to be taken from the heap since the last reset,
+ * the block is reallocated with some margin above the high-water mark.
+ */
+void Arena::reset() {
+	high_water = std::max(high_water, used + overflow_bytes);
+	if (high_water > capacity) {
+		for (char *p : overflow) {
+			delete[] p;
+		}
+		overflow.clear();
+		freeParts(block);
+
+		// Same memory as the arrays of the particles (huge pages)
+		capacity = high_water + high_water / 2;
+		block = static_cast<char *>(allocParts(capacity));
+	}
+	used = 0;
+	overflow_bytes = 0;
+}
+
+/*!
+ * \brief Free all the buffers and enlarge the block if needed.
+ *
+ * \param bytes Number of bytes expected between two resets
+ */
+void Arena::reserve(const size_t bytes) {
+	high_water = std::max(high_water, bytes);
+	reset();
+}
+
+/*!
+ * \brief Allocate memory on the heap when the block is full.
+ *
+ * The memory is freed at the next reset.
+ *
+ * \param bytes Number of bytes (multiple of ARENA_ALIGN)
+ * \return Pointer to the memory (aligned)
+ */
+void * Arena::allocOverflow(const size_t bytes) {
+	char *p = new char[bytes + ARENA_ALIGN];
+	overflow.push_back(p);
+	overflow_bytes += bytes;
+	std::uintptr_t a = reinterpret_cast<std::uintptr_t>(p);
+	return p + (ARENA_ALIGN - a % ARENA_ALIGN) % ARENA_ALIGN;
+}
@@ -0,0 +1,98 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file arena.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Arena allocator for the buffers rebuilt at each time step
+ *
+ * Header file for arena.cpp.
+ * It defines the class Arena and the counter of heap allocations.
+ */
+
+#ifndef ACTIVEBROWNIAN_ARENA_H_
+#define ACTIVEBROWNIAN_ARENA_H_
+
+#include <cstddef>
+#include <vector>
+
+// Alignment of the buffers (size of a cache line)
+#define ARENA_ALIGN 64
+
+/*!
+ * \brief Class for an arena (bump) allocator
+ *
+ * The buffers are carved out of a single block and are all freed at once
+ * by reset(), typically at the beginning of each time step.
+ * When the block is too small, the missing memory is taken from the heap
+ * and the block is enlarged at the next reset, so that after a few steps
+ * no heap allocation is performed anymore.
+ * An arena is not thread-safe: each thread should use its own.
+ */
+class Arena {
+	public:
+		Arena(const size_t _capacity=0);
+		~Arena();
+		Arena(const Arena &) = delete;
+		Arena & operator=(const Arena &) = delete;
+
+		//! Allocate n uninitialized objects of type T
+		template<typename T>
+		T * alloc(const size_t n) {
+			size_t bytes = (n * sizeof(T) + ARENA_ALIGN - 1)
+			               / ARENA_ALIGN * ARENA_ALIGN;
+			if (used + bytes > capacity) {
+				return static_cast<T *>(allocOverflow(bytes));
+			}
+			void *p = block + used;
+			used += bytes;
+			return static_cast<T *>(p);
+		}
+		//! Free all the buffers (and enlarge the block if needed)
+		void reset();
+		//! Free all the buffers and make the block at least that large
+		void reserve(const size_t bytes);
+
+		//! Size of the block in bytes
+		size_t getCapacity() const {
+			return capacity;
+		}
+		//! Largest number of bytes used between two resets
+		size_t getHighWater() const {
+			return high_water;
+		}
+
+	private:
+		//! Allocate memory on the heap when the block is full
+		void * allocOverflow(const size_t bytes);
+
+		char *block; //!< Memory of the block (aligned)
+		size_t capacity; //!< Size of the block in bytes
+		size_t used; //!< Bytes used in the block
+		std::vector<char *> overflow; //!< Buffers allocated on the heap
+		size_t overflow_bytes; //!< Bytes allocated on the heap
+		size_t high_water; //!< Largest number of bytes used
+};
+
+//! Number of heap allocations since the start (-1 if not counted)
+long heapAllocCount();
+//! Count or not the heap allocations of the calling thread
+void countHeapAllocs(const bool count);
+
+#endif // ACTIVEBROWNIAN_ARENA_H_
@@ -31,6 +31,65 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <array>
 #include <iostream>
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <new>
+#include "arena.h"
+#include "partAllocator.h"
+#include "workers.h"
+
+/*!
+ * \brief Class for the particles of all the boxes
+ *
+ * The indices of the particles are stored box after box, and the particles
+ * of box k are those between starts[k] and ends[k]. The boxes are
+ * contiguous (ends[k] = starts[k+1]) unless free slots are left after
+ * each box for the incremental updates.
+ */
+class PartsOfBoxes {
+	public:
+		//! Range of the particles of a box
+		class Range {
+			public:
+				Range(const long *_b, const long *_e) : b(_b), e(_e) {}
+				const long * begin() const { return b; }
+				const long * end() const { return e; }
+				const long * cbegin() const { return b; }
+				const long * cend() const { return e; }
+				long size() const { return e - b; }
+
+			private:
+				const long *b; //!< First particle
+				const long *e; //!< Past the last particle
+		};
+
+		PartsOfBoxes() : parts(nullptr), starts(nullptr), ends(nullptr) {}
+		//! Set the arrays of the particles and of the starts of the boxes
+		//! (and of their ends if there are free slots between the boxes)
+		void set(const long *_parts, const long *_starts,
+		         const long *_ends=nullptr) {
+			parts = _parts;
+			starts = _starts;
+			ends = _ends ? _ends : _starts + 1;
+		}
+		//! Particles of box k
+		Range operator[](const long k) const {
+			return Range(parts + starts[k], parts + ends[k]);
+		}
+		//! Index of the first slot of box k in the sorted order
+		//! (getStart(n_boxes) is the total number of slots)
+		long getStart(const long k) const {
+			return starts[k];
+		}
+
+	private:
+		const long *parts; //!< Indices of the particles
+		const long *starts; //!< Index of the first slot of each box
+		const long *ends; //!< Index past the last particle of each box
+};
 
 /*!
  * \brief Class for the boxes in which particles are.
@@ -42,38 +101,156 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 template<int DIM>
 class Boxes {
 	public:
-		Boxes(const double len, const long n_parts, const double size=1.0,
-			  const int fac=1);
+		Boxes(const std::array<double, DIM> &lens, const long n_parts,
+			  const double size=1.0, const int fac=1);
 		//! Update according to the positions
-		void update(const std::array< std::vector<double>, DIM> &pos);
+		void update(const std::array<PartVector<double>, DIM> &pos);
 
 		//! Return the number of boxes
 		long getNBoxes() const {
 			return n_boxes;
 		}
 
+		//! Return the number of boxes along axis a
+		long getNBoxesAxis(const int a) const {
+			return n_boxes_ax[a];
+		}
+
 		const std::vector< std::vector<long> > & getNbrsPos() const {
 			return nbrs_pos;
 		}
 
-		const std::vector< std::vector<long> > & getPartsOfBox() const {
+		//! Shift of the image of each neighboring box
+		const std::vector< std::vector< std::array<double, DIM> > > &
+		getNbrsShift() const {
+			return nbrs_shift;
+		}
+
+		const PartsOfBoxes & getPartsOfBox() const {
 			return parts_of_box;
 		}
 
+		//! Set which axes are periodic (all of them by default)
+		void setPeriodic(const std::array<bool, DIM> &per);
+		//! Get the lower and upper corners of box k
+		void getBoxBounds(const long k, std::array<double, DIM> &lo,
+				          std::array<double, DIM> &hi) const;
+		//! Set the Lees-Edwards offset of the images along y (only in 2d)
+		void setShearOffset(const double offset);
+
+		//! Threads of the classification (nullptr for a single thread)
+		void setWorkers(Workers *_workers) {
+			workers = _workers;
+			reserveArena();
+		}
+
+		//! Move only the particles changing box, with a full rebuild
+		//! every given number of updates (0 to rebuild at each update)
+		void setIncremental(const long every);
+		//! Rebuild the classification at the next update (the particles
+		//! have been renumbered)
+		void forceRebuild() {
+			inc_valid = false;
+		}
+
+		//! Enable or disable the ghost copies of the boundary particles
+		void setGhosts(const bool gh);
+		//! Tell whether the ghosts are enabled
+		bool hasGhosts() const {
+			return ghosts;
+		}
+		//! Neighboring boxes with the halo boxes (index n_boxes + h)
+		const std::vector< std::vector<long> > & getNbrsGhost() const {
+			return nbrs_ghost;
+		}
+		//! Box copied in each halo box
+		const std::vector<long> & getHaloSrc() const {
+			return halo_src;
+		}
+		//! Ghosts in each halo box
+		const PartsOfBoxes & getPartsOfHalo() const {
+			return parts_of_halo;
+		}
+		//! Positions of the ghosts
+		const std::array<double *, DIM> & getGhostPos() const {
+			return ghost_pos;
+		}
+		//! Particle of which each ghost is a copy
+		const long * getGhostOwner() const {
+			return ghost_owner;
+		}
+		//! Number of ghosts
+		long getNGhosts() const {
+			return n_ghosts;
+		}
+
 	private:
 		//!< Compute the neighboring boxes of a given box
 		void computeNbrsPos();
+		//! Reserve the memory of the classification in the arena
+		void reserveArena();
+		//! Box of particle i
+		long boxOf(const std::array<PartVector<double>, DIM> &pos,
+		           const long i) const;
+		//! Sort the particles by box
+		void sortSerial(const long *box_of);
+		//! Find the boxes and sort the particles with several threads
+		void sortParallel(const std::array<PartVector<double>, DIM> &pos,
+		                  long *box_of);
+		//! Move the particles which changed box (incremental mode)
+		void updateIncremental(const long *box_of);
+		//! Sort the particles by box leaving free slots (incremental mode)
+		void rebuildIncremental(const long *box_of);
+		//! Copy the particles of the boundary layer into the halo boxes
+		void fillGhosts(const std::array<PartVector<double>, DIM> &pos);
 
-		const long n_boxes_x; //!< Number of boxes in one direction
-		const long n_boxes; //!< Total number of boxes
-		const double len_box; //!< Length of a box (approximately 1/fac)
+		//! Number of boxes in each direction
+		std::array<long, DIM> n_boxes_ax;
+		//! Number of boxes in a slice orthogonal to each direction
+		std::array<long, DIM> strides;
+		long n_boxes; //!< Total number of boxes
+		std::array<double, DIM> lens; //!< Lengths of the system
+		//! Length of a box in each direction (approximately 1/fac)
+		std::array<double, DIM> len_box;
 		const long n_parts; //!< Number of particles
 		const int fac; //!< Factor for the size of the boxes
+		std::array<bool, DIM> periodic; //!< Periodicity along each axis
 		//! Neighboring boxes of a given box along the 'positive' directions
 		std::vector< std::vector<long> > nbrs_pos; 
+		//! Shift to add to the positions in each neighboring box to get
+		//! the nearest image (zero except across the boundaries)
+		std::vector< std::vector< std::array<double, DIM> > > nbrs_shift;
+		bool sheared; //!< Lees-Edwards boundary conditions along y
+		//! Number of neighbors of a box not coming from the sheared boundary
+		std::vector<size_t> n_nbrs_static;
 
+		//! Memory of the classification, freed at each update
+		Arena arena;
+		//! Threads of the classification (nullptr for a single thread)
+		Workers *workers;
 		//!< Particles in a given box
-		std::vector< std::vector<long> > parts_of_box;
+		PartsOfBoxes parts_of_box;
+
+		//! Number of updates between the full rebuilds (0: not incremental)
+		long inc_every;
+		long inc_count; //!< Updates since the last full rebuild
+		bool inc_valid; //!< The incremental classification is up to date
+		PartVector<long> inc_box; //!< Box of each particle
+		PartVector<long> inc_slot; //!< Slot of each particle
+		PartVector<long> inc_parts; //!< Particle in each slot
+		PartVector<long> inc_starts; //!< First slot of each box
+		PartVector<long> inc_ends; //!< Slot past the last particle of each box
+
+		bool ghosts; //!< Ghost copies of the boundary particles
+		//! Neighboring boxes, a halo box replacing each shifted image
+		std::vector< std::vector<long> > nbrs_ghost;
+		std::vector<long> halo_src; //!< Box copied in each halo box
+		//! Shift of the copy in each halo box
+		std::vector< std::array<double, DIM> > halo_shift;
+		PartsOfBoxes parts_of_halo; //!< Ghosts in each halo box
+		std::array<double *, DIM> ghost_pos; //!< Positions of the ghosts
+		long *ghost_owner; //!< Particle copied in each ghost
+		long n_ghosts; //!< Number of ghosts
 };
 
 /*! 
@@ -97,20 +274,203 @@ int mypow(const T a, const U b) {
  * \brief Constructor of boxes.
  *
  * Construct the boxes with which we will be able to classify the particles.
+ * The system may have a different length along each axis, in which case
+ * the number of boxes differs from one axis to the other.
  *
- * \param len Length of the system
+ * \param lens Lengths of the system along each axis
  * \param n_parts Number of particles
  * \param size Size of the box (default 1.0)
+ * \param fac Factor for the size of the boxes (default 1)
  */
 template<int DIM>
-Boxes<DIM>::Boxes(const double len, const long n_parts, const double size,
-		          const int fac) :
-		n_boxes_x(fac * std::floor(len / size)),
-		n_boxes(mypow(n_boxes_x, DIM)), len_box(len / n_boxes_x),
-		n_parts(n_parts), fac(fac) {
+Boxes<DIM>::Boxes(const std::array<double, DIM> &lens, const long n_parts,
+		          const double size, const int fac) :
+		lens(lens), n_parts(n_parts), fac(fac), sheared(false),
+		workers(nullptr), inc_every(0), inc_count(0), inc_valid(false),
+		ghosts(false), ghost_owner(nullptr), n_ghosts(0) {
+	periodic.fill(true);
+	n_boxes = 1;
+	for (int a = 0 ; a < DIM ; ++a) {
+		n_boxes_ax[a] = fac * (long) std::floor(lens[a] / size);
+		// A side shorter than a box would leave no box (and no pair)
+		assert(n_boxes_ax[a] >= 1);
+		len_box[a] = lens[a] / n_boxes_ax[a];
+		strides[a] = n_boxes;
+		n_boxes *= n_boxes_ax[a];
+	}
 	nbrs_pos.resize(n_boxes);
+	nbrs_shift.resize(n_boxes);
+	nbrs_ghost.resize(n_boxes);
+	computeNbrsPos();
+	ghost_pos.fill(nullptr);
+	reserveArena();
+}
+
+/*
+ * \brief Set the periodicity of the boxes along each axis.
+ *
+ * The boxes on both sides of a non-periodic axis (e.g. closed by walls)
+ * are no longer neighbors.
+ *
+ * \param per Periodicity along each axis
+ */
+template<int DIM>
+void Boxes<DIM>::setPeriodic(const std::array<bool, DIM> &per) {
+	periodic = per;
+	computeNbrsPos();
+}
+
+/*
+ * \brief Enable or disable the ghosts.
+ *
+ * With the ghosts, the particles of the boundary layer are copied
+ * at each update into halo boxes, at the position of their image.
+ * The boxes returned by getNbrsGhost() then form a non-periodic domain
+ * in which the distances are plain differences, and the forces exerted
+ * on the ghosts have to be added to their owners (see getGhostOwner()).
+ * The ghosts are not compatible with the Lees-Edwards boundary conditions.
+ *
+ * \param gh True to enable the ghosts
+ */
+template<int DIM>
+void Boxes<DIM>::setGhosts(const bool gh) {
+	ghosts = gh;
 	computeNbrsPos();
-	parts_of_box.resize(n_boxes);
+	reserveArena();
+}
+
+/*
+ * \brief Reserve the memory of the classification in the arena.
+ *
+ * The number of ghosts is estimated from the average occupancy of the boxes
+ * (twice as many to account for the fluctuations).
+ */
+template<int DIM>
+void Boxes<DIM>::reserveArena() {
+	// Box of each particle, starts of the boxes, cursors, sorted particles
+	size_t bytes = (2 * n_parts + 2 * n_boxes + 1) * sizeof(long)
+	               + 4 * ARENA_ALIGN;
+	if (workers) {
+		// Sums of the slabs of boxes (parallel sort)
+		bytes += (workers->getNThreads() + 1) * sizeof(long) + ARENA_ALIGN;
+	}
+	if (ghosts) {
+		// Starts of the halos, indices, owners and positions of the ghosts
+		long n_halos = (long) halo_src.size();
+		long n_ghosts_est = 2 * n_halos * (n_parts / n_boxes + 1);
+		bytes += (n_halos + 1 + 2 * n_ghosts_est) * sizeof(long)
+		         + DIM * n_ghosts_est * sizeof(double)
+		         + (3 + DIM) * ARENA_ALIGN;
+	}
+	arena.reserve(bytes);
+}
+
+/*
+ * \brief Get the lower and upper corners of a box.
+ *
+ * \param k Index of the box
+ * \param lo Lower corner (output)
+ * \param hi Upper corner (output)
+ */
+template<int DIM>
+void Boxes<DIM>::getBoxBounds(const long k, std::array<double, DIM> &lo,
+		                      std::array<double, DIM> &hi) const {
+	long i = k;
+	for (int a = DIM-1 ; a >= 0 ; --a) {
+		long c = i / strides[a];
+		i -= strides[a] * c;
+		lo[a] = c * len_box[a];
+		hi[a] = (c + 1) * len_box[a];
+	}
+}
+
+/*
+ * \brief Set the Lees-Edwards offset of the images along y.
+ *
+ * The image of the system above (resp. below) is shifted by offset
+ * (resp. -offset) along x. The boxes of the top rows and the boxes
+ * of the bottom rows are then no longer neighbors in a fixed way: at each
+ * call, the neighbors across the boundary are recomputed for the boxes
+ * of the top rows (only), which costs O(number of boxes along x).
+ *
+ * \param offset Offset of the upper image along x
+ */
+template<>
+inline void Boxes<2>::setShearOffset(const double offset) {
+	const long nx = n_boxes_ax[0], ny = n_boxes_ax[1];
+	if (!sheared) {
+		// The neighbors across the boundary along y are removed
+		sheared = true;
+		periodic[1] = false;
+		computeNbrsPos();
+		n_nbrs_static.resize(n_boxes);
+		for (long k = 0 ; k < n_boxes ; ++k) {
+			n_nbrs_static[k] = nbrs_pos[k].size();
+		}
+	}
+
+	// Shift of the upper image in number of boxes
+	const long s = (long) std::floor(offset / len_box[0]);
+	for (long y = std::max(0l, ny - fac) ; y < ny ; ++y) {
+		for (long x = 0 ; x < nx ; ++x) {
+			const long k = x + nx * y;
+			nbrs_pos[k].resize(n_nbrs_static[k]);
+			nbrs_shift[k].resize(n_nbrs_static[k]);
+			// Rows of the upper image which are close enough
+			for (long y2 = 0 ; y2 <= y + fac - ny ; ++y2) {
+				// One more box because the shift is not an integer
+				for (long d = -fac - 1 ; d <= fac ; ++d) {
+					long x2_raw = x - s + d;
+					long x2 = (x2_raw % nx + nx) % nx;
+					nbrs_pos[k].push_back(x2 + nx * y2);
+					// Image of the box in the upper image
+					nbrs_shift[k].push_back(
+						{offset + lens[0] * ((x2_raw - x2) / nx), lens[1]});
+				}
+			}
+		}
+	}
+}
+
+/*
+ * \brief Box of a particle.
+ *
+ * \param pos Positions of the particles
+ * \param i Index of the particle
+ * \return Index of the box
+ */
+template<int DIM>
+inline long Boxes<DIM>::boxOf(const std::array<PartVector<double>, DIM> &pos,
+                              const long i) const {
+	long box = 0;
+	for (int a = 0 ; a < DIM ; a++) {
+		//long ba = (long) std::floor((*pos)[i][a] / len_box);
+		// Round towards 0 (a position just below the length
+		// of the box can be rounded up to the last edge)
+		long ba = std::min((long) (pos[a][i] / len_box[a]),
+		                   n_boxes_ax[a] - 1);
+		box += strides[a] * ba;
+	}
+	return box;
+}
+
+/*
+ * \brief Box of a particle.
+ *
+ * Specialization for d = 2 (unrolls the loop over the axes).
+ *
+ * \param pos Positions of the particles
+ * \param i Index of the particle
+ * \return Index of the box
+ */
+template<>
+inline long Boxes<2>::boxOf(const std::array<PartVector<double>, 2> &pos,
+                            const long i) const {
+	// Round towards 0 (a position just below the length of the box
+	// can be rounded up to the last edge)
+	long bx = std::min((long) (pos[0][i] / len_box[0]), n_boxes_ax[0] - 1);
+	long by = std::min((long) (pos[1][i] / len_box[1]), n_boxes_ax[1] - 1);
+	return bx + n_boxes_ax[0] * by;
 }
 
 /*
@@ -121,48 +481,246 @@ Boxes<DIM>::Boxes(const double len, const long n_parts, const double size,
  * \param pos Positions of the particles
  */
 template<int DIM>
-inline void Boxes<DIM>::update(const std::array<std::vector<double>, DIM> &pos) {
-    for (long i=0 ; i < n_boxes ; ++i) {
-		parts_of_box[i].clear();
+void Boxes<DIM>::update(const std::array<PartVector<double>, DIM> &pos) {
+	// Free the previous classification
+	arena.reset();
+	long *box_of = arena.alloc<long>(n_parts);
+
+	if (inc_every > 0) {
+		OMP_PRAGMA(omp parallel for simd schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			box_of[i] = boxOf(pos, i);
+		}
+		updateIncremental(box_of);
+	} else if (workers && workers->getNThreads() > 1) {
+		sortParallel(pos, box_of);
+	} else {
+		OMP_PRAGMA(omp parallel for simd schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			box_of[i] = boxOf(pos, i);
+		}
+		sortSerial(box_of);
 	}
 
-    for (long i=0 ; i < n_parts ; ++i) {
-        long box = 0;
-        for (int a = 0 ; a < DIM ; a++) {
-			//long ba = (long) std::floor((*pos)[i][a] / len_box);
-			// Round towards 0
-			long ba = (long) (pos[a][i] / len_box);
-            box += mypow(n_boxes_x, a) * ba;
-        }
+	if (ghosts) {
+		fillGhosts(pos);
+	}
+}
 
-		parts_of_box[box].push_back(i);
+/*
+ * \brief Sort the particles by box (counting sort).
+ *
+ * The sort is stable: the particles of a box are in increasing order.
+ * All the arrays are taken from the arena: they remain valid
+ * until the next update.
+ *
+ * \param box_of Box of each particle
+ */
+template<int DIM>
+void Boxes<DIM>::sortSerial(const long *box_of) {
+	long *starts = arena.alloc<long>(n_boxes + 1);
+	long *cursor = arena.alloc<long>(n_boxes);
+	long *parts = arena.alloc<long>(n_parts);
+
+	std::fill(starts, starts + n_boxes + 1, 0);
+	for (long i = 0 ; i < n_parts ; ++i) {
+		++starts[box_of[i] + 1];
+	}
+	for (long k = 0 ; k < n_boxes ; ++k) {
+		starts[k+1] += starts[k];
+		cursor[k] = starts[k];
+	}
+	for (long i = 0 ; i < n_parts ; ++i) {
+		parts[cursor[box_of[i]]++] = i;
 	}
+	parts_of_box.set(parts, starts);
 }
 
 /*
- * \brief Classify the particles at given positions in the boxes.
- * 
- * Specialization for d = 2 (removes the call to mypow).
- * Warning: the positions should be consistent with the Boxes object!
+ * \brief Sort the particles by box with several threads (counting sort).
+ *
+ * Each thread takes a slab of particles, finds their boxes and counts
+ * them with atomic increments. The starts of the boxes are a prefix sum,
+ * done in parallel over slabs of boxes, and the particles are scattered
+ * with the counters as atomic cursors. No lock is taken, but the order
+ * within a box then depends on the timing of the threads: the boxes are
+ * sorted at the end, which gives the same result as the serial sort.
  *
  * \param pos Positions of the particles
+ * \param box_of Box of each particle (output)
  */
+template<int DIM>
+void Boxes<DIM>::sortParallel(const std::array<PartVector<double>, DIM> &pos,
+                              long *box_of) {
+	const int n_threads = workers->getNThreads();
+	long *starts = arena.alloc<long>(n_boxes + 1);
+	std::atomic<long> *counts = arena.alloc< std::atomic<long> >(n_boxes);
+	long *parts = arena.alloc<long>(n_parts);
+	long *slab_sums = arena.alloc<long>(n_threads + 1);
 
-template<>
-inline void Boxes<2>::update(const std::array<std::vector<double>, 2> &pos) {
-    for (long i=0 ; i < n_boxes ; ++i) {
-		parts_of_box[i].clear();
+	// Boxes of the particles and number of particles in each box
+	auto clear = [&](const int t) {
+		const long k_end = workers->splitBegin(n_boxes, t + 1);
+		for (long k = workers->splitBegin(n_boxes, t) ; k < k_end ; ++k) {
+			::new(static_cast<void *>(counts + k)) std::atomic<long>(0);
+		}
+	};
+	workers->run(clear);
+	auto count = [&](const int t) {
+		const long i_end = workers->splitBegin(n_parts, t + 1);
+		for (long i = workers->splitBegin(n_parts, t) ; i < i_end ; ++i) {
+			box_of[i] = boxOf(pos, i);
+			counts[box_of[i]].fetch_add(1, std::memory_order_relaxed);
+		}
+	};
+	workers->run(count);
+
+	// Prefix sum: total of each slab of boxes, then starts of the boxes,
+	// the counters becoming the cursors
+	auto sum = [&](const int t) {
+		const long k_end = workers->splitBegin(n_boxes, t + 1);
+		long s = 0;
+		for (long k = workers->splitBegin(n_boxes, t) ; k < k_end ; ++k) {
+			s += counts[k].load(std::memory_order_relaxed);
+		}
+		slab_sums[t+1] = s;
+	};
+	workers->run(sum);
+	slab_sums[0] = 0;
+	for (int t = 0 ; t < n_threads ; ++t) {
+		slab_sums[t+1] += slab_sums[t];
+	}
+	auto scan = [&](const int t) {
+		const long k_end = workers->splitBegin(n_boxes, t + 1);
+		long s = slab_sums[t];
+		for (long k = workers->splitBegin(n_boxes, t) ; k < k_end ; ++k) {
+			starts[k] = s;
+			s += counts[k].load(std::memory_order_relaxed);
+			counts[k].store(starts[k], std::memory_order_relaxed);
+		}
+	};
+	workers->run(scan);
+	starts[n_boxes] = n_parts;
+
+	// Scatter the particles, then restore the order within the boxes
+	auto scatter = [&](const int t) {
+		const long i_end = workers->splitBegin(n_parts, t + 1);
+		for (long i = workers->splitBegin(n_parts, t) ; i < i_end ; ++i) {
+			parts[counts[box_of[i]].fetch_add(1, std::memory_order_relaxed)]
+				= i;
+		}
+	};
+	workers->run(scatter);
+	auto order = [&](const int t) {
+		const long k_end = workers->splitBegin(n_boxes, t + 1);
+		for (long k = workers->splitBegin(n_boxes, t) ; k < k_end ; ++k) {
+			std::sort(parts + starts[k], parts + starts[k+1]);
+		}
+	};
+	workers->run(order);
+
+	parts_of_box.set(parts, starts);
+}
+
+/*
+ * \brief Enable the incremental updates of the classification.
+ *
+ * Between two steps only a few particles change box: instead of sorting
+ * all the particles again, each box keeps some free slots and only the
+ * particles whose box has changed are moved. The classification is
+ * rebuilt from scratch periodically (which restores the order of the
+ * particles within the boxes) or when a box is full.
+ *
+ * \param every Number of updates between the full rebuilds
+ * (0 to rebuild at each update)
+ */
+template<int DIM>
+void Boxes<DIM>::setIncremental(const long every) {
+	inc_every = every;
+	inc_valid = false;
+	if (inc_every > 0) {
+		inc_box.resize(n_parts);
+		inc_slot.resize(n_parts);
+		// Free slots of rebuildIncremental()
+		inc_parts.resize(n_parts + n_parts / 2 + 2 * n_boxes);
+		inc_starts.resize(n_boxes + 1);
+		inc_ends.resize(n_boxes);
+	} else {
+		PartVector<long>().swap(inc_box);
+		PartVector<long>().swap(inc_slot);
+		PartVector<long>().swap(inc_parts);
+		PartVector<long>().swap(inc_starts);
+		PartVector<long>().swap(inc_ends);
+	}
+}
+
+/*
+ * \brief Move the particles which changed box.
+ *
+ * A particle leaving a box is replaced by the last particle of the box,
+ * and is appended to its new box. The cost is proportional to the number
+ * of particles changing box, except for the full rebuilds.
+ *
+ * \param box_of Box of each particle
+ */
+template<int DIM>
+void Boxes<DIM>::updateIncremental(const long *box_of) {
+	if (!inc_valid || ++inc_count >= inc_every) {
+		rebuildIncremental(box_of);
+		return;
 	}
 
-    for (long i=0 ; i < n_parts ; ++i) {
-        long box = 0;
-		// Round towards 0
-		long bx = (long) (pos[0][i] / len_box);
-		long by = (long) (pos[1][i] / len_box);
-		box = bx + n_boxes_x * by;
+	for (long i = 0 ; i < n_parts ; ++i) {
+		const long b = box_of[i];
+		if (b == inc_box[i]) {
+			continue;
+		}
+		if (inc_ends[b] == inc_starts[b+1]) {
+			// No free slot left in the new box
+			rebuildIncremental(box_of);
+			return;
+		}
+		const long a = inc_box[i];
+		const long last = inc_parts[--inc_ends[a]];
+		inc_parts[inc_slot[i]] = last;
+		inc_slot[last] = inc_slot[i];
 
-		parts_of_box[box].push_back(i);
+		inc_parts[inc_ends[b]] = i;
+		inc_slot[i] = inc_ends[b]++;
+		inc_box[i] = b;
 	}
+	parts_of_box.set(inc_parts.data(), inc_starts.data(), inc_ends.data());
+}
+
+/*
+ * \brief Sort the particles by box leaving free slots after each box.
+ *
+ * A box of n particles gets n / 2 + 2 free slots, which is enough
+ * for the fluctuations of the occupancy between the rebuilds.
+ *
+ * \param box_of Box of each particle
+ */
+template<int DIM>
+void Boxes<DIM>::rebuildIncremental(const long *box_of) {
+	std::fill(inc_ends.begin(), inc_ends.end(), 0);
+	for (long i = 0 ; i < n_parts ; ++i) {
+		++inc_ends[box_of[i]];
+	}
+	inc_starts[0] = 0;
+	for (long k = 0 ; k < n_boxes ; ++k) {
+		const long n = inc_ends[k];
+		inc_starts[k+1] = inc_starts[k] + n + n / 2 + 2;
+		inc_ends[k] = inc_starts[k];
+	}
+	for (long i = 0 ; i < n_parts ; ++i) {
+		const long b = box_of[i];
+		inc_parts[inc_ends[b]] = i;
+		inc_slot[i] = inc_ends[b]++;
+		inc_box[i] = b;
+	}
+	inc_count = 0;
+	inc_valid = true;
+	parts_of_box.set(inc_parts.data(), inc_starts.data(), inc_ends.data());
 }
 
 /*
@@ -173,55 +731,102 @@ inline void Boxes<2>::update(const std::array<std::vector<double>, 2> &pos) {
  */
 template<int DIM>
 void Boxes<DIM>::computeNbrsPos() {
-	std::array<double, DIM> pows_n_boxes_x;	
-	for (int a = 0 ; a < DIM ; ++a) {
-		pows_n_boxes_x[a] = mypow(n_boxes_x, a);
+	// Offsets of the neighbors along the 'positive' direction
+	std::vector< std::array<long, DIM> > offsets;
+	std::array<long, DIM> o;
+
+	// First dimension (half space)
+	for (int b = 0 ; b < fac ; ++b) {
+		o.fill(0);
+		o[0] = 1 + b;
+		offsets.push_back(o);
+
+		// Second dimension for k + d (both sides)
+		for (int c = 0 ; c < fac ; ++c) {
+			o[1] = c + 1;
+			offsets.push_back(o);
+			o[1] = -c - 1;
+			offsets.push_back(o);
+		}
+	}
+	// Second dimension for k (only half space)
+	for (int b = 0 ; b < fac ; ++b) {
+		o.fill(0);
+		o[1] = b + 1;
+		offsets.push_back(o);
+	}
+	// Other dimensions (both sides, but only half space for k)
+	for (int a = 2 ; a < DIM ; ++a) {
+		std::vector< std::array<long, DIM> > tmp = offsets;
+
+		for (int c = 0 ; c < fac ; ++c) {
+			for (auto x : tmp) {
+				x[a] = c + 1;
+				offsets.push_back(x);
+				x[a] = -c - 1;
+				offsets.push_back(x);
+			}
+			o.fill(0);
+			o[a] = c + 1;
+			offsets.push_back(o);
+		}
 	}
+
 	std::array<long, DIM> coos;
+	std::array<double, DIM> shift;
+
+	// Halo box of each (box, image) pair
+	std::map< std::pair<long, long>, long > halo_of;
+	halo_src.clear();
+	halo_shift.clear();
 
-	// for all the particles
+	// for all the boxes
 	for (long k = 0 ; k < n_boxes ; ++k) {
 		// Coordinates of the box
 		long i = k;
 		for (int a = DIM-1 ; a >= 0 ; --a) {
-			coos[a] = i / pows_n_boxes_x[a];
-			i -= pows_n_boxes_x[a] * coos[a];
+			coos[a] = i / strides[a];
+			i -= strides[a] * coos[a];
 		}
 
 		nbrs_pos[k].clear();
+		nbrs_shift[k].clear();
+		nbrs_ghost[k].clear();
 		// nbrs_pos[k].push_back(k); // We no longer include the box itself
 
-		// First dimension (half space)
-		for (int b = 0 ; b < fac ; ++b) {
-			long d = (coos[0] + 1 + b) % n_boxes_x - coos[0];
-			nbrs_pos[k].push_back(k + d);
-
-			// Second dimension for k + d (both sides)
-			for (int c = 0 ; c < fac ; ++c) {
-				long e1 = (coos[1] + c + 1) % n_boxes_x - coos[1];
-				long e2 = (coos[1] - c - 1 + n_boxes_x) % n_boxes_x - coos[1];
-				nbrs_pos[k].push_back(k + d + n_boxes_x * e1);
-				nbrs_pos[k].push_back(k + d + n_boxes_x * e2);
+		for (const auto &x : offsets) {
+			long nbr = 0;
+			long image = 0; // Index of the image in base 3
+			bool exists = true;
+			for (int a = 0 ; a < DIM ; ++a) {
+				long c = coos[a] + x[a];
+				// Number of times we cross the boundary (-1, 0 or 1)
+				long w = (c >= n_boxes_ax[a]) - (c < 0);
+				// Neighbors across a non-periodic boundary do not exist
+				exists = exists && (periodic[a] || w == 0);
+				nbr += strides[a] * (c - w * n_boxes_ax[a]);
+				shift[a] = w * lens[a];
+				image = 3 * image + w + 1;
 			}
-		}
-		// Second dimension for k (only half space)
-		for (int b = 0 ; b < fac ; ++b) {
-			long d = (coos[1] + b + 1) % n_boxes_x - coos[1];
-			nbrs_pos[k].push_back(k + n_boxes_x * d);
-		}
-
-		// Other dimensions (both sides)
-		for (int a = 2 ; a < DIM ; ++a) {
-			std::vector<long> tmp = nbrs_pos[k];
-			tmp.push_back(k);
+			if (!exists) {
+				continue;
+			}
+			nbrs_pos[k].push_back(nbr);
+			nbrs_shift[k].push_back(shift);
 
-			for (int c = 0 ; c < fac ; ++c) {
-				long e1 = (coos[a] + c + 1) % n_boxes_x - coos[a];
-				long e2 = (coos[a] - c - 1 + n_boxes_x) % n_boxes_x - coos[a];
-				for (long x : tmp) {
-					nbrs_pos[k].push_back(x + pows_n_boxes_x[a] * e1);
-					nbrs_pos[k].push_back(x + pows_n_boxes_x[a] * e2);
+			if (ghosts) {
+				// The image of a box across the boundary becomes a halo box
+				long h = nbr;
+				if (image != (mypow(3, DIM) - 1) / 2) {
+					auto res = halo_of.insert({{nbr, image},
+					                           (long) halo_src.size()});
+					if (res.second) {
+						halo_src.push_back(nbr);
+						halo_shift.push_back(shift);
+					}
+					h = n_boxes + res.first->second;
 				}
+				nbrs_ghost[k].push_back(h);
 			}
 		}
 
@@ -233,4 +838,43 @@ void Boxes<DIM>::computeNbrsPos() {
 	}
 }
 
+/*
+ * \brief Copy the particles of the boundary layer into the halo boxes.
+ *
+ * This is done at each update when the ghosts are enabled.
+ * The ghosts of halo box h are numbered consecutively, and their arrays
+ * are taken from the arena as the particles of the boxes.
+ *
+ * \param pos Positions of the particles
+ */
+template<int DIM>
+void Boxes<DIM>::fillGhosts(const std::array<PartVector<double>, DIM> &pos) {
+	const long n_halos = (long) halo_src.size();
+	long *starts = arena.alloc<long>(n_halos + 1);
+	starts[0] = 0;
+	for (long h = 0 ; h < n_halos ; ++h) {
+		starts[h+1] = starts[h] + parts_of_box[halo_src[h]].size();
+	}
+	n_ghosts = starts[n_halos];
+
+	long *ids = arena.alloc<long>(n_ghosts);
+	ghost_owner = arena.alloc<long>(n_ghosts);
+	for (int a = 0 ; a < DIM ; ++a) {
+		ghost_pos[a] = arena.alloc<double>(n_ghosts);
+	}
+
+	long g = 0;
+	for (long h = 0 ; h < n_halos ; ++h) {
+		for (long i : parts_of_box[halo_src[h]]) {
+			ids[g] = g;
+			ghost_owner[g] = i;
+			for (int a = 0 ; a < DIM ; ++a) {
+				ghost_pos[a][g] = pos[a][i] + halo_shift[h][a];
+			}
+			++g;
+		}
+	}
+	parts_of_halo.set(ids, starts);
+}
+
 #endif // ACTIVEBROWNIAN_BOXES_H_
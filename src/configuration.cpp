@@ -0,0 +1,257 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file configuration.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Saved configurations of a 2d system
+ *
+ * A configuration is read from a hdf5 file written by saveConfiguration
+ * (datasets pos_x, pos_y and angles, attributes len_x and len_y),
+ * or from a frame of a trajectory, raw or compressed.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "H5Cpp.h"
+#include "configuration.h"
+#include "trajectory.h"
+#include "trajCodec.h"
+
+// Largest relative difference between the lengths of the replicated box
+// and of the target box (the positions are rescaled)
+#define REPLICATE_TOLERANCE 1e-3
+
+/*!
+ * \brief Save the configuration of a state to a hdf5 file.
+ *
+ * \param fname Name of the file
+ * \param state State of the system
+ * \param len_x Length of the box along x
+ * \param len_y Length of the box along y
+ * \return False if the file could not be written
+ */
+bool saveConfiguration(const std::string &fname, const State *state,
+                       const double len_x, const double len_y) {
+	try {
+		H5::H5File file(fname, H5F_ACC_TRUNC);
+
+		H5::DataSpace default_ds;
+		H5::Attribute a_len_x = file.createAttribute(
+				"len_x", H5::PredType::NATIVE_DOUBLE, default_ds);
+		a_len_x.write(H5::PredType::NATIVE_DOUBLE, &len_x);
+		H5::Attribute a_len_y = file.createAttribute(
+				"len_y", H5::PredType::NATIVE_DOUBLE, default_ds);
+		a_len_y.write(H5::PredType::NATIVE_DOUBLE, &len_y);
+
+		hsize_t n = state->getPosX().size();
+		H5::DataSpace dataspace(1, &n);
+		const char *names[3] = {"pos_x", "pos_y", "angles"};
+		const double *data[3] = {state->getPosX().data(),
+		                         state->getPosY().data(),
+								 state->getAngles().data()};
+		for (int f = 0 ; f < 3 ; ++f) {
+			H5::DataSet dataset = file.createDataSet(
+					names[f], H5::PredType::NATIVE_DOUBLE, dataspace);
+			dataset.write(data[f], H5::PredType::NATIVE_DOUBLE);
+		}
+	} catch (H5::Exception& err) {
+		err.printError();
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * \brief Load a configuration saved by saveConfiguration.
+ *
+ * \param fname Name of the file
+ * \param conf Configuration (output)
+ * \return False if the file could not be read
+ */
+static bool loadH5(const std::string &fname, Configuration &conf) {
+	try {
+		H5::H5File file(fname, H5F_ACC_RDONLY);
+		file.openAttribute("len_x").read(H5::PredType::NATIVE_DOUBLE,
+		                                 &conf.len_x);
+		file.openAttribute("len_y").read(H5::PredType::NATIVE_DOUBLE,
+		                                 &conf.len_y);
+
+		const char *names[3] = {"pos_x", "pos_y", "angles"};
+		std::vector<double> *data[3] = {&conf.pos_x, &conf.pos_y,
+		                                &conf.angles};
+		for (int f = 0 ; f < 3 ; ++f) {
+			H5::DataSet dataset = file.openDataSet(names[f]);
+			data[f]->resize(dataset.getSpace().getSimpleExtentNpoints());
+			dataset.read(data[f]->data(), H5::PredType::NATIVE_DOUBLE);
+		}
+	} catch (H5::Exception& err) {
+		err.printError();
+		return false;
+	}
+	if (conf.pos_y.size() != conf.pos_x.size()
+		|| conf.angles.size() != conf.pos_x.size()) {
+		std::cerr << "Error: the datasets of " << fname
+			<< " have different sizes" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * \brief Check the frame of a trajectory and count it from the start.
+ *
+ * \param fname Name of the file
+ * \param dim Dimension of the trajectory
+ * \param n_frames Number of frames
+ * \param frame Frame (negative: from the end), updated
+ * \return False if the frame does not exist
+ */
+static bool checkFrame(const std::string &fname, const int dim,
+                       const long n_frames, long &frame) {
+	if (dim != 2) {
+		std::cerr << "Error: " << fname << " is not a 2d trajectory"
+			<< std::endl;
+		return false;
+	}
+	if (frame < 0) {
+		frame += n_frames;
+	}
+	if (frame < 0 || frame >= n_frames) {
+		std::cerr << "Error: no such frame in " << fname << " ("
+			<< n_frames << " frames)" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * \brief Load a configuration from a hdf5 file or a frame of a trajectory.
+ *
+ * The format is found from the beginning of the file.
+ *
+ * \param fname Name of the file
+ * \param frame Frame of the trajectory (negative: from the end)
+ * \param conf Configuration (output)
+ * \return False if the file could not be read
+ */
+bool loadConfiguration(const std::string &fname, long frame,
+                       Configuration &conf) {
+	char magic[8] = {0};
+	{
+		std::ifstream file(fname, std::ios::binary);
+		if (!file.good()) {
+			std::cerr << "Error: cannot open " << fname << std::endl;
+			return false;
+		}
+		file.read(magic, 8);
+	}
+
+	if (std::memcmp(magic, "\x89HDF\r\n\x1a\n", 8) == 0) {
+		return loadH5(fname, conf);
+	} else if (std::memcmp(magic, CODEC_MAGIC, 8) == 0) {
+		TrajDecoder traj(fname);
+		if (!traj.isOpen() || !checkFrame(fname, traj.getDim(),
+		                                  traj.getNFrames(), frame)) {
+			return false;
+		}
+		std::vector<double> values;
+		if (!traj.read(frame, values)) {
+			std::cerr << "Error: cannot decode frame " << frame << " of "
+				<< fname << std::endl;
+			return false;
+		}
+		const long n = traj.getNParts();
+		conf.len_x = traj.getLens()[0];
+		conf.len_y = traj.getLens()[1];
+		conf.pos_x.assign(values.begin(), values.begin() + n);
+		conf.pos_y.assign(values.begin() + n, values.begin() + 2 * n);
+		conf.angles.assign(values.begin() + 2 * n, values.begin() + 3 * n);
+	} else {
+		TrajReader traj(fname);
+		if (!traj.isOpen() || !checkFrame(fname, traj.getDim(),
+		                                  traj.getNFrames(), frame)) {
+			return false;
+		}
+		const long n = traj.getNParts();
+		conf.len_x = traj.getLens()[0];
+		conf.len_y = traj.getLens()[1];
+		std::vector<double> *data[3] = {&conf.pos_x, &conf.pos_y,
+		                                &conf.angles};
+		for (int f = 0 ; f < 3 ; ++f) {
+			const float *field = traj.getField(frame, f);
+			data[f]->assign(field, field + n);
+		}
+	}
+	return true;
+}
+
+/*!
+ * \brief Replicate a configuration periodically to fill a larger box.
+ *
+ * The box of the configuration is repeated n_x times along x
+ * and n_y times along y, and the positions are rescaled to the exact
+ * lengths of the target box (which should differ only slightly).
+ *
+ * \param conf Configuration
+ * \param len_x Length of the target box along x
+ * \param len_y Length of the target box along y
+ * \param n_parts Number of particles of the target system
+ * \param res Replicated configuration (output)
+ * \param n_x Number of copies along x (output)
+ * \param n_y Number of copies along y (output)
+ * \return False if the target system is not made of copies of conf
+ */
+bool replicateConfiguration(const Configuration &conf, const double len_x,
+                            const double len_y, const long n_parts,
+							Configuration &res, int &n_x, int &n_y) {
+	const long n = conf.pos_x.size();
+	n_x = std::max(1L, std::lround(len_x / conf.len_x));
+	n_y = std::max(1L, std::lround(len_y / conf.len_y));
+	if (n * n_x * n_y != n_parts
+		|| std::abs(n_x * conf.len_x - len_x) > REPLICATE_TOLERANCE * len_x
+		|| std::abs(n_y * conf.len_y - len_y) > REPLICATE_TOLERANCE * len_y) {
+		std::cerr << "Error: the configuration (" << n << " particles in "
+			<< conf.len_x << " x " << conf.len_y << ") cannot be replicated "
+			"into " << n_parts << " particles in " << len_x << " x " << len_y
+			<< std::endl;
+		return false;
+	}
+
+	const double scal_x = len_x / (n_x * conf.len_x);
+	const double scal_y = len_y / (n_y * conf.len_y);
+	res.len_x = len_x;
+	res.len_y = len_y;
+	res.pos_x.resize(n_parts);
+	res.pos_y.resize(n_parts);
+	res.angles.resize(n_parts);
+	long i = 0;
+	for (int kx = 0 ; kx < n_x ; ++kx) {
+		for (int ky = 0 ; ky < n_y ; ++ky) {
+			for (long j = 0 ; j < n ; ++j, ++i) {
+				res.pos_x[i] = (conf.pos_x[j] + kx * conf.len_x) * scal_x;
+				res.pos_y[i] = (conf.pos_y[j] + ky * conf.len_y) * scal_y;
+				res.angles[i] = conf.angles[j];
+			}
+		}
+	}
+	return true;
+}
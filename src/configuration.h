@@ -0,0 +1,57 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file configuration.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Saved configurations of a 2d system
+ *
+ * Header file for configuration.cpp.
+ * It defines the structure Configuration and the functions to save,
+ * load and replicate it.
+ */
+
+#ifndef ACTIVEBROWNIAN_CONFIGURATION_H_
+#define ACTIVEBROWNIAN_CONFIGURATION_H_
+
+#include <string>
+#include <vector>
+#include "state.h"
+
+//! Positions and orientations of the particles of a 2d system
+struct Configuration {
+	double len_x; //!< Length of the box along x
+	double len_y; //!< Length of the box along y
+	std::vector<double> pos_x; //!< Positions along x
+	std::vector<double> pos_y; //!< Positions along y
+	std::vector<double> angles; //!< Orientations
+};
+
+//! Save the configuration of a state to a hdf5 file
+bool saveConfiguration(const std::string &fname, const State *state,
+                       const double len_x, const double len_y);
+//! Load a configuration from a hdf5 file or a frame of a trajectory
+bool loadConfiguration(const std::string &fname, long frame,
+                       Configuration &conf);
+//! Replicate a configuration periodically to fill a larger box
+bool replicateConfiguration(const Configuration &conf, const double len_x,
+                            const double len_y, const long n_parts,
+							Configuration &res, int &n_x, int &n_y);
+
+#endif // ACTIVEBROWNIAN_CONFIGURATION_H_
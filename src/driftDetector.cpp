@@ -0,0 +1,122 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file driftDetector.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Detection of the end of the thermalization
+ *
+ * Implementation of the methods of the class DriftDetector.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "driftDetector.h"
+
+/*!
+ * \brief Constructor of DriftDetector
+ *
+ * \param _n_obs Number of observables
+ * \param _block Number of samples in a block
+ * \param _tol Tolerance on the relative drift
+ */
+DriftDetector::DriftDetector(const int _n_obs, const long _block,
+                             const double _tol) :
+	n_obs(_n_obs), block(_block), tol(_tol), n_in_block(0), n_blocks(0),
+	current(_n_obs, 0.0), means(2 * DRIFT_HALF_WINDOW * _n_obs, 0.0),
+	abs_scales(_n_obs, 0.0), drift(std::numeric_limits<double>::infinity()),
+	significance(std::numeric_limits<double>::infinity()) {
+}
+
+/*!
+ * \brief Add a sample of the observables.
+ *
+ * \param values Values of the observables
+ * \return True if the observables have converged
+ */
+bool DriftDetector::add(const double *values) {
+	for (int k = 0 ; k < n_obs ; ++k) {
+		current[k] += values[k];
+	}
+	if (++n_in_block < block) {
+		return false;
+	}
+
+	// Block done: store its means in the ring
+	const long slot = n_blocks % (2 * DRIFT_HALF_WINDOW);
+	for (int k = 0 ; k < n_obs ; ++k) {
+		means[slot * n_obs + k] = current[k] / block;
+		current[k] = 0.0;
+	}
+	n_in_block = 0;
+	++n_blocks;
+
+	return n_blocks >= 2 * DRIFT_HALF_WINDOW && check();
+}
+
+/*!
+ * \brief Compare the two halves of the window.
+ *
+ * \return True if no observable drifts
+ */
+bool DriftDetector::check() {
+	const long w = DRIFT_HALF_WINDOW;
+	bool converged = true;
+	drift = 0.0;
+	significance = 0.0;
+	for (int k = 0 ; k < n_obs ; ++k) {
+		// Means and variances of the block means of each half,
+		// the oldest block being in the slot of the next one
+		double m[2] = {0.0, 0.0}, v[2] = {0.0, 0.0};
+		for (int h = 0 ; h < 2 ; ++h) {
+			for (long b = 0 ; b < w ; ++b) {
+				long slot = (n_blocks + h * w + b) % (2 * w);
+				m[h] += means[slot * n_obs + k];
+			}
+			m[h] /= w;
+			for (long b = 0 ; b < w ; ++b) {
+				long slot = (n_blocks + h * w + b) % (2 * w);
+				double d = means[slot * n_obs + k] - m[h];
+				v[h] += d * d;
+			}
+			v[h] /= w - 1;
+		}
+
+		double diff = std::abs(m[1] - m[0]);
+		double scale = (abs_scales[k] > 0.0) ? abs_scales[k]
+		                                     : std::abs(m[0] + m[1]) / 2;
+		double err = std::sqrt((v[0] + v[1]) / w);
+		if (scale > 0.0) {
+			drift = std::max(drift, diff / scale);
+		} else if (diff > 0.0) {
+			drift = std::numeric_limits<double>::infinity();
+		}
+		if (err > 0.0) {
+			significance = std::max(significance, diff / err);
+		} else if (diff > 0.0) {
+			significance = std::numeric_limits<double>::infinity();
+		}
+		// The drift should be both small and not significant
+		if (diff > tol * scale || diff > 2.0 * err) {
+			converged = false;
+		}
+	}
+	return converged;
+}
@@ -0,0 +1,87 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file driftDetector.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Detection of the end of the thermalization
+ *
+ * Header file for driftDetector.cpp.
+ * It defines the class DriftDetector.
+ */
+
+#ifndef ACTIVEBROWNIAN_DRIFTDETECTOR_H_
+#define ACTIVEBROWNIAN_DRIFTDETECTOR_H_
+
+#include <vector>
+
+// Number of blocks in each half of the window
+#define DRIFT_HALF_WINDOW 5
+
+/*!
+ * \brief Class detecting that some observables have stopped drifting
+ *
+ * The samples are averaged over blocks. The last 2 * DRIFT_HALF_WINDOW
+ * blocks form a window, and the observables have converged when,
+ * for each of them, the mean over the newer half of the window differs
+ * from the mean over the older half both by less than the tolerance
+ * and by less than twice the statistical error of the difference.
+ * The tolerance is relative to the mean, except for the observables
+ * whose mean is about zero, which are given an absolute scale.
+ */
+class DriftDetector {
+	public:
+		DriftDetector(const int _n_obs, const long _block,
+		              const double _tol);
+
+		//! Compare the drift of observable k to tol * s instead of
+		//! tol * |mean| (for an observable whose mean is about zero)
+		void setAbsolute(const int k, const double s) {
+			abs_scales[k] = s;
+		}
+		//! Add a sample of the observables, return true if converged
+		bool add(const double *values);
+		//! Largest drift over the last window, relative to the scales
+		double getDrift() const {
+			return drift;
+		}
+		//! Largest drift over the last window, in statistical errors
+		double getSignificance() const {
+			return significance;
+		}
+
+	private:
+		//! Check the drift over the window
+		bool check();
+
+		const int n_obs; //!< Number of observables
+		const long block; //!< Number of samples in a block
+		const double tol; //!< Tolerance on the relative drift
+		long n_in_block; //!< Number of samples in the current block
+		long n_blocks; //!< Number of blocks done
+		std::vector<double> current; //!< Sums over the current block
+		//! Means over the blocks of the window (ring, n_obs per block)
+		std::vector<double> means;
+		//! Absolute scales of the observables (0 for a relative tolerance)
+		std::vector<double> abs_scales;
+		double drift; //!< Largest drift relative to the scales
+		double significance; //!< Largest drift in statistical errors
+};
+
+#endif // ACTIVEBROWNIAN_DRIFTDETECTOR_H_
@@ -0,0 +1,88 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file externalField.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief External fields and spatially varying activity
+ *
+ * Implementation of the methods of the class ExternalField.
+*/
+
+#include <cmath>
+#include "state.h"
+#include "externalField.h"
+
+/*!
+ * \brief Constructor of ExternalField
+ *
+ * Tabulate the activity and the external force on the grid.
+ * The external force is the sum of gravity (along -y) and of a harmonic
+ * trap centered in the box.
+ *
+ * \param _len_x Length of the box along x
+ * \param _len_y Length of the box along y
+ * \param step Approximate spacing of the grid
+ * \param activity Average activity
+ * \param profile Profile of the activity
+ * \param activ_amp Relative amplitude of the modulation of the activity
+ * \param gravity Intensity of gravity
+ * \param trap Stiffness of the harmonic trap
+ */
+ExternalField::ExternalField(const double _len_x, const double _len_y,
+		                     const double step, const double activity,
+							 const ActivityProfile profile,
+							 const double activ_amp, const double gravity,
+							 const double trap) :
+	len_x(_len_x), len_y(_len_y) {
+	n_x = std::max(1l, (long) std::ceil(len_x / step));
+	n_y = std::max(1l, (long) std::ceil(len_y / step));
+	scal_x = n_x / len_x;
+	scal_y = n_y / len_y;
+	grid.resize(N_CHANNELS * n_x * n_y);
+
+	for (long j = 0 ; j < n_y ; ++j) {
+		for (long i = 0 ; i < n_x ; ++i) {
+			double x = i / scal_x;
+			double y = j / scal_y;
+			double *g = &grid[N_CHANNELS * (i + n_x * j)];
+
+			switch (profile) {
+				case ACTIV_SINE:
+					g[0] = activity * (1. + activ_amp
+							           * std::sin(2. * M_PI * x / len_x));
+					break;
+				case ACTIV_STEP:
+					g[0] = activity * (1. + (x < 0.5 * len_x ? activ_amp
+								                             : -activ_amp));
+					break;
+				default:
+					g[0] = activity;
+			}
+
+			// Harmonic trap: the distance to the center is periodized
+			double dx = x - 0.5 * len_x;
+			double dy = y - 0.5 * len_y;
+			pbcSym(dx, len_x);
+			pbcSym(dy, len_y);
+			g[1] = -trap * dx;
+			g[2] = -trap * dy - gravity;
+		}
+	}
+}
@@ -0,0 +1,100 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file externalField.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief External fields and spatially varying activity
+ *
+ * Header file for externalField.cpp.
+ * It defines the class ExternalField.
+ */
+
+#ifndef ACTIVEBROWNIAN_EXTERNALFIELD_H_
+#define ACTIVEBROWNIAN_EXTERNALFIELD_H_
+
+#include <vector>
+#include "gridCell.h"
+
+//! Profile of the activity
+enum ActivityProfile {
+	ACTIV_UNIFORM, //!< Uniform activity
+	ACTIV_SINE, //!< Sinusoidal modulation along x
+	ACTIV_STEP //!< Higher activity in the left half of the box
+};
+
+/*!
+ * \brief Class for the external fields in dimension 2
+ *
+ * The activity and the external force are tabulated once on a periodic
+ * grid. During the simulation they are obtained at the position of each
+ * particle by bilinear interpolation, which costs a gather of the
+ * 4 surrounding nodes whatever the complexity of the fields.
+ */
+class ExternalField {
+	public:
+		ExternalField(const double _len_x, const double _len_y,
+				      const double step, const double activity,
+					  const ActivityProfile profile, const double activ_amp,
+					  const double gravity, const double trap);
+
+		/*!
+		 * \brief Interpolate the fields at a given position
+		 *
+		 * \param x Position along x (between 0 and len_x)
+		 * \param y Position along y (between 0 and len_y)
+		 * \param act Activity (output)
+		 * \param fx External force along x (output)
+		 * \param fy External force along y (output)
+		 */
+		void sample(const double x, const double y, double &act,
+				    double &fx, double &fy) const {
+			double u = x * scal_x;
+			double v = y * scal_y;
+			long i0, i1, j0, j1;
+			gridCell(u, n_x, i0, i1);
+			gridCell(v, n_y, j0, j1);
+
+			const double *g00 = &grid[N_CHANNELS * (i0 + n_x * j0)];
+			const double *g10 = &grid[N_CHANNELS * (i1 + n_x * j0)];
+			const double *g01 = &grid[N_CHANNELS * (i0 + n_x * j1)];
+			const double *g11 = &grid[N_CHANNELS * (i1 + n_x * j1)];
+			double w00 = (1. - u) * (1. - v), w10 = u * (1. - v);
+			double w01 = (1. - u) * v, w11 = u * v;
+
+			act = w00 * g00[0] + w10 * g10[0] + w01 * g01[0] + w11 * g11[0];
+			fx = w00 * g00[1] + w10 * g10[1] + w01 * g01[1] + w11 * g11[1];
+			fy = w00 * g00[2] + w10 * g10[2] + w01 * g01[2] + w11 * g11[2];
+		}
+
+	private:
+		//! Number of channels per node (activity, force along x and y)
+		static const int N_CHANNELS = 3;
+
+		const double len_x; //!< Length of the box along x
+		const double len_y; //!< Length of the box along y
+		long n_x; //!< Number of nodes along x
+		long n_y; //!< Number of nodes along y
+		double scal_x; //!< Inverse of the grid spacing along x
+		double scal_y; //!< Inverse of the grid spacing along y
+		//! Values at the nodes, the channels of a node being contiguous
+		std::vector<double> grid;
+};
+
+#endif // ACTIVEBROWNIAN_EXTERNALFIELD_H_
@@ -0,0 +1,52 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file gridCell.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Cell of a periodic grid containing a point
+ *
+ * Shared by the interpolation of the external fields and the
+ * cloud-in-cell assignment of the long-range forces.
+ */
+
+#ifndef ACTIVEBROWNIAN_GRIDCELL_H_
+#define ACTIVEBROWNIAN_GRIDCELL_H_
+
+/*!
+ * \brief Find the cell of a periodic grid containing a point (one axis)
+ *
+ * The coordinate is in units of the grid spacing and between 0 and n:
+ * a point at n exactly (because of rounding) is the same as 0.
+ *
+ * \param u Coordinate, replaced by the position inside the cell
+ * (between 0 and 1)
+ * \param n Number of nodes
+ * \param i0 Node on the left of the point (output)
+ * \param i1 Node on the right of the point (output)
+ */
+inline void gridCell(double &u, const long n, long &i0, long &i1) {
+	i0 = (long) u;
+	// The position inside the cell before wrapping the node
+	u -= i0;
+	i0 -= (i0 >= n) * n;
+	i1 = (i0 + 1 == n) ? 0 : i0 + 1;
+}
+
+#endif // ACTIVEBROWNIAN_GRIDCELL_H_
@@ -0,0 +1,297 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file h5Chunks.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Parallel compression of chunked HDF5 datasets
+ *
+ * The chunks are compressed by the threads in the format of the HDF5
+ * filters and written as they are (direct chunk write), so that HDF5
+ * itself, which is not thread-safe, only copies bytes to the file.
+ * LZ4 and Zstandard are available when the libraries were found
+ * at compilation (USE_LZ4 and USE_ZSTD).
+ */
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <zlib.h>
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include "h5Chunks.h"
+
+// Number of chunks compressed by each thread between two writes
+#define CHUNKS_PER_THREAD 4
+
+/*!
+ * \brief Codec of a given name.
+ *
+ * \param name Name (none, deflate, lz4 or zstd)
+ * \param codec Codec (output)
+ * \return False if the codec is unknown or not built in
+ */
+bool parseH5Codec(const std::string &name, H5Codec &codec) {
+	if (name == "none") {
+		codec = H5_CODEC_NONE;
+	} else if (name == "deflate") {
+		codec = H5_CODEC_DEFLATE;
+#ifdef USE_LZ4
+	} else if (name == "lz4") {
+		codec = H5_CODEC_LZ4;
+#endif
+#ifdef USE_ZSTD
+	} else if (name == "zstd") {
+		codec = H5_CODEC_ZSTD;
+#endif
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/*!
+ * \brief Largest level of compression of a codec.
+ *
+ * \param codec Codec
+ * \return Largest level (-1 if the codec has no level)
+ */
+int maxH5Level(const H5Codec codec) {
+	switch (codec) {
+		case H5_CODEC_DEFLATE:
+			return 9;
+#ifdef USE_ZSTD
+		case H5_CODEC_ZSTD:
+			return ZSTD_maxCLevel();
+#endif
+		default:
+			return -1;
+	}
+}
+
+/*!
+ * \brief Largest size of a compressed chunk.
+ *
+ * \param codec Codec
+ * \param bytes Size of the chunk
+ * \return Size of the buffer needed by compressChunk
+ */
+static size_t chunkBound(const H5Codec codec, const size_t bytes) {
+	switch (codec) {
+		case H5_CODEC_DEFLATE:
+			return compressBound(bytes);
+#ifdef USE_LZ4
+		case H5_CODEC_LZ4:
+			return 16 + LZ4_compressBound(bytes);
+#endif
+#ifdef USE_ZSTD
+		case H5_CODEC_ZSTD:
+			return ZSTD_compressBound(bytes);
+#endif
+		default:
+			return bytes;
+	}
+}
+
+#ifdef USE_LZ4
+/*!
+ * \brief Write an integer in big-endian order (format of the LZ4 filter).
+ *
+ * \param out Output
+ * \param v Integer
+ * \param n Number of bytes
+ */
+static void putBigEndian(char *out, const uint64_t v, const int n) {
+	for (int k = 0 ; k < n ; ++k) {
+		out[k] = (char) (v >> (8 * (n - 1 - k)));
+	}
+}
+#endif
+
+/*!
+ * \brief Compress a chunk in the format of the HDF5 filter.
+ *
+ * \param codec Codec
+ * \param level Level of compression (deflate and zstd)
+ * \param src Chunk
+ * \param bytes Size of the chunk
+ * \param dst Compressed chunk (at least chunkBound bytes)
+ * \return Size of the compressed chunk (0 on failure)
+ */
+static size_t compressChunk(const H5Codec codec, const int level,
+                            const char *src, const size_t bytes, char *dst) {
+	switch (codec) {
+		case H5_CODEC_DEFLATE: {
+			uLongf len = compressBound(bytes);
+			if (compress2(reinterpret_cast<Bytef *>(dst), &len,
+			              reinterpret_cast<const Bytef *>(src), bytes,
+						  level) != Z_OK) {
+				return 0;
+			}
+			return len;
+		}
+#ifdef USE_LZ4
+		case H5_CODEC_LZ4: {
+			// Original size, size of the blocks (a single one),
+			// then size and data of each block
+			putBigEndian(dst, bytes, 8);
+			putBigEndian(dst + 8, bytes, 4);
+			int len = LZ4_compress_default(src, dst + 16, bytes,
+			                               LZ4_compressBound(bytes));
+			if (len <= 0 || (size_t) len >= bytes) {
+				// Stored uncompressed
+				std::memcpy(dst + 16, src, bytes);
+				len = bytes;
+			}
+			putBigEndian(dst + 12, len, 4);
+			return 16 + len;
+		}
+#endif
+#ifdef USE_ZSTD
+		case H5_CODEC_ZSTD: {
+			size_t len = ZSTD_compress(dst, ZSTD_compressBound(bytes), src,
+			                           bytes, level);
+			return ZSTD_isError(len) ? 0 : len;
+		}
+#endif
+		default:
+			std::memcpy(dst, src, bytes);
+			return bytes;
+	}
+}
+
+/*!
+ * \brief Write a chunked dataset of long long.
+ *
+ * The chunks are gathered (the edge ones padded with zeros) and compressed
+ * by the threads, a few per thread at a time, and written in order
+ * by the calling thread.
+ *
+ * \param file File
+ * \param name Name of the dataset
+ * \param ndim Number of dimensions (at most 3)
+ * \param dims Dimensions of the data
+ * \param chunk_dims Dimensions of a chunk
+ * \param data Data (row-major order)
+ * \param codec Codec
+ * \param level Level of compression (deflate and zstd)
+ * \param workers Threads compressing the chunks (nullptr for one thread)
+ * \return Dataset
+ */
+H5::DataSet writeChunked(H5::H5File &file, const std::string &name,
+                         const int ndim, const hsize_t *dims,
+						 const hsize_t *chunk_dims, const long long *data,
+						 const H5Codec codec, const int level,
+						 Workers *workers) {
+	H5::DSetCreatPropList plist;
+	plist.setChunk(ndim, chunk_dims);
+	if (codec == H5_CODEC_DEFLATE) {
+		plist.setDeflate(level);
+	} else if (codec == H5_CODEC_LZ4) {
+		// Optional: the file can be created without the plugin
+		plist.setFilter(H5_FILTER_ID_LZ4, H5Z_FLAG_OPTIONAL);
+	} else if (codec == H5_CODEC_ZSTD) {
+		const unsigned int cd_level = level;
+		plist.setFilter(H5_FILTER_ID_ZSTD, H5Z_FLAG_OPTIONAL, 1, &cd_level);
+	}
+	H5::DataSpace dataspace(ndim, dims);
+	H5::DataSet dataset = file.createDataSet(name, H5::PredType::NATIVE_LLONG,
+	                                         dataspace, plist);
+
+	// Dimensions completed to 3 by leading ones
+	hsize_t d[3] = {1, 1, 1}, c[3] = {1, 1, 1}, n_ch[3];
+	for (int a = 0 ; a < ndim ; ++a) {
+		d[3 - ndim + a] = dims[a];
+		c[3 - ndim + a] = chunk_dims[a];
+	}
+	for (int a = 0 ; a < 3 ; ++a) {
+		n_ch[a] = (d[a] + c[a] - 1) / c[a];
+	}
+	const hsize_t n_chunks = n_ch[0] * n_ch[1] * n_ch[2];
+	const size_t chunk_len = c[0] * c[1] * c[2];
+	const size_t chunk_bytes = chunk_len * sizeof(long long);
+
+	const int n_threads = workers ? workers->getNThreads() : 1;
+	const int n_slots = CHUNKS_PER_THREAD * n_threads;
+	std::vector< std::vector<long long> > raw(n_threads,
+	                                          std::vector<long long>(chunk_len));
+	std::vector< std::vector<char> > comp(
+		n_slots, std::vector<char>(chunkBound(codec, chunk_bytes)));
+	std::vector<size_t> sizes(n_slots);
+
+	for (hsize_t first = 0 ; first < n_chunks ; first += n_slots) {
+		const int n_batch = (int) std::min((hsize_t) n_slots, n_chunks - first);
+
+		auto task = [&](const int t) {
+			long long *buf = raw[t].data();
+			for (int s = t ; s < n_batch ; s += n_threads) {
+				hsize_t k = first + s;
+				const hsize_t o0 = (k / (n_ch[1] * n_ch[2])) * c[0];
+				const hsize_t o1 = ((k / n_ch[2]) % n_ch[1]) * c[1];
+				const hsize_t o2 = (k % n_ch[2]) * c[2];
+				// Gather the chunk (rows of the last dimension)
+				const hsize_t w = std::min(c[2], d[2] - o2);
+				for (hsize_t i = 0 ; i < c[0] ; ++i) {
+					for (hsize_t j = 0 ; j < c[1] ; ++j) {
+						long long *row = buf + (i * c[1] + j) * c[2];
+						if (o0 + i < d[0] && o1 + j < d[1]) {
+							const long long *src = data
+								+ ((o0 + i) * d[1] + o1 + j) * d[2] + o2;
+							std::copy(src, src + w, row);
+							std::fill(row + w, row + c[2], 0LL);
+						} else {
+							std::fill(row, row + c[2], 0LL);
+						}
+					}
+				}
+				sizes[s] = compressChunk(codec, level,
+				                         reinterpret_cast<const char *>(buf),
+				                         chunk_bytes, comp[s].data());
+			}
+		};
+		if (workers) {
+			workers->run(task);
+		} else {
+			task(0);
+		}
+
+		for (int s = 0 ; s < n_batch ; ++s) {
+			hsize_t k = first + s;
+			hsize_t full[3] = {(k / (n_ch[1] * n_ch[2])) * c[0],
+			                   ((k / n_ch[2]) % n_ch[1]) * c[1],
+			                   (k % n_ch[2]) * c[2]};
+			if (sizes[s] == 0) {
+				throw H5::DataSetIException("writeChunked",
+				                            "compression of a chunk failed");
+			}
+			if (H5Dwrite_chunk(dataset.getId(), H5P_DEFAULT, 0,
+			                   full + 3 - ndim, sizes[s],
+							   comp[s].data()) < 0) {
+				throw H5::DataSetIException("writeChunked",
+				                            "H5Dwrite_chunk failed");
+			}
+		}
+	}
+	return dataset;
+}
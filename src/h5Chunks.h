@@ -0,0 +1,62 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file h5Chunks.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Parallel compression of chunked HDF5 datasets
+ *
+ * Header file for h5Chunks.cpp.
+ * It defines the codecs of the HDF5 output and the function writing
+ * a chunked dataset whose chunks are compressed by a pool of threads.
+ */
+
+#ifndef ACTIVEBROWNIAN_H5CHUNKS_H_
+#define ACTIVEBROWNIAN_H5CHUNKS_H_
+
+#include <string>
+#include "H5Cpp.h"
+#include "workers.h"
+
+// Identifiers of the HDF5 filters registered by the plugins
+#define H5_FILTER_ID_LZ4 32004
+#define H5_FILTER_ID_ZSTD 32015
+
+//! Compression of the HDF5 datasets
+enum H5Codec {
+	H5_CODEC_NONE, //!< No compression
+	H5_CODEC_DEFLATE, //!< Deflate (zlib), readable everywhere
+	H5_CODEC_LZ4, //!< LZ4 (needs the HDF5 plugin to be read)
+	H5_CODEC_ZSTD //!< Zstandard (needs the HDF5 plugin to be read)
+};
+
+//! Codec of a given name (false if unknown or not built in)
+bool parseH5Codec(const std::string &name, H5Codec &codec);
+//! Largest level of compression of a codec (-1 if it has no level)
+int maxH5Level(const H5Codec codec);
+
+//! Write a chunked dataset of long long, the chunks being compressed
+//! in parallel
+H5::DataSet writeChunked(H5::H5File &file, const std::string &name,
+                         const int ndim, const hsize_t *dims,
+						 const hsize_t *chunk_dims, const long long *data,
+						 const H5Codec codec, const int level,
+						 Workers *workers);
+
+#endif // ACTIVEBROWNIAN_H5CHUNKS_H_
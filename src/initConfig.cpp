@@ -0,0 +1,318 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file initConfig.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Initial configurations without overlaps
+ *
+ * Both generators are O(N): the lattice directly, and each step of the
+ * FIRE minimization with a grid of cells as large as the range.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "initConfig.h"
+
+// Jitter of the lattice (fraction of the spacing)
+#define LATTICE_JITTER 0.05
+// FIRE stops when no pair is closer than (1 - FIRE_TOL) sigma
+#define FIRE_TOL 0.02
+// Largest number of steps of FIRE
+#define FIRE_MAX_STEPS 20000
+// Parameters of FIRE (Bitzek et al., PRL 97, 170201, 2006)
+#define FIRE_DT 0.05
+#define FIRE_DT_MAX 0.5
+#define FIRE_ALPHA 0.1
+#define FIRE_N_MIN 5
+#define FIRE_F_INC 1.1
+#define FIRE_F_DEC 0.5
+#define FIRE_F_ALPHA 0.99
+
+/*!
+ * \brief Grid of cells for the pairs closer than a range (periodic box)
+ */
+class CellGrid {
+	public:
+		//! Cells at least as large as the range
+		CellGrid(const double _len_x, const double _len_y,
+		         const double _range, const long n_parts) :
+			len_x(_len_x), len_y(_len_y), range_sq(_range * _range),
+			n_x(std::max(1, (int) (_len_x / _range))),
+			n_y(std::max(1, (int) (_len_y / _range))),
+			starts(n_x * n_y + 1), cell_of(n_parts), ids(n_parts) {
+			// Too few cells to look at distinct neighbors: a single one
+			if (n_x < 3 || n_y < 3) {
+				n_x = n_y = 1;
+				starts.resize(2);
+			}
+		}
+
+		//! Sort the particles by cell (counting sort)
+		void build(const std::vector<double> &x, const std::vector<double> &y) {
+			std::fill(starts.begin(), starts.end(), 0);
+			for (size_t i = 0 ; i < x.size() ; ++i) {
+				int cx = std::min(n_x - 1, (int) (x[i] / len_x * n_x));
+				int cy = std::min(n_y - 1, (int) (y[i] / len_y * n_y));
+				cell_of[i] = cy * n_x + cx;
+				++starts[cell_of[i] + 1];
+			}
+			for (int c = 0 ; c < n_x * n_y ; ++c) {
+				starts[c + 1] += starts[c];
+			}
+			std::vector<long> pos(starts.begin(), starts.end() - 1);
+			for (size_t i = 0 ; i < x.size() ; ++i) {
+				ids[pos[cell_of[i]]++] = i;
+			}
+		}
+
+		//! Call f(i, j, dx, dy, r2) for each pair closer than the range
+		template<typename F>
+		void forEachPair(const std::vector<double> &x,
+		                 const std::vector<double> &y, const F &f) const {
+			// Half of the neighbors, so that each pair is seen once
+			static const int offsets[5][2] = {{0, 0}, {1, 0}, {-1, 1},
+			                                  {0, 1}, {1, 1}};
+			const int n_offsets = (n_x == 1) ? 1 : 5;
+			for (int cy = 0 ; cy < n_y ; ++cy) {
+				for (int cx = 0 ; cx < n_x ; ++cx) {
+					const int c1 = cy * n_x + cx;
+					for (int o = 0 ; o < n_offsets ; ++o) {
+						const int c2 = ((cy + offsets[o][1]) % n_y) * n_x
+						               + (cx + offsets[o][0] + n_x) % n_x;
+						for (long a = starts[c1] ; a < starts[c1 + 1] ; ++a) {
+							const long i = ids[a];
+							const long b0 = (o == 0) ? a + 1 : starts[c2];
+							for (long b = b0 ; b < starts[c2 + 1] ; ++b) {
+								const long j = ids[b];
+								double dx = x[i] - x[j], dy = y[i] - y[j];
+								dx -= len_x * std::round(dx / len_x);
+								dy -= len_y * std::round(dy / len_y);
+								double r2 = dx * dx + dy * dy;
+								if (r2 < range_sq) {
+									f(i, j, dx, dy, r2);
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+
+	private:
+		const double len_x; //!< Length of the box along x
+		const double len_y; //!< Length of the box along y
+		const double range_sq; //!< Square of the range
+		int n_x; //!< Number of cells along x
+		int n_y; //!< Number of cells along y
+		std::vector<long> starts; //!< First particle of each cell
+		std::vector<int> cell_of; //!< Cell of each particle
+		std::vector<long> ids; //!< Particles sorted by cell
+};
+
+/*!
+ * \brief Triangular lattice filling the box, with some jitter.
+ *
+ * The number of rows is even, so that the shifted rows alternate across
+ * the periodic boundary too, and close to that of the equilateral
+ * lattice: the one giving the farthest nearest neighbors is chosen.
+ * The sites left empty are drawn at random. Each coordinate is moved
+ * by at most a fraction LATTICE_JITTER of the spacing, less if needed
+ * to keep the neighbors at least sigma apart. The orientations are
+ * random.
+ *
+ * \param len_x Length of the box along x
+ * \param len_y Length of the box along y
+ * \param n_parts Number of particles
+ * \param sigma Smallest distance to keep between the particles
+ * \param rng Random number generator
+ * \param conf Configuration (output)
+ */
+void latticeConfiguration(const double len_x, const double len_y,
+                          const long n_parts, const double sigma,
+                          std::mt19937 &rng, Configuration &conf) {
+	// Distance between nearest neighbors for a number of rows
+	auto nearestOf = [&](const long rows) {
+		const double dx = len_x / ((n_parts + rows - 1) / rows);
+		const double dy = len_y / rows;
+		// Same row, next row (shifted) and next row with the same shift
+		return std::min({dx, std::sqrt(0.25 * dx * dx + dy * dy),
+		                 2.0 * dy});
+	};
+	// Even numbers of rows around the equilateral lattice
+	const long half_rows = std::max(1L, std::lround(0.5 * std::sqrt(
+		2.0 * n_parts * len_y / (std::sqrt(3.0) * len_x))));
+	long n_rows = 2 * half_rows;
+	for (long h = std::max(1L, half_rows - 2) ; h <= half_rows + 2 ; ++h) {
+		if (nearestOf(2 * h) > nearestOf(n_rows)) {
+			n_rows = 2 * h;
+		}
+	}
+	const long n_cols = (n_parts + n_rows - 1) / n_rows;
+	const double dx = len_x / n_cols, dy = len_y / n_rows;
+
+	// Two neighbors get closer by at most 2 sqrt(2) times the jitter
+	const double nearest = nearestOf(n_rows);
+	const double jitter = std::max(0.0, std::min(
+		LATTICE_JITTER * std::min(dx, dy),
+		(nearest - sigma) / (2.0 * std::sqrt(2.0))));
+
+	std::vector<long> sites(n_cols * n_rows);
+	for (size_t k = 0 ; k < sites.size() ; ++k) {
+		sites[k] = k;
+	}
+	std::shuffle(sites.begin(), sites.end(), rng);
+	std::sort(sites.begin(), sites.begin() + n_parts);
+
+	std::uniform_real_distribution<double> rndJitter(-jitter, jitter);
+	std::uniform_real_distribution<double> rndAngle(0, 2.0 * M_PI);
+	conf.len_x = len_x;
+	conf.len_y = len_y;
+	conf.pos_x.resize(n_parts);
+	conf.pos_y.resize(n_parts);
+	conf.angles.resize(n_parts);
+	for (long i = 0 ; i < n_parts ; ++i) {
+		long row = sites[i] / n_cols, col = sites[i] % n_cols;
+		double x = (col + 0.5 * (row % 2)) * dx + rndJitter(rng);
+		double y = (row + 0.5) * dy + rndJitter(rng);
+		conf.pos_x[i] = x - len_x * std::floor(x / len_x);
+		conf.pos_y[i] = y - len_y * std::floor(y / len_y);
+		conf.angles[i] = rndAngle(rng);
+	}
+}
+
+/*!
+ * \brief Random configuration whose overlaps are removed by FIRE.
+ *
+ * The particles interact with the harmonic repulsion
+ * (1 - r / sigma)^2 / 2, whose energy is minimized by FIRE until no pair
+ * is closer than (1 - FIRE_TOL) sigma. The orientations are random.
+ *
+ * \param len_x Length of the box along x
+ * \param len_y Length of the box along y
+ * \param n_parts Number of particles
+ * \param sigma Diameter of the particles
+ * \param rng Random number generator
+ * \param conf Configuration (output)
+ * \return Number of steps of FIRE
+ */
+long fireConfiguration(const double len_x, const double len_y,
+                       const long n_parts, const double sigma,
+					   std::mt19937 &rng, Configuration &conf) {
+	std::uniform_real_distribution<double> rndPosX(0, len_x);
+	std::uniform_real_distribution<double> rndPosY(0, len_y);
+	std::uniform_real_distribution<double> rndAngle(0, 2.0 * M_PI);
+	conf.len_x = len_x;
+	conf.len_y = len_y;
+	conf.pos_x.resize(n_parts);
+	conf.pos_y.resize(n_parts);
+	conf.angles.resize(n_parts);
+	for (long i = 0 ; i < n_parts ; ++i) {
+		conf.pos_x[i] = rndPosX(rng);
+		conf.pos_y[i] = rndPosY(rng);
+		conf.angles[i] = rndAngle(rng);
+	}
+
+	std::vector<double> &x = conf.pos_x, &y = conf.pos_y;
+	std::vector<double> fx(n_parts), fy(n_parts);
+	std::vector<double> vx(n_parts, 0.), vy(n_parts, 0.);
+	CellGrid grid(len_x, len_y, sigma, n_parts);
+	double dt = FIRE_DT * sigma, alpha = FIRE_ALPHA;
+	long n_pos = 0, step = 0;
+
+	for (step = 0 ; step < FIRE_MAX_STEPS ; ++step) {
+		// Harmonic repulsion
+		std::fill(fx.begin(), fx.end(), 0.);
+		std::fill(fy.begin(), fy.end(), 0.);
+		double max_overlap = 0.;
+		grid.build(x, y);
+		grid.forEachPair(x, y, [&](const long i, const long j, const double dx,
+		                           const double dy, const double r2) {
+			double r = std::max(std::sqrt(r2), 1e-12 * sigma);
+			double overlap = 1.0 - r / sigma;
+			max_overlap = std::max(max_overlap, overlap);
+			double f = overlap / (sigma * r);
+			fx[i] += f * dx;
+			fy[i] += f * dy;
+			fx[j] -= f * dx;
+			fy[j] -= f * dy;
+		});
+		if (max_overlap < FIRE_TOL) {
+			break;
+		}
+
+		// Velocities turned towards the forces while going downhill
+		double power = 0., v_sq = 0., f_sq = 0.;
+		for (long i = 0 ; i < n_parts ; ++i) {
+			power += fx[i] * vx[i] + fy[i] * vy[i];
+			v_sq += vx[i] * vx[i] + vy[i] * vy[i];
+			f_sq += fx[i] * fx[i] + fy[i] * fy[i];
+		}
+		if (power > 0.) {
+			double mix = alpha * std::sqrt(v_sq / f_sq);
+			for (long i = 0 ; i < n_parts ; ++i) {
+				vx[i] = (1. - alpha) * vx[i] + mix * fx[i];
+				vy[i] = (1. - alpha) * vy[i] + mix * fy[i];
+			}
+			if (++n_pos > FIRE_N_MIN) {
+				dt = std::min(dt * FIRE_F_INC, FIRE_DT_MAX * sigma);
+				alpha *= FIRE_F_ALPHA;
+			}
+		} else {
+			std::fill(vx.begin(), vx.end(), 0.);
+			std::fill(vy.begin(), vy.end(), 0.);
+			dt *= FIRE_F_DEC;
+			alpha = FIRE_ALPHA;
+			n_pos = 0;
+		}
+
+		// Semi-implicit Euler step, limited to a fraction of sigma
+		const double max_move = 0.1 * sigma;
+		for (long i = 0 ; i < n_parts ; ++i) {
+			vx[i] += dt * fx[i];
+			vy[i] += dt * fy[i];
+			double mx = std::max(-max_move, std::min(dt * vx[i], max_move));
+			double my = std::max(-max_move, std::min(dt * vy[i], max_move));
+			x[i] += mx;
+			y[i] += my;
+			x[i] -= len_x * std::floor(x[i] / len_x);
+			y[i] -= len_y * std::floor(y[i] / len_y);
+		}
+	}
+	return step;
+}
+
+/*!
+ * \brief Smallest distance between two particles.
+ *
+ * \param conf Configuration
+ * \param range Largest distance looked at
+ * \return Smallest distance (range if no pair is closer)
+ */
+double minDistance(const Configuration &conf, const double range) {
+	CellGrid grid(conf.len_x, conf.len_y, range, conf.pos_x.size());
+	grid.build(conf.pos_x, conf.pos_y);
+	double min_r2 = range * range;
+	grid.forEachPair(conf.pos_x, conf.pos_y,
+		[&](const long, const long, const double, const double,
+		    const double r2) {
+			min_r2 = std::min(min_r2, r2);
+		});
+	return std::sqrt(min_r2);
+}
@@ -0,0 +1,54 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file initConfig.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Initial configurations without overlaps
+ *
+ * Header file for initConfig.cpp.
+ * It defines the generators of initial configurations of a periodic
+ * 2d system in which the particles do not overlap.
+ */
+
+#ifndef ACTIVEBROWNIAN_INITCONFIG_H_
+#define ACTIVEBROWNIAN_INITCONFIG_H_
+
+#include <random>
+#include "configuration.h"
+
+//! Initial configuration of the particles
+enum InitMode {
+	INIT_RANDOM, //!< Uniformly random (overlaps)
+	INIT_LATTICE, //!< Triangular lattice with some jitter
+	INIT_FIRE //!< Random, then overlaps removed by FIRE minimization
+};
+
+//! Triangular lattice filling the box, with some jitter
+void latticeConfiguration(const double len_x, const double len_y,
+                          const long n_parts, const double sigma,
+                          std::mt19937 &rng, Configuration &conf);
+//! Random configuration whose overlaps are removed by FIRE
+long fireConfiguration(const double len_x, const double len_y,
+                       const long n_parts, const double sigma,
+					   std::mt19937 &rng, Configuration &conf);
+//! Smallest distance between two particles
+double minDistance(const Configuration &conf, const double range);
+
+#endif // ACTIVEBROWNIAN_INITCONFIG_H_
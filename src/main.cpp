@@ -37,7 +37,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 /*!
  * \brief Main function
  *
- * Create and run the simulation.
+ * Create and run the simulation. The exit status is 1 if it could not
+ * be initialized or failed during the run.
  */
 int main(int argc, char **argv) {
 	Simul simulation(argc, argv);
@@ -51,5 +52,5 @@ int main(int argc, char **argv) {
 	simulation.print();
 	simulation.run();
 
-	return 0;
+	return (simulation.getStatus() == SIMUL_RUN_FAILED) ? 1 : 0;
 }
@@ -0,0 +1,125 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file obsWriter.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Periodic export of the observables during the run
+ *
+ * Implementation of the methods of the class ObsWriter.
+ */
+
+#include <cstdio>
+#include <iostream>
+#include "arena.h"
+#include "obsWriter.h"
+
+/*!
+ * \brief Constructor of ObsWriter
+ *
+ * Allocate the snapshot and start the thread.
+ *
+ * \param obs Observables
+ * \param _fname Name of the output file
+ * \param _every Samples between two exports
+ * \param _write Function writing a snapshot
+ */
+ObsWriter::ObsWriter(const Observables *obs, const std::string &_fname,
+                     const long _every, const WriteFunc &_write) :
+	fname(_fname), every(_every), write(_write), next(_every),
+	snapshot_iters(0), n_written(0), busy(false), stop(false) {
+	// Same sizes as the observables: the copies do not allocate
+	obs->getSums(snapshot);
+	thread = std::thread(&ObsWriter::loop, this);
+}
+
+/*!
+ * \brief Destructor of ObsWriter
+ */
+ObsWriter::~ObsWriter() {
+	finish();
+}
+
+/*!
+ * \brief Wait for the write in progress (if any) and stop the thread.
+ */
+void ObsWriter::finish() {
+	if (!thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv.notify_one();
+	thread.join();
+}
+
+/*!
+ * \brief Export the observables if it is time and the thread is free.
+ *
+ * \param obs Observables
+ * \param n_iters_done Number of iterations done
+ */
+void ObsWriter::sample(const Observables *obs, const long n_iters_done) {
+	if (obs->getNCalls() < next) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (busy) {
+			return; // Try again at the next sample
+		}
+		obs->getSums(snapshot);
+		snapshot_iters = n_iters_done;
+		busy = true;
+	}
+	cv.notify_one();
+	next = obs->getNCalls() + every;
+}
+
+/*!
+ * \brief Loop of the thread: wait for a snapshot, write it, and so on.
+ */
+void ObsWriter::loop() {
+	// The writes are outside the time loop: their allocations
+	// (HDF5 library) are not counted
+	countHeapAllocs(false);
+	const std::string tmp_fname = fname + ".part";
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this] { return stop || busy; });
+			if (!busy) {
+				return;
+			}
+		}
+
+		// The snapshot is not modified while busy
+		write(tmp_fname, &snapshot, snapshot_iters);
+		if (std::rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+			std::cerr << "Error: cannot rename " << tmp_fname << " to "
+				<< fname << std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(mtx);
+		++n_written;
+		busy = false;
+	}
+}
@@ -0,0 +1,88 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file obsWriter.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Periodic export of the observables during the run
+ *
+ * Header file for obsWriter.cpp.
+ * It defines the class ObsWriter.
+ */
+
+#ifndef ACTIVEBROWNIAN_OBSWRITER_H_
+#define ACTIVEBROWNIAN_OBSWRITER_H_
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "observables.h"
+
+/*!
+ * \brief Class for the periodic export of the observables
+ *
+ * Every few samples, the accumulated values are copied and written
+ * by a background thread, so that a run which is killed still leaves
+ * its observables so far. The file is written under a temporary name
+ * and renamed, so that it is always complete. If the previous write
+ * is not over, the export is postponed to the next sample.
+ */
+class ObsWriter {
+	public:
+		//! Function writing a snapshot to a file after some iterations
+		typedef std::function<void(const std::string &fname,
+		                           const ObsSums *snapshot,
+								   const long n_iters_done)> WriteFunc;
+
+		ObsWriter(const Observables *obs, const std::string &_fname,
+		          const long _every, const WriteFunc &_write);
+		~ObsWriter();
+		ObsWriter(const ObsWriter &) = delete;
+		ObsWriter & operator=(const ObsWriter &) = delete;
+
+		//! To be called after each sample: export if it is time
+		void sample(const Observables *obs, const long n_iters_done);
+		//! Wait for the write in progress and stop the thread
+		void finish();
+		//! Number of snapshots written
+		long getNWritten() const {
+			return n_written;
+		}
+
+	private:
+		void loop(); //!< Loop of the thread waiting for snapshots
+
+		const std::string fname; //!< Name of the output file
+		const long every; //!< Samples between two exports
+		const WriteFunc write; //!< Function writing a snapshot
+		long next; //!< Number of samples of the next export
+		ObsSums snapshot; //!< Copy of the accumulated values
+		long snapshot_iters; //!< Iterations done at the snapshot
+		long n_written; //!< Number of snapshots written
+
+		std::thread thread; //!< Thread writing the snapshots
+		std::mutex mtx; //!< Mutex for the snapshot
+		std::condition_variable cv; //!< Signal of a new snapshot
+		bool busy; //!< A snapshot is being written
+		bool stop; //!< Tell the thread to exit
+};
+
+#endif // ACTIVEBROWNIAN_OBSWRITER_H_
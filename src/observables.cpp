@@ -26,19 +26,29 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 //#include <cassert>
 #include <cmath>
+#include <algorithm>
 #include "H5Cpp.h"
 #include "observables.h"
+#include "ompPragma.h"
 
 /*
  * \brief Constructor of Observables
  *
  * Initialize the vector for correlations.
+ * In a rectangular box, the correlations are computed up to half of the
+ * smallest side of the box, so that the window is isotropic.
+ * The time series of the energy is reserved for energy_samples_ calls
+ * (no energy if zero).
  */
-Observables::Observables(const double len_, const long n_parts_,
+Observables::Observables(const double len_x_, const double len_y_,
+		                 const long n_parts_,
 		                 const double step_r_, const long n_div_angle_,
-						 bool less_obs_, bool cartesian_) :
-		len(len_), n_parts(n_parts_), step_r(step_r_),
+						 bool less_obs_, bool cartesian_, bool sheared_,
+						 long energy_samples_) :
+		len_x(len_x_), len_y(len_y_), len_min(std::min(len_x_, len_y_)),
+		n_parts(n_parts_), step_r(step_r_),
 		n_div_angle(n_div_angle_), less_obs(less_obs_), cartesian(cartesian_),
+		sheared(sheared_), with_energy(energy_samples_ > 0),
 		scal_r(1.0 / step_r), scal_angle(n_div_angle / (2 * M_PI))
 #ifdef USE_MKL
 		, n_pairs(n_parts * (n_parts - 1) / 2),
@@ -47,24 +57,33 @@ Observables::Observables(const double len_, const long n_parts_,
 #endif
 {
 	if (cartesian) {
-		n_div_r = (long) std::ceil(len / step_r);
+		n_div_r = (long) std::ceil(len_min / step_r);
 		n_div_tot = n_div_r * n_div_r;
-		step_r = len / n_div_r; // The step divides exactly the box
+		step_r = len_min / n_div_r; // The step divides exactly the box
 		scal_r = 1.0 / step_r;
 	} else {
 		// Half of the diagonal
         //n_div_r = (long) std::ceil(len * std::sqrt(0.5) / step_r);
-        n_div_r = (long) std::ceil(len / 2 / step_r);
+        n_div_r = (long) std::ceil(len_min / 2 / step_r);
 	   	if (less_obs) {
 			n_div_tot = n_div_r * n_div_angle;
 		} else {
 			n_div_tot = n_div_r * n_div_angle * n_div_angle;
 		}
 	}
-	n_calls = 0;
-	f_along = 0.0;
-	f_along_sq = 0.0;
-	correls.assign(n_div_tot, 0);
+	sums.n_calls = 0;
+	sums.f_along = 0.0;
+	sums.f_along_sq = 0.0;
+	sums.stress_xy = 0.0;
+	sums.stress_xy_sq = 0.0;
+	sums.energy = 0.0;
+	sums.energy_sq = 0.0;
+	sums.energy_series.reserve(energy_samples_);
+#if defined(USE_OPENMP) && !defined(USE_MKL)
+	thread_correls.assign(ompMaxThreads(),
+	                      std::vector<long long>(n_div_tot, 0));
+#endif
+	sums.correls.assign(n_div_tot, 0);
 }
 
 
@@ -72,15 +91,29 @@ Observables::Observables(const double len_, const long n_parts_,
  * \brief Compute the observables for a given state
  */
 void Observables::compute(const State *state) {
-	const std::vector<double> & pos_x = state->getPosX();
-	const std::vector<double> & pos_y = state->getPosY();
-	const std::vector<double> & angles = state->getAngles();
+	const PartVector<double> & pos_x = state->getPosX();
+	const PartVector<double> & pos_y = state->getPosY();
+	const PartVector<double> & angles = state->getAngles();
 
-	n_calls++;
+	sums.n_calls++;
 	// Average force along the orientation
 	double f = state->avgFAlong();
-	f_along += f;
-	f_along_sq += f * f;
+	sums.f_along += f;
+	sums.f_along_sq += f * f;
+	// Stress (only for a sheared system)
+	const double offset = state->getShearOffset();
+	if (sheared) {
+		double sxy = state->getStressXY();
+		sums.stress_xy += sxy;
+		sums.stress_xy_sq += sxy * sxy;
+	}
+	// Interaction energy (computed with the last forces)
+	if (with_energy) {
+		double e = state->getEnergy() / n_parts;
+		sums.energy += e;
+		sums.energy_sq += e * e;
+		sums.energy_series.push_back(e);
+	}
 
 #ifdef USE_MKL // MKL version
 	long k = 0;
@@ -96,8 +129,14 @@ void Observables::compute(const State *state) {
 		}
 	}
 
-	pbcSymMKL(dxs, len, phis, n_pairs);
-	pbcSymMKL(dys, len, phis, n_pairs);
+	if (offset != 0.) {
+		// Lees-Edwards shift of the images along y
+		for (long k = 0 ; k < n_pairs ; ++k) {
+			dxs[k] -= offset * std::round(dys[k] / len_y);
+		}
+	}
+	pbcSymMKL(dxs.data(), len_x, phis.data(), n_pairs);
+	pbcSymMKL(dys.data(), len_y, phis.data(), n_pairs);
 	// Computation of phis
 	vdAtan2(n_pairs, dys.data(), dxs.data(), phis.data());
 	// Computation of drs
@@ -113,20 +152,20 @@ void Observables::compute(const State *state) {
 		vdSinCos(n_pairs, thetas1.data(), dys.data(), dxs.data());
 		vdMul(n_pairs, dxs.data(), drs.data(), dxs.data());
 		vdMul(n_pairs, dys.data(), drs.data(), dys.data());
-		pbcMKL(dxs, n_div_r, phis, n_pairs);
-		pbcMKL(dys, n_div_r, phis, n_pairs);
+		pbcMKL(dxs.data(), n_div_r, phis.data(), n_pairs);
+		pbcMKL(dys.data(), n_div_r, phis.data(), n_pairs);
 	} else {
-		pbcMKL(thetas1, 2 * M_PI, dxs, n_pairs);
+		pbcMKL(thetas1.data(), 2 * M_PI, dxs.data(), n_pairs);
 		cblas_dscal(n_pairs, scal_angle, thetas1.data(), 1); // Scaling
 		if (!less_obs) {
 			// Computation of thetas2
 			cblas_daxpy(n_pairs, -1.0, phis.data(), 1, thetas2.data(), 1);
-			pbcMKL(thetas2, 2 * M_PI, dxs, n_pairs);
+			pbcMKL(thetas2.data(), 2 * M_PI, dxs.data(), n_pairs);
 			cblas_dscal(n_pairs, scal_angle, thetas2.data(), 1); // Scaling
 		}
 	}
 
-	double rmax = len * scal_r / 2;
+	double rmax = len_min * scal_r / 2;
 	for (long k = 0 ; k < n_pairs ; ++k) {
 		if (drs[k] >= rmax) { // Get rid of the points too far away
 			continue;
@@ -146,61 +185,86 @@ void Observables::compute(const State *state) {
 				box = b1 * n_div_angle * n_div_angle + b2 * n_div_angle + b3;
 			}
 		}
-		correls[box]++; // Add 1 in the right box
+		sums.correls[box]++; // Add 1 in the right box
 	}
 #else // Basic version
-	// For each pair of particles
-	for (long i = 0 ; i < n_parts ; ++i) {
-		for (long j = i + 1 ; j < n_parts ; ++j) {
-			double dx = pos_x[j] - pos_x[i];
-			pbcSym(dx, len);
-			double dy = pos_y[j] - pos_y[i];
-			pbcSym(dy, len);
-			double dr = std::sqrt(dx * dx + dy * dy);
-			if (dr > len / 2.) { // Get rid of the points too far away
-				continue;
-			}
+	// With OpenMP, each thread counts its pairs in its own histogram
+	OMP_PRAGMA(omp parallel)
+	{
+#ifdef USE_OPENMP
+		long long *correls = thread_correls[ompThreadNum()].data();
+#else
+		long long *correls = sums.correls.data();
+#endif
+		// For each pair of particles (fewer pairs for the last particles)
+		OMP_PRAGMA(omp for schedule(dynamic, 16))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			for (long j = i + 1 ; j < n_parts ; ++j) {
+				double dx = pos_x[j] - pos_x[i];
+				double dy = pos_y[j] - pos_y[i];
+				pbcSymLE(dx, dy, len_x, len_y, offset);
+				double dr = std::sqrt(dx * dx + dy * dy);
+				if (dr > len_min / 2.) { // Get rid of the points too far away
+					continue;
+				}
 
-			double phi = std::atan2(dy, dx);
-			double theta1 = angles[j] - phi;
-			pbc(theta1, 2 * M_PI);
+				double phi = std::atan2(dy, dx);
+				double theta1 = angles[j] - phi;
+				pbc(theta1, 2 * M_PI);
 
-			size_t box = 0;
-			if (cartesian) {
-				double x = std::cos(theta1) * dr;
-				double y = std::sin(theta1) * dr;
-				pbc(x, len);
-				pbc(y, len);
-				size_t b1 = (size_t) (x * scal_r);
-				size_t b2 = (size_t) (y * scal_r);
-				box = b1 * n_div_r + b2;
-			} else {
-				size_t b1 = (size_t) (dr * scal_r);
-				size_t b2 = (size_t) (theta1 * scal_angle);
-				if (less_obs) {
-					box = b1 * n_div_angle + b2;
+				size_t box = 0;
+				if (cartesian) {
+					double x = std::cos(theta1) * dr;
+					double y = std::sin(theta1) * dr;
+					pbc(x, len_min);
+					pbc(y, len_min);
+					size_t b1 = (size_t) (x * scal_r);
+					size_t b2 = (size_t) (y * scal_r);
+					box = b1 * n_div_r + b2;
 				} else {
-					double theta2 = angles[i] - phi;
-					pbc(theta2, 2 * M_PI);
-					size_t b3 = (size_t) (theta2 * scal_angle);
-					box = b1 * n_div_angle * n_div_angle + b2 * n_div_angle
-						  + b3;
+					size_t b1 = (size_t) (dr * scal_r);
+					size_t b2 = (size_t) (theta1 * scal_angle);
+					if (less_obs) {
+						box = b1 * n_div_angle + b2;
+					} else {
+						double theta2 = angles[i] - phi;
+						pbc(theta2, 2 * M_PI);
+						size_t b3 = (size_t) (theta2 * scal_angle);
+						box = b1 * n_div_angle * n_div_angle + b2 * n_div_angle
+							  + b3;
+					}
 				}
-			}
 
-			correls[box]++; // Add 1 in the right box
+				correls[box]++; // Add 1 in the right box
+			}
+		}
+	}
+#ifdef USE_OPENMP
+	// Reduction of the histograms of the threads
+	OMP_PRAGMA(omp parallel for schedule(static))
+	for (long k = 0 ; k < n_div_tot ; ++k) {
+		for (auto &c : thread_correls) {
+			sums.correls[k] += c[k];
+			c[k] = 0;
 		}
 	}
 #endif
+#endif
 }
 
 /*
  * \brief Export the observables to a hdf5 file
+ *
+ * The values written are the current ones, or a snapshot of them
+ * taken by getSums (for a write from another thread).
  */
 void Observables::writeH5(const std::string fname, double rho, long n_parts,
 				          double pot_strength, double temperature,
 						  double rot_dif, double activity, double dt,
-						  long n_iters, long n_iters_th, long skip) const {
+						  long n_iters, long n_iters_th, long skip,
+						  const H5Codec codec, const int level,
+						  Workers *workers, const ObsSums *snapshot) const {
+	const ObsSums &s = snapshot ? *snapshot : sums;
 	try {
 		H5::H5File file(fname, H5F_ACC_TRUNC);
 
@@ -209,6 +273,12 @@ void Observables::writeH5(const std::string fname, double rho, long n_parts,
 		H5::Attribute a_rho = file.createAttribute(
 				"rho", H5::PredType::NATIVE_DOUBLE, default_ds);
 		a_rho.write(H5::PredType::NATIVE_DOUBLE, &rho);
+		H5::Attribute a_len_x = file.createAttribute(
+				"len_x", H5::PredType::NATIVE_DOUBLE, default_ds);
+		a_len_x.write(H5::PredType::NATIVE_DOUBLE, &len_x);
+		H5::Attribute a_len_y = file.createAttribute(
+				"len_y", H5::PredType::NATIVE_DOUBLE, default_ds);
+		a_len_y.write(H5::PredType::NATIVE_DOUBLE, &len_y);
 		H5::Attribute a_n_parts = file.createAttribute(
 				"n_parts", H5::PredType::NATIVE_LONG, default_ds);
 		a_n_parts.write(H5::PredType::NATIVE_LONG, &n_parts);
@@ -266,17 +336,10 @@ void Observables::writeH5(const std::string fname, double rho, long n_parts,
 			dims[1] = (hsize_t) n_div_angle;
 			dims[2] = (hsize_t) n_div_angle;
 		}
-		// Create dataset
-		H5::DataSet dataset;
-		H5::DSetCreatPropList plist;
-		plist.setDeflate(6);
-		plist.setChunk(ndim, chunk_dims);
-		H5::DataSpace dataspace(ndim, dims);
-		dataset = file.createDataSet("correlations",
-									 H5::PredType::NATIVE_LLONG,
-									 dataspace, plist);
-		// Write data
-		dataset.write(correls.data(), H5::PredType::NATIVE_LLONG);
+		// Create dataset, the chunks being compressed by the threads
+		H5::DataSet dataset = writeChunked(file, "correlations", ndim, dims,
+		                                   chunk_dims, s.correls.data(), codec,
+										   level, workers);
 
 		// Attributes for correlations
 		H5::Attribute a_dr = dataset.createAttribute(
@@ -296,9 +359,39 @@ void Observables::writeH5(const std::string fname, double rho, long n_parts,
 			  						  H5::PredType::NATIVE_DOUBLE,
 									  dataspaceF);
 		double ff[2];
-		ff[0] = f_along / n_calls;
-		ff[1] = (f_along_sq / n_calls) - (ff[0] * ff[0]);
+		ff[0] = s.f_along / s.n_calls;
+		ff[1] = (s.f_along_sq / s.n_calls) - (ff[0] * ff[0]);
 		datasetF.write(ff, H5::PredType::NATIVE_DOUBLE);
+
+		// Stress (sheared system)
+		if (sheared) {
+			H5::DataSet datasetS = file.createDataSet(
+					"stressxy", H5::PredType::NATIVE_DOUBLE, dataspaceF);
+			double ss[2];
+			ss[0] = s.stress_xy / s.n_calls;
+			ss[1] = (s.stress_xy_sq / s.n_calls) - (ss[0] * ss[0]);
+			datasetS.write(ss, H5::PredType::NATIVE_DOUBLE);
+		}
+
+		// Interaction energy per particle and its time series
+		if (with_energy) {
+			H5::DataSet datasetE = file.createDataSet(
+					"energy", H5::PredType::NATIVE_DOUBLE, dataspaceF);
+			double ee[2];
+			ee[0] = s.energy / s.n_calls;
+			ee[1] = (s.energy_sq / s.n_calls) - (ee[0] * ee[0]);
+			datasetE.write(ee, H5::PredType::NATIVE_DOUBLE);
+
+			hsize_t n_samples = s.energy_series.size();
+			H5::DataSpace dataspaceT(1, &n_samples);
+			H5::DataSet datasetT = file.createDataSet(
+					"energy_series", H5::PredType::NATIVE_DOUBLE, dataspaceT);
+			datasetT.write(s.energy_series.data(),
+			               H5::PredType::NATIVE_DOUBLE);
+			H5::Attribute a_skip_t = datasetT.createAttribute(
+					"skip", H5::PredType::NATIVE_LONG, default_ds);
+			a_skip_t.write(H5::PredType::NATIVE_LONG, &skip);
+		}
 	} catch (H5::Exception& err) {
         err.printError();
 	}
@@ -30,27 +30,61 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <vector>
 #include "state.h"
+#include "h5Chunks.h"
+
+//! Values accumulated by the observables
+struct ObsSums {
+	long n_calls; //!< Number of calls of 'compute'
+	double f_along; //!< Internal force along the orientation
+	double f_along_sq; //!< Square of internal force along the orientation
+	double stress_xy; //!< xy component of the stress
+	double stress_xy_sq; //!< Square of the xy component of the stress
+	double energy; //!< Interaction energy per particle
+	double energy_sq; //!< Square of the interaction energy per particle
+	std::vector<double> energy_series; //!< Energy per particle of each call
+	std::vector<long long> correls; //!< Correlations
+};
 
 class Observables {
 	public:
-		Observables(const double len_, const long n_parts_,
+		Observables(const double len_x_, const double len_y_,
+				    const long n_parts_,
 				    const double step_r_, const long n_div_angle_,
-					const bool less_obs_, const bool cartesian_);
+					const bool less_obs_, const bool cartesian_,
+					const bool sheared_=false, const long energy_samples_=0);
 		//! Compute the observables for a given state
 		void compute(const State *state);
 		//! Export to hdf5
 		void writeH5(const std::string fname, double rho, long n_parts,
 	                 double pot_strength, double temperature, double rot_dif,
 				     double activity, double dt, long n_iters, long n_iters_th,
-					 long skip) const;
+					 long skip, const H5Codec codec=H5_CODEC_DEFLATE,
+					 const int level=6, Workers *workers=nullptr,
+					 const ObsSums *snapshot=nullptr) const;
+		//! Copy the accumulated values (no allocation after the first copy)
+		void getSums(ObsSums &snapshot) const {
+			// The energy series is reserved at its final length: so is
+			// the copy, which is then filled without reallocation
+			snapshot.energy_series.reserve(sums.energy_series.capacity());
+			snapshot = sums;
+		}
+		//! Number of calls of 'compute'
+		long getNCalls() const {
+			return sums.n_calls;
+		}
 
 	private:
-		const double len; //!< Length of the box
+		const double len_x; //!< Length of the box along x
+		const double len_y; //!< Length of the box along y
+		//! Length of the window for correlations (smallest side of the box)
+		const double len_min;
 		const long n_parts; //!< Number of particles 
 		double step_r; //!< Size of spatial division
 		const long n_div_angle; //!< Number of divisions for angle
 		const bool less_obs; //!< Only (r, theta) correlations
 		const bool cartesian; //!< Correlations in cartesian coordinates
+		const bool sheared; //!< Sheared system (export the stress)
+		const bool with_energy; //!< Export the interaction energy
 		double scal_r; //!< Scale for spatial divisions
 		const double scal_angle; //!< Scale for angular divisions
 		long n_div_r; //!< Number of divisions in x
@@ -62,10 +96,11 @@ class Observables {
 		std::vector<double> dxs, dys, phis, drs, thetas1, thetas2;
 #endif
 
-		long n_calls; //!< Number of calls of 'compute'
-		double f_along; //!< Internal force along the orientation
-		double f_along_sq; //!< Square of internal force along the orientation
-		std::vector<long long> correls; //!< Correlations
+		ObsSums sums; //!< Accumulated values
+#if defined(USE_OPENMP) && !defined(USE_MKL)
+		//! Correlations counted by each thread (merged after each call)
+		std::vector< std::vector<long long> > thread_correls;
+#endif
 };
 
 #endif // ACTIVEBROWNIAN_OBSERVABLES_H
@@ -0,0 +1,58 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file ompPragma.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief OpenMP directives of the hot loops
+ *
+ * The directives are written with OMP_PRAGMA, which expands to nothing
+ * unless the OpenMP variant is built (USE_OPENMP), so that both variants
+ * share the same loops without warnings about unknown pragmas.
+ */
+
+#ifndef ACTIVEBROWNIAN_OMPPRAGMA_H_
+#define ACTIVEBROWNIAN_OMPPRAGMA_H_
+
+#ifdef USE_OPENMP
+#include <omp.h>
+#define OMP_PRAGMA(...) _Pragma(#__VA_ARGS__)
+#else
+#define OMP_PRAGMA(...)
+#endif
+
+//! Number of the calling thread in a parallel region (0 without OpenMP)
+inline int ompThreadNum() {
+#ifdef USE_OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+//! Largest number of threads of a parallel region (1 without OpenMP)
+inline int ompMaxThreads() {
+#ifdef USE_OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+#endif // ACTIVEBROWNIAN_OMPPRAGMA_H_
@@ -0,0 +1,248 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file partAllocator.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Allocator for the arrays of the particles
+ *
+ * Allocation of the arrays on normal or huge pages.
+ * The arrays on huge pages are recorded in a table, the others start
+ * with a header of 64 bytes: the mode can change while arrays are alive.
+ * The arrays of ZeroParts are mapped directly.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include "partAllocator.h"
+
+//! Header before each array on the heap (one cache line)
+struct alignas(64) PartsHeader {
+	void *base; //!< Beginning of the heap block
+};
+
+//! Array mapped on huge pages
+struct PartsMapping {
+	size_t len; //!< Length of the mapping
+	int kind; //!< Pages actually used (HugePages)
+};
+
+//! Arrays mapped on huge pages, by address: their description is kept
+//! aside so that their first page is not written at allocation
+static std::map<void *, PartsMapping> mappings;
+static std::mutex mappings_mtx; //!< Protects the mappings
+
+static std::atomic<int> huge_pages(HUGE_PAGES_NONE); //!< Requested pages
+//! Bytes currently mapped on each kind of huge pages
+static std::atomic<size_t> bytes_on[3];
+//! Number of large arrays which did not get the requested pages
+static std::atomic<long> n_fallbacks(0);
+
+/*!
+ * \brief Map memory aligned on a huge page.
+ *
+ * \param len Length (multiple of HUGE_PAGE_SIZE)
+ * \param mode HUGE_PAGES_EXPLICIT or HUGE_PAGES_TRANSPARENT
+ * \return Pointer to the memory, nullptr on failure
+ */
+static void * mapHuge(const size_t len, const int mode) {
+	if (mode == HUGE_PAGES_EXPLICIT) {
+		void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		return (p == MAP_FAILED) ? nullptr : p;
+	}
+
+	// Map one more huge page and trim to an aligned range
+	char *p = static_cast<char *>(mmap(nullptr, len + HUGE_PAGE_SIZE,
+	                                   PROT_READ | PROT_WRITE,
+	                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (p == MAP_FAILED) {
+		return nullptr;
+	}
+	std::uintptr_t a = reinterpret_cast<std::uintptr_t>(p);
+	size_t head = (HUGE_PAGE_SIZE - a % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+	if (head > 0) {
+		munmap(p, head);
+	}
+	munmap(p + head + len, HUGE_PAGE_SIZE - head);
+	p += head;
+#ifdef MADV_HUGEPAGE
+	if (madvise(p, len, MADV_HUGEPAGE) != 0) {
+		munmap(p, len);
+		return nullptr;
+	}
+	return p;
+#else
+	munmap(p, len);
+	return nullptr;
+#endif
+}
+
+/*!
+ * \brief Choose the pages backing the large arrays.
+ *
+ * Only the arrays allocated afterwards are affected.
+ *
+ * \param mode Kind of pages
+ */
+void setHugePages(const HugePages mode) {
+	huge_pages = mode;
+}
+
+/*!
+ * \brief Allocate memory for an array of the particles.
+ *
+ * The arrays of at least one huge page get the requested pages,
+ * with fallback from explicit to transparent huge pages,
+ * and then to the heap. The memory of the arrays on huge pages is not
+ * written, so that the first touch decides its NUMA node (the small
+ * arrays on the heap are preceded by a header).
+ *
+ * \param bytes Number of bytes
+ * \return Pointer to the memory (aligned on 64 bytes)
+ */
+void * allocParts(const size_t bytes) {
+	const int mode = huge_pages;
+
+	if (mode != HUGE_PAGES_NONE && bytes >= HUGE_PAGE_SIZE) {
+		size_t len = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+		             * HUGE_PAGE_SIZE;
+		for (int m = mode ; m > HUGE_PAGES_NONE ; --m) {
+			void *p = mapHuge(len, m);
+			if (p) {
+				if (m != mode) {
+					++n_fallbacks;
+				}
+				std::lock_guard<std::mutex> lock(mappings_mtx);
+				mappings[p] = {len, m};
+				bytes_on[m] += len;
+				return p;
+			}
+		}
+		++n_fallbacks;
+	}
+
+	const size_t total = bytes + sizeof(PartsHeader);
+	char *raw = static_cast<char *>(::operator new(total + 64));
+	std::uintptr_t a = reinterpret_cast<std::uintptr_t>(raw);
+	PartsHeader *h = reinterpret_cast<PartsHeader *>(raw + (64 - a % 64) % 64);
+	h->base = raw;
+	return h + 1;
+}
+
+/*!
+ * \brief Free memory allocated by allocParts.
+ *
+ * \param p Pointer to the memory
+ */
+void freeParts(void *p) {
+	if (!p) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mappings_mtx);
+		auto it = mappings.find(p);
+		if (it != mappings.end()) {
+			bytes_on[it->second.kind] -= it->second.len;
+			munmap(p, it->second.len);
+			mappings.erase(it);
+			return;
+		}
+	}
+	PartsHeader *h = static_cast<PartsHeader *>(p) - 1;
+	::operator delete(h->base);
+}
+
+/*!
+ * \brief Print the pages backing the arrays.
+ *
+ * The memory actually backed by transparent huge pages is given
+ * by the kernel (AnonHugePages, in kB).
+ *
+ * \param out Output stream
+ */
+void printHugePages(std::ostream &out) {
+	const char *names[3] = {"none", "transparent", "explicit"};
+	out << "# Huge pages: requested " << names[huge_pages.load()]
+		<< ", explicit " << (bytes_on[HUGE_PAGES_EXPLICIT] >> 20)
+		<< " MB, transparent (advised) "
+		<< (bytes_on[HUGE_PAGES_TRANSPARENT] >> 20) << " MB, fallbacks "
+		<< n_fallbacks;
+
+	std::ifstream smaps("/proc/self/smaps_rollup");
+	std::string line;
+	while (std::getline(smaps, line)) {
+		if (line.compare(0, 14, "AnonHugePages:") == 0) {
+			out << ", kernel AnonHugePages "
+				<< line.substr(line.find_first_not_of(" \t", 14));
+		}
+	}
+	out << std::endl;
+}
+
+/*!
+ * \brief Map an array of doubles equal to zero.
+ *
+ * The anonymous mapping reads as zero and its pages are only backed
+ * when first written. std::bad_alloc is thrown if the mapping fails.
+ *
+ * \param n Number of elements
+ */
+void ZeroParts::assign(const size_t n) {
+	unmap();
+	if (n == 0) {
+		return;
+	}
+	len = n * sizeof(double);
+	void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+	ptr = static_cast<double *>(p);
+}
+
+/*!
+ * \brief Give back the memory of an array of zeros.
+ *
+ * The pages are dropped and read as zero again: the array must only
+ * contain zeros. They are backed again when next written, possibly
+ * by another thread.
+ */
+void ZeroParts::release() {
+	if (ptr) {
+		madvise(ptr, len, MADV_DONTNEED);
+	}
+}
+
+/*!
+ * \brief Unmap the array.
+ */
+void ZeroParts::unmap() {
+	if (ptr) {
+		munmap(ptr, len);
+	}
+	ptr = nullptr;
+	len = 0;
+}
@@ -0,0 +1,155 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file partAllocator.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Allocator for the arrays of the particles
+ *
+ * Header file for partAllocator.cpp.
+ * It defines the class PartAllocator, the type PartVector, the class
+ * ZeroParts (arrays backed where written) and the choice
+ * of the pages backing the large arrays.
+ */
+
+#ifndef ACTIVEBROWNIAN_PARTALLOCATOR_H_
+#define ACTIVEBROWNIAN_PARTALLOCATOR_H_
+
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <iostream>
+
+// Size of a huge page (x86-64)
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+//! Pages backing the large arrays
+enum HugePages {
+	HUGE_PAGES_NONE, //!< Normal pages
+	HUGE_PAGES_TRANSPARENT, //!< Transparent huge pages (madvise)
+	HUGE_PAGES_EXPLICIT //!< Explicit huge pages (hugetlbfs pool)
+};
+
+//! Choose the pages backing the large arrays allocated from now on
+void setHugePages(const HugePages mode);
+//! Allocate memory for an array of the particles (aligned on 64 bytes)
+void * allocParts(const size_t bytes);
+//! Free memory allocated by allocParts
+void freeParts(void *p);
+//! Print the pages actually backing the arrays
+void printHugePages(std::ostream &out);
+
+/*!
+ * \brief Allocator for the arrays of the particles
+ *
+ * The elements are default-initialized: resizing a vector of doubles
+ * does not write to the memory. The pages of a large array are then
+ * only mapped when first written, on the NUMA node of the thread which
+ * writes them (first touch), which lets each thread place its share.
+ * The arrays larger than a huge page are backed by huge pages
+ * if requested by setHugePages(), which reduces the TLB misses
+ * of the random accesses to the neighbors.
+ */
+template<typename T>
+class PartAllocator {
+	public:
+		typedef T value_type;
+
+		PartAllocator() {}
+		template<typename U>
+		PartAllocator(const PartAllocator<U> &) {}
+
+		//! Allocate memory for n objects
+		T * allocate(const size_t n) {
+			return static_cast<T *>(allocParts(n * sizeof(T)));
+		}
+		//! Free memory
+		void deallocate(T *p, const size_t) {
+			freeParts(p);
+		}
+
+		//! Default-initialize (no value written for the basic types)
+		template<typename U>
+		void construct(U *p) {
+			::new(static_cast<void *>(p)) U;
+		}
+		//! Construct from arguments
+		template<typename U, typename... Args>
+		void construct(U *p, Args&&... args) {
+			::new(static_cast<void *>(p)) U(std::forward<Args>(args)...);
+		}
+};
+
+template<typename T, typename U>
+bool operator==(const PartAllocator<T> &, const PartAllocator<U> &) {
+	return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const PartAllocator<T> &, const PartAllocator<U> &) {
+	return false;
+}
+
+//! Vector for the arrays of the particles
+template<typename T>
+using PartVector = std::vector<T, PartAllocator<T> >;
+
+/*!
+ * \brief Array of doubles which reads as zero until written
+ *
+ * The memory is mapped without being backed: only the pages which are
+ * written cost memory, on the NUMA node of the thread writing them.
+ * A thread can then index an array of all the particles while using
+ * only the range of them it works on.
+ */
+class ZeroParts {
+	public:
+		ZeroParts() : ptr(nullptr), len(0) {}
+		~ZeroParts() {
+			unmap();
+		}
+		ZeroParts(const ZeroParts &) = delete;
+		ZeroParts & operator=(const ZeroParts &) = delete;
+
+		//! Map n doubles equal to zero (replacing the previous array)
+		void assign(const size_t n);
+		//! Give back the memory of an array of zeros (still mapped)
+		void release();
+		//! Pointer to the first element
+		double * data() {
+			return ptr;
+		}
+		//! Element i
+		double & operator[](const size_t i) {
+			return ptr[i];
+		}
+		//! Tell whether the array is mapped
+		bool empty() const {
+			return !ptr;
+		}
+
+	private:
+		void unmap(); //!< Unmap the array
+
+		double *ptr; //!< Elements
+		size_t len; //!< Length of the mapping in bytes
+};
+
+#endif // ACTIVEBROWNIAN_PARTALLOCATOR_H_
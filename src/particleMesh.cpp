@@ -0,0 +1,238 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file particleMesh.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Long-range interactions with a particle-mesh method
+ *
+ * Implementation of the methods of the classes Fft and ParticleMesh.
+*/
+
+#include <cmath>
+#include <algorithm>
+#include "particleMesh.h"
+#include "gridCell.h"
+
+/*!
+ * \brief Smallest power of 2 larger than or equal to n
+ */
+static long nextPow2(const long n) {
+	long p = 1;
+	while (p < n) {
+		p *= 2;
+	}
+	return p;
+}
+
+/*!
+ * \brief Constructor of Fft
+ *
+ * \param _n Size of the transform (power of 2)
+ */
+Fft::Fft(const long _n) : n(_n) {
+	twiddles.resize(n / 2);
+	for (long k = 0 ; k < n / 2 ; ++k) {
+		twiddles[k] = std::polar(1.0, -2.0 * M_PI * k / n);
+	}
+	rev.resize(n);
+	long bits = 0;
+	while ((1l << bits) < n) {
+		++bits;
+	}
+	for (long k = 0 ; k < n ; ++k) {
+		long r = 0;
+		for (long b = 0 ; b < bits ; ++b) {
+			r |= ((k >> b) & 1) << (bits - 1 - b);
+		}
+		rev[k] = r;
+	}
+}
+
+/*!
+ * \brief In-place transform
+ *
+ * The inverse transform is not normalized.
+ *
+ * \param data Pointer to the first value
+ * \param stride Distance between two consecutive values
+ * \param inverse Compute the inverse transform
+ */
+void Fft::transform(std::complex<double> *data, const long stride,
+		            const bool inverse) const {
+	for (long k = 0 ; k < n ; ++k) {
+		if (k < rev[k]) {
+			std::swap(data[k * stride], data[rev[k] * stride]);
+		}
+	}
+	for (long len = 2 ; len <= n ; len *= 2) {
+		const long half = len / 2;
+		const long step = n / len;
+		for (long s = 0 ; s < n ; s += len) {
+			for (long k = 0 ; k < half ; ++k) {
+				std::complex<double> w = twiddles[k * step];
+				if (inverse) {
+					w = std::conj(w);
+				}
+				std::complex<double> &a = data[(s + k) * stride];
+				std::complex<double> &b = data[(s + k + half) * stride];
+				std::complex<double> t = w * b;
+				b = a - t;
+				a += t;
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Constructor of ParticleMesh
+ *
+ * Compute the influence function. The Fourier transform of the smooth
+ * part of the potential is 2 pi exp(-k^2 / (4 alpha^2)) / k^2;
+ * it is divided by the square of the Fourier transform of the
+ * cloud-in-cell assignment function, which is applied twice
+ * (spreading and interpolation).
+ *
+ * \param _len_x Length of the box along x
+ * \param _len_y Length of the box along y
+ * \param step Approximate spacing of the mesh
+ * \param _cutoff Cutoff of the real-space part
+ * \param _strength Strength of the interaction
+ */
+ParticleMesh::ParticleMesh(const double _len_x, const double _len_y,
+		                   const double step, const double _cutoff,
+						   const double _strength) :
+	len_x(_len_x), len_y(_len_y), cutoff(_cutoff),
+	alpha(EWALD_ALPHA_CUTOFF / _cutoff), strength(_strength),
+	n_x(nextPow2((long) std::ceil(_len_x / step))),
+	n_y(nextPow2((long) std::ceil(_len_y / step))),
+	fft_x(n_x), fft_y(n_y) {
+	const long n_nodes = n_x * n_y;
+	kernel[0].assign(n_nodes, 0);
+	kernel[1].assign(n_nodes, 0);
+	rho.resize(n_nodes);
+	field[0].resize(n_nodes);
+	field[1].resize(n_nodes);
+
+	const double area = len_x * len_y;
+	for (long j = 0 ; j < n_y ; ++j) {
+		long mj = (j < n_y / 2) ? j : j - n_y;
+		double ky = 2. * M_PI * mj / len_y;
+		double sy = (mj == 0) ? 1. : std::sin(M_PI * mj / n_y)
+		                             / (M_PI * mj / n_y);
+		for (long i = 0 ; i < n_x ; ++i) {
+			long mi = (i < n_x / 2) ? i : i - n_x;
+			if (mi == 0 && mj == 0) {
+				continue; // Neutralizing background
+			}
+			double kx = 2. * M_PI * mi / len_x;
+			double sx = (mi == 0) ? 1. : std::sin(M_PI * mi / n_x)
+			                             / (M_PI * mi / n_x);
+			double k2 = kx * kx + ky * ky;
+			// Cloud-in-cell: W(k) = sinc^2 along each axis
+			double w = sx * sx * sy * sy;
+			double g = strength * 2. * M_PI * std::exp(-k2 / (4 * alpha * alpha))
+				       / (k2 * area * w * w);
+			// Derivative (the Nyquist modes are odd and are dropped)
+			kernel[0][i + n_x * j] = (2 * i == n_x) ? 0. : kx * g;
+			kernel[1][i + n_x * j] = (2 * j == n_y) ? 0. : ky * g;
+		}
+	}
+}
+
+/*!
+ * \brief Two-dimensional transform of a mesh (x is the fastest index)
+ */
+void ParticleMesh::transform2d(std::vector< std::complex<double> > &mesh,
+		                       const bool inverse) const {
+	for (long j = 0 ; j < n_y ; ++j) {
+		fft_x.transform(&mesh[n_x * j], 1, inverse);
+	}
+	for (long i = 0 ; i < n_x ; ++i) {
+		fft_y.transform(&mesh[i], n_x, inverse);
+	}
+}
+
+/*!
+ * \brief Nodes and weights of the cloud-in-cell assignment
+ *
+ * \param x Position along x (between 0 and len_x)
+ * \param y Position along y (between 0 and len_y)
+ * \param nodes Indices of the 4 surrounding nodes (output)
+ * \param weights Corresponding weights (output)
+ */
+inline void ParticleMesh::cic(const double x, const double y, long nodes[4],
+		                      double weights[4]) const {
+	double u = x * n_x / len_x;
+	double v = y * n_y / len_y;
+	long i0, i1, j0, j1;
+	gridCell(u, n_x, i0, i1);
+	gridCell(v, n_y, j0, j1);
+
+	nodes[0] = i0 + n_x * j0;
+	nodes[1] = i1 + n_x * j0;
+	nodes[2] = i0 + n_x * j1;
+	nodes[3] = i1 + n_x * j1;
+	weights[0] = (1. - u) * (1. - v);
+	weights[1] = u * (1. - v);
+	weights[2] = (1. - u) * v;
+	weights[3] = u * v;
+}
+
+/*!
+ * \brief Add the long-range forces (all the particles have unit charge)
+ *
+ * \param pos Positions of the particles (in the box)
+ * \param forces Forces, to which the long-range part is added
+ */
+void ParticleMesh::addForces(const std::array<PartVector<double>, 2> &pos,
+		                     std::array<PartVector<double>, 2> &forces) {
+	const long n_parts = pos[0].size();
+	const long n_nodes = n_x * n_y;
+	long nodes[4];
+	double weights[4];
+
+	// Spreading
+	std::fill(rho.begin(), rho.end(), 0.);
+	for (long i = 0 ; i < n_parts ; ++i) {
+		cic(pos[0][i], pos[1][i], nodes, weights);
+		for (int c = 0 ; c < 4 ; ++c) {
+			rho[nodes[c]] += weights[c];
+		}
+	}
+
+	// Convolution and derivative: E(k) = -i k G(k) rho(k)
+	transform2d(rho, false);
+	const std::complex<double> mi(0., -1.);
+	for (long n = 0 ; n < n_nodes ; ++n) {
+		field[0][n] = mi * kernel[0][n] * rho[n];
+		field[1][n] = mi * kernel[1][n] * rho[n];
+	}
+	transform2d(field[0], true);
+	transform2d(field[1], true);
+
+	// Interpolation
+	for (long i = 0 ; i < n_parts ; ++i) {
+		cic(pos[0][i], pos[1][i], nodes, weights);
+		for (int c = 0 ; c < 4 ; ++c) {
+			forces[0][i] += weights[c] * field[0][nodes[c]].real();
+			forces[1][i] += weights[c] * field[1][nodes[c]].real();
+		}
+	}
+}
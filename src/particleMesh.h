@@ -0,0 +1,119 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file particleMesh.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Long-range interactions with a particle-mesh method
+ *
+ * Header file for particleMesh.cpp.
+ * It defines the classes Fft and ParticleMesh.
+ */
+
+#ifndef ACTIVEBROWNIAN_PARTICLEMESH_H_
+#define ACTIVEBROWNIAN_PARTICLEMESH_H_
+
+#include <vector>
+#include <array>
+#include <complex>
+#include "partAllocator.h"
+
+// alpha * cutoff for the Ewald splitting
+#define EWALD_ALPHA_CUTOFF 3.0
+
+/*!
+ * \brief Class for one-dimensional fast Fourier transforms
+ *
+ * Radix-2 Cooley-Tukey algorithm: the size should be a power of 2.
+ * The twiddle factors and the bit reversal permutation are computed once.
+ */
+class Fft {
+	public:
+		Fft(const long _n);
+		//! In-place transform of n values separated by stride
+		void transform(std::complex<double> *data, const long stride,
+				       const bool inverse) const;
+
+	private:
+		const long n; //!< Size of the transform
+		std::vector< std::complex<double> > twiddles; //!< exp(-2 i pi k / n)
+		std::vector<long> rev; //!< Bit reversal permutation
+};
+
+/*!
+ * \brief Class for the long-range interactions in dimension 2
+ *
+ * The particles interact through the 2d Coulomb potential -g ln(r),
+ * which is split following Ewald. The splitting parameter alpha is chosen
+ * such that the real-space part is negligible (exp(-9)) beyond the cutoff. The short-range part,
+ * g E1(alpha^2 r^2) / 2, is computed in real space with the cell list
+ * (see State). The long-range part is computed on a periodic mesh:
+ * the particles are spread on the mesh (cloud-in-cell), the mesh is
+ * Fourier transformed, multiplied by the smooth kernel and differentiated,
+ * and the field is interpolated back at the particles.
+ * The cost is O(N + M log M) for M nodes, i.e. O(N log N).
+ */
+class ParticleMesh {
+	public:
+		ParticleMesh(const double _len_x, const double _len_y,
+				     const double step, const double _cutoff,
+					 const double _strength);
+		//! Add the long-range forces
+		void addForces(const std::array<PartVector<double>, 2> &pos,
+				       std::array<PartVector<double>, 2> &forces);
+
+		//! Get the cutoff of the real-space part
+		double getCutoff() const {
+			return cutoff;
+		}
+		//! Get the Ewald splitting parameter
+		double getAlpha() const {
+			return alpha;
+		}
+		//! Get the strength of the interaction
+		double getStrength() const {
+			return strength;
+		}
+
+	private:
+		//! Two-dimensional transform of a mesh
+		void transform2d(std::vector< std::complex<double> > &mesh,
+				         const bool inverse) const;
+		//! Nodes and weights of the cloud-in-cell assignment
+		void cic(const double x, const double y, long nodes[4],
+				 double weights[4]) const;
+
+		const double len_x; //!< Length of the box along x
+		const double len_y; //!< Length of the box along y
+		const double cutoff; //!< Cutoff of the real-space part
+		const double alpha; //!< Ewald splitting parameter
+		const double strength; //!< Strength of the interaction
+		long n_x; //!< Number of nodes along x (power of 2)
+		long n_y; //!< Number of nodes along y (power of 2)
+		Fft fft_x; //!< Transform along x
+		Fft fft_y; //!< Transform along y
+
+		//! Influence function for the derivative along x and y
+		std::array<std::vector<double>, 2> kernel;
+		std::vector< std::complex<double> > rho; //!< Charge on the mesh
+		//! Field along x and y on the mesh
+		std::array<std::vector< std::complex<double> >, 2> field;
+};
+
+#endif // ACTIVEBROWNIAN_PARTICLEMESH_H_
@@ -0,0 +1,209 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file replay.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Play back of a stored trajectory
+ *
+ * Implementation of the methods of the class Replay.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "replay.h"
+
+/*!
+ * \brief Constructor of Replay
+ *
+ * Start at the first frame and start the thread reading in advance.
+ *
+ * \param _traj Trajectory (with at least one frame)
+ * \param _speed Initial speed in frames per second
+ * \param _depth Number of frames read in advance
+ */
+Replay::Replay(const TrajReader *_traj, const double _speed,
+               const long _depth) :
+	traj(_traj), n_frames(std::max(_traj->getNFrames(), 1L)),
+	depth(_depth), pos(0.), speed(_speed), paused(false),
+	last(std::chrono::steady_clock::now()), target(0), direction(1),
+	stop(false) {
+	prefetcher = std::thread(&Replay::prefetchLoop, this);
+	notifyPrefetch();
+}
+
+/*!
+ * \brief Destructor of Replay
+ *
+ * Stop the thread reading in advance.
+ */
+Replay::~Replay() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv.notify_one();
+	prefetcher.join();
+}
+
+/*!
+ * \brief Advance with the clock and give the frame to display.
+ *
+ * The position moves by the speed times the time elapsed since
+ * the last call (unless paused), looping over the trajectory.
+ *
+ * \return Current frame
+ */
+long Replay::update() {
+	auto now = std::chrono::steady_clock::now();
+	double elapsed = std::chrono::duration<double>(now - last).count();
+	last = now;
+	if (!paused) {
+		pos = std::fmod(pos + speed * elapsed, (double) n_frames);
+		if (pos < 0.) {
+			pos += n_frames;
+		}
+	}
+	notifyPrefetch();
+	return std::min(getFrame(), n_frames - 1);
+}
+
+/*!
+ * \brief Pause or resume the play back.
+ */
+void Replay::togglePause() {
+	paused = !paused;
+}
+
+/*!
+ * \brief Play twice faster.
+ */
+void Replay::faster() {
+	speed *= 2.;
+}
+
+/*!
+ * \brief Play twice slower.
+ */
+void Replay::slower() {
+	speed /= 2.;
+}
+
+/*!
+ * \brief Play in the other direction.
+ */
+void Replay::reverse() {
+	speed = -speed;
+}
+
+/*!
+ * \brief Go to a frame.
+ *
+ * \param k Frame (clamped to the trajectory)
+ */
+void Replay::seek(const long k) {
+	pos = std::max(0L, std::min(k, n_frames - 1));
+	notifyPrefetch();
+}
+
+/*!
+ * \brief Move by a number of frames, looping over the trajectory.
+ *
+ * \param dk Number of frames (negative backwards)
+ */
+void Replay::step(const long dk) {
+	long k = (getFrame() + dk) % n_frames;
+	seek(k < 0 ? k + n_frames : k);
+}
+
+/*!
+ * \brief Print the current frame, time and speed.
+ *
+ * \param out Output stream
+ */
+void Replay::printStatus(std::ostream &out) const {
+	out << "Frame " << getFrame() << "/" << n_frames << ", t="
+		<< getFrame() * traj->getDtFrame() << ", speed " << speed
+		<< " frames/s" << (paused ? " (paused)" : "");
+}
+
+/*!
+ * \brief Give the current frame and direction to the prefetcher.
+ */
+void Replay::notifyPrefetch() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		target = getFrame();
+		direction = (speed < 0.) ? -1 : 1;
+	}
+	cv.notify_one();
+}
+
+/*!
+ * \brief Loop of the thread reading in advance.
+ *
+ * The next frames in the direction of play are requested from the
+ * system, and their pages are read here, so that the visualization
+ * finds them in memory. The frames already read are not read again
+ * while the play back goes on.
+ */
+void Replay::prefetchLoop() {
+	const long n_parts = traj->getNParts();
+	const int n_fields = traj->getNFields();
+	// Number of floats in a page
+	const long stride = 4096 / sizeof(float);
+	long done_begin = 0, done_end = 0; // Frames already read
+	volatile float sink = 0.;
+
+	// Frames to read for the current frame and direction
+	auto window = [&](long &k_begin, long &k_end) {
+		k_begin = std::max((direction > 0) ? target : target - depth + 1, 0L);
+		k_end = std::min((direction > 0) ? target + depth : target + 1,
+		                 n_frames);
+	};
+
+	while (true) {
+		long k_begin, k_end;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [&] {
+				window(k_begin, k_end);
+				return stop || k_begin < done_begin || k_end > done_end;
+			});
+			if (stop) {
+				return;
+			}
+		}
+
+		traj->prefetch(k_begin, k_end);
+		for (long f = k_begin ; f < k_end ; ++f) {
+			if (f >= done_begin && f < done_end) {
+				continue;
+			}
+			for (int c = 0 ; c < n_fields ; ++c) {
+				const float *field = traj->getField(f, c);
+				for (long i = 0 ; i < n_parts ; i += stride) {
+					sink = sink + field[i];
+				}
+			}
+		}
+		done_begin = k_begin;
+		done_end = k_end;
+	}
+}
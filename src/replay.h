@@ -0,0 +1,104 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file replay.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Play back of a stored trajectory
+ *
+ * Header file for replay.cpp.
+ * It defines the class Replay.
+ */
+
+#ifndef ACTIVEBROWNIAN_REPLAY_H_
+#define ACTIVEBROWNIAN_REPLAY_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include "trajectory.h"
+
+/*!
+ * \brief Class for the play back of a trajectory
+ *
+ * It gives the frame to display at a given time, depending on the speed
+ * (possibly negative), the pauses and the seeks. It is independent of
+ * the visualization, which calls it from its own thread.
+ * A background thread asks the system to read the next frames
+ * in the direction of play, so that large files play smoothly.
+ */
+class Replay {
+	public:
+		Replay(const TrajReader *_traj, const double _speed=24.,
+		       const long _depth=16);
+		~Replay();
+		Replay(const Replay &) = delete;
+		Replay & operator=(const Replay &) = delete;
+
+		long update(); //!< Advance with the clock and give the frame
+		void togglePause(); //!< Pause or resume
+		void faster(); //!< Play twice faster
+		void slower(); //!< Play twice slower
+		void reverse(); //!< Play in the other direction
+		void seek(const long k); //!< Go to frame k
+		void step(const long dk); //!< Move by dk frames
+
+		//! Trajectory
+		const TrajReader * getTraj() const {
+			return traj;
+		}
+		//! Current frame
+		long getFrame() const {
+			return (long) pos;
+		}
+		//! Speed in frames per second
+		double getSpeed() const {
+			return speed;
+		}
+		//! Whether the play back is paused
+		bool isPaused() const {
+			return paused;
+		}
+		//! Print the current frame, time and speed
+		void printStatus(std::ostream &out) const;
+
+	private:
+		void prefetchLoop(); //!< Loop of the thread reading in advance
+		void notifyPrefetch(); //!< Give the current frame to the thread
+
+		const TrajReader *traj; //!< Trajectory
+		const long n_frames; //!< Number of frames
+		const long depth; //!< Number of frames read in advance
+		double pos; //!< Current position (in frames)
+		double speed; //!< Speed (frames per second, negative backwards)
+		bool paused; //!< Whether the play back is paused
+		//! Time of the last update
+		std::chrono::steady_clock::time_point last;
+
+		std::thread prefetcher; //!< Thread reading in advance
+		std::mutex mtx; //!< Mutex for the requests
+		std::condition_variable cv; //!< Signal of a new request
+		long target; //!< Current frame for the prefetcher
+		int direction; //!< Direction of play for the prefetcher
+		bool stop; //!< Tell the prefetcher to exit
+};
+
+#endif // ACTIVEBROWNIAN_REPLAY_H_
@@ -27,11 +27,21 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <exception>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <memory>
 #include <boost/program_options.hpp>
+#include "arena.h"
 #include "observables.h"
+#include "obsWriter.h"
+#include "configuration.h"
+#include "driftDetector.h"
 #include "simul.h"
 #include "state.h"
 #include "state3d.h"
+#include "workers.h"
+#include "ompPragma.h"
 
 #ifndef NOVISU
 #include <thread>
@@ -68,12 +78,59 @@ Simul::Simul(int argc, char **argv) {
 		("iters,I", po::value<long>(&n_iters)->required(),
 		 "Number of time iterations")
 		("itersTh,J", po::value<long>(&n_iters_th)->default_value(0),
-		 "Number of time iterations of thermalization")
+		 "Number of time iterations of thermalization (largest number "
+		 "if automatic)")
+		("thTol", po::value<double>(&th_tol)->default_value(0.0),
+		 "Tolerance on the drift of the observables to stop the "
+		 "thermalization (relative, absolute for the polarization), the "
+		 "drift having also to be below 2 standard errors "
+		 "(0 for a fixed number of iterations)")
+		("thBlock", po::value<long>(&th_block)->default_value(10),
+		 "Samples of the observables in a block (automatic thermalization)")
 		("skip,S", po::value<long>(&skip)->default_value(100),
 		 "Iterations between two computations of observables")
 		("output,O",
 		 po::value<std::string>(&output)->default_value("observables.h5"),
 		 "Name of the output file")
+		("h5Codec",
+		 po::value<std::string>(&h5_codec_str)->default_value("deflate"),
+		 "Compression of the output: none, deflate"
+#ifdef USE_LZ4
+		 ", lz4"
+#endif
+#ifdef USE_ZSTD
+		 ", zstd"
+#endif
+		 )
+		("h5Level", po::value<int>(&h5_level)->default_value(6),
+		 "Level of compression of the output (0 to 9 for deflate, "
+		 "up to 22 for zstd)")
+		("flushEvery", po::value<long>(&flush_every)->default_value(0),
+		 "Samples between two exports of the observables during the run "
+		 "(0 for none)")
+		("traj", po::value<std::string>(&traj_fname)->default_value(""),
+		 "Name of the trajectory file (raw binary, none if empty)")
+		("trajSkip", po::value<long>(&traj_skip)->default_value(100),
+		 "Iterations between two frames of the trajectory")
+		("init", po::value<std::string>(&init_fname)->default_value(""),
+		 "Initial configuration (hdf5 file or trajectory), replicated "
+		 "periodically if the system is larger; random if empty")
+		("initFrame", po::value<long>(&init_frame)->default_value(-1),
+		 "Frame of the trajectory for the initial configuration "
+		 "(negative: from the end)")
+		("initMode",
+		 po::value<std::string>(&init_mode_str)->default_value("random"),
+		 "Generator of the initial configuration: random (overlaps), "
+		 "lattice (triangular) or fire (random without overlaps)")
+		("saveConfig", po::value<std::string>(&save_fname)->default_value(""),
+		 "Save the final configuration to this hdf5 file")
+		("trajCodec",
+		 po::value<std::string>(&traj_codec)->default_value("raw"),
+		 "Encoding of the trajectory: raw (float32) or lossy (compressed)")
+		("trajError", po::value<double>(&traj_error)->default_value(1e-3),
+		 "Largest error on the positions in the lossy trajectory")
+		("keyframes", po::value<long>(&keyframes)->default_value(100),
+		 "Frames between two keyframes of the lossy trajectory")
 		("stepr,s",
 		 po::value<double>(&step_r)->default_value(0.2),
 		 "Spatial resolution for correlations")
@@ -81,6 +138,8 @@ Simul::Simul(int argc, char **argv) {
 		 po::value<long>(&n_div_angle)->default_value(40),
 		 "Number of angular points for correlations")
 		("wca", po::bool_switch(&wca), "Use WCA potential")
+		("energy", po::bool_switch(&energy),
+		 "Output the interaction energy and its time series")
 		("3d,3", po::bool_switch(&sim3d), "Simulation in 3d instead of 2d")
 		("less", po::bool_switch(&less_obs),
 		 "Output only (r, theta) correlations")
@@ -89,9 +148,64 @@ Simul::Simul(int argc, char **argv) {
 		("facBoxes",
 		 po::value<int>(&fac_boxes)->default_value(1),
 		 "Factor for the boxes")
+		("aspectY",
+		 po::value<double>(&aspect_y)->default_value(1.0),
+		 "Ratio between the lengths of the box along y and x")
+		("aspectZ",
+		 po::value<double>(&aspect_z)->default_value(1.0),
+		 "Ratio between the lengths of the box along z and x (3d)")
+		("walls",
+		 po::value<std::string>(&walls_str)->default_value("none"),
+		 "Confining walls: none, flat, channel or circle")
+		("activProfile",
+		 po::value<std::string>(&activ_profile_str)->default_value("uniform"),
+		 "Profile of activity: uniform, sine or step")
+		("activAmp", po::value<double>(&activ_amp)->default_value(0.5),
+		 "Relative amplitude of the modulation of activity")
+		("gravity,g", po::value<double>(&gravity)->default_value(0.0),
+		 "Intensity of gravity (along -y)")
+		("trap", po::value<double>(&trap)->default_value(0.0),
+		 "Stiffness of the harmonic trap at the center of the box")
+		("fieldStep", po::value<double>(&field_step)->default_value(0.5),
+		 "Spacing of the grid for the external fields")
+		("align,A", po::value<double>(&align_strength)->default_value(0.0),
+		 "Strength of the alignment torques")
+		("alignRadius",
+		 po::value<double>(&align_radius)->default_value(1.0),
+		 "Radius within which the particles align")
+		("nematic", po::bool_switch(&nematic),
+		 "Nematic instead of polar alignment")
+		("mass,m", po::value<double>(&mass)->default_value(0.0),
+		 "Mass of the particles (underdamped dynamics if nonzero)")
+		("shear", po::value<double>(&shear_rate)->default_value(0.0),
+		 "Shear rate (Lees-Edwards boundary conditions)")
+		("longRange", po::value<double>(&long_range)->default_value(0.0),
+		 "Strength of the long-range (2d Coulomb) repulsion")
+		("ewaldCutoff",
+		 po::value<double>(&ewald_cutoff)->default_value(2.5),
+		 "Cutoff of the real-space part of the long-range forces")
+		("meshStep", po::value<double>(&mesh_step)->default_value(0.4),
+		 "Spacing of the mesh for the long-range forces")
+		("ghosts", po::bool_switch(&ghosts),
+		 "Use ghost copies of the particles at the periodic boundaries")
+		("cellRebuild", po::value<long>(&cell_rebuild)->default_value(0),
+		 "Steps between the full rebuilds of the boxes, only the particles "
+		 "changing box being moved in between (0: rebuild at each step)")
+		("threads", po::value<int>(&n_threads)->default_value(1),
+		 "Number of threads for the forces")
+		("sortEvery", po::value<long>(&sort_every)->default_value(1000),
+		 "Steps between the sorts of the particles by box, with several "
+		 "threads (0: only at the start)")
+		("pin", po::bool_switch(&pin),
+		 "Pin the threads to their CPUs")
+		("hugePages",
+		 po::value<std::string>(&huge_pages_str)->default_value("none"),
+		 "Pages of the particle arrays: none, thp or explicit")
 #ifndef NOVISU
 		("sleep", po::value<int>(&sleep)->default_value(0),
 		 "Number of milliseconds to sleep for between iterations")
+		("replay", po::value<std::string>(&replay_fname),
+		 "Play back a trajectory file instead of simulating")
 #endif
 		("help,h", "Print help message and exit")
 		;
@@ -107,6 +221,13 @@ Simul::Simul(int argc, char **argv) {
 			status = SIMUL_INIT_HELP;
 			return;
 		}
+#ifndef NOVISU
+		// Play back: the parameters of the simulation are not needed
+		if (vars.count("replay")) {
+			replay_fname = vars["replay"].as<std::string>();
+			return;
+		}
+#endif
 
         po::notify(vars);
 	} catch (std::exception &e) {
@@ -121,7 +242,150 @@ Simul::Simul(int argc, char **argv) {
 		|| notPositive(temperature, "T") || notPositive(rot_dif, "rot_dif")
 		|| notPositive(activity, "actity") || notStrPositive(dt, "dt")
 		|| notPositive(n_iters, "n_iters")
-		|| notStrPositive(fac_boxes, "fac_boxes")) {
+		|| notStrPositive(fac_boxes, "fac_boxes")
+		|| notStrPositive(aspect_y, "aspectY")
+		|| notStrPositive(aspect_z, "aspectZ")) {
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+
+	if (walls_str == "none") {
+		walls = WALLS_NONE;
+	} else if (walls_str == "flat") {
+		walls = WALLS_FLAT;
+	} else if (walls_str == "channel") {
+		walls = WALLS_CHANNEL;
+	} else if (walls_str == "circle") {
+		walls = WALLS_CIRCLE;
+	} else {
+		std::cerr << "Error: unknown type of walls " << walls_str
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (huge_pages_str == "none") {
+		huge_pages = HUGE_PAGES_NONE;
+	} else if (huge_pages_str == "thp") {
+		huge_pages = HUGE_PAGES_TRANSPARENT;
+	} else if (huge_pages_str == "explicit") {
+		huge_pages = HUGE_PAGES_EXPLICIT;
+	} else {
+		std::cerr << "Error: unknown type of huge pages " << huge_pages_str
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (sim3d && walls != WALLS_NONE) {
+		std::cerr << "Error: walls are only implemented in 2d" << std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+
+	if (activ_profile_str == "uniform") {
+		activ_profile = ACTIV_UNIFORM;
+	} else if (activ_profile_str == "sine") {
+		activ_profile = ACTIV_SINE;
+	} else if (activ_profile_str == "step") {
+		activ_profile = ACTIV_STEP;
+	} else {
+		std::cerr << "Error: unknown profile of activity "
+			<< activ_profile_str << std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (notPositive(trap, "trap") || notStrPositive(field_step, "fieldStep")
+		|| notPositive(align_strength, "align")
+		|| notStrPositive(align_radius, "alignRadius")
+		|| notPositive(mass, "mass")
+		|| notPositive(long_range, "longRange")
+		|| notStrPositive(ewald_cutoff, "ewaldCutoff")
+		|| notStrPositive(mesh_step, "meshStep")
+		|| notStrPositive(n_threads, "threads")
+		|| notStrPositive(traj_skip, "trajSkip")
+		|| notStrPositive(traj_error, "trajError")
+		|| notStrPositive(keyframes, "keyframes")
+		|| notPositive(h5_level, "h5Level")
+		|| notPositive(flush_every, "flushEvery")
+		|| notPositive(th_tol, "thTol")
+		|| notStrPositive(th_block, "thBlock")
+		|| notPositive(cell_rebuild, "cellRebuild")
+		|| notPositive(sort_every, "sortEvery")) {
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (th_tol > 0.0 && n_iters_th == 0) {
+		std::cerr << "Error: the automatic thermalization needs a largest "
+			"number of iterations (itersTh)" << std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (init_mode_str == "random") {
+		init_mode = INIT_RANDOM;
+	} else if (init_mode_str == "lattice") {
+		init_mode = INIT_LATTICE;
+	} else if (init_mode_str == "fire") {
+		init_mode = INIT_FIRE;
+	} else {
+		std::cerr << "Error: unknown initial configuration " << init_mode_str
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (init_mode != INIT_RANDOM && (!init_fname.empty()
+		                             || walls != WALLS_NONE)) {
+		std::cerr << "Error: the generated initial configurations are "
+			"incompatible with --init and walls" << std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (!init_fname.empty() && walls != WALLS_NONE) {
+		// The saved (and replicated) particles could be beyond the walls
+		std::cerr << "Error: --init is incompatible with walls" << std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (!parseH5Codec(h5_codec_str, h5_codec)) {
+		std::cerr << "Error: unknown or unavailable codec " << h5_codec_str
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (h5_level > maxH5Level(h5_codec) && maxH5Level(h5_codec) >= 0) {
+		std::cerr << "Error: the level of compression of " << h5_codec_str
+			<< " should be between 0 and " << maxH5Level(h5_codec)
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (traj_codec != "raw" && traj_codec != "lossy") {
+		std::cerr << "Error: unknown encoding of the trajectory " << traj_codec
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (sim3d && (activ_profile != ACTIV_UNIFORM || gravity != 0.0
+				  || trap != 0.0 || align_strength > 0.0 || mass > 0.0
+				  || shear_rate != 0.0 || long_range > 0.0 || ghosts
+				  || n_threads > 1 || pin || !init_fname.empty()
+				  || !save_fname.empty() || init_mode != INIT_RANDOM
+				  || th_tol > 0.0 || energy || cell_rebuild > 0)) {
+		std::cerr << "Error: external fields, alignment, inertia, shear, "
+			"long-range forces, ghosts, threads (and their pinning), "
+			"saved configurations, automatic thermalization, energy and "
+			"incremental boxes are only implemented in 2d"
+			<< std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (shear_rate != 0.0 && (walls != WALLS_NONE || mass > 0.0 || ghosts)) {
+		std::cerr << "Error: shear is incompatible with walls, inertia "
+			"and ghosts" << std::endl;
+		status = SIMUL_INIT_FAILED;
+		return;
+	}
+	if (long_range > 0.0 && (walls != WALLS_NONE || shear_rate != 0.0)) {
+		std::cerr << "Error: long-range forces require a periodic system"
+			<< std::endl;
 		status = SIMUL_INIT_FAILED;
 		return;
 	}
@@ -132,13 +396,36 @@ Simul::Simul(int argc, char **argv) {
 		status = SIMUL_INIT_FAILED;
 	}
 
+	// The area (or volume) is n_parts / rho whatever the aspect ratios
 	if (sim3d) {
-		len = std::cbrt(n_parts / rho);
+		lens[0] = std::cbrt(n_parts / (rho * aspect_y * aspect_z));
+		lens[1] = aspect_y * lens[0];
+		lens[2] = aspect_z * lens[0];
 	} else {
-		len = std::sqrt(n_parts / rho);
+		lens[0] = std::sqrt(n_parts / (rho * aspect_y));
+		lens[1] = aspect_y * lens[0];
+		lens[2] = 0.0;
+	}
+	// Range of the interactions (size of the boxes): the nearest image
+	// is unique only if every side is at least twice as long
+	const double range = std::max({(wca ? TWOONESIXTH : 1.0),
+	                               (align_strength > 0.0 ? align_radius : 0.0),
+	                               (long_range > 0.0 ? ewald_cutoff : 0.0)});
+	for (int a = 0 ; a < (sim3d ? 3 : 2) ; ++a) {
+		if (lens[a] < 2.0 * range) {
+			std::cerr << "Error: the sides of the box (" << lens[0] << " x "
+				<< lens[1];
+			if (sim3d) {
+				std::cerr << " x " << lens[2];
+			}
+			std::cerr << ") should be at least twice the range of the "
+				"interactions (" << range << ")" << std::endl;
+			status = SIMUL_INIT_FAILED;
+			return;
+		}
 	}
 #ifdef NOVISU
-	if (sim3d) {
+	if (sim3d && traj_fname.empty()) {
 		std::cerr << "Currently no output for 3d simulations..." << std::endl;
 		status = SIMUL_INIT_FAILED;
 	}
@@ -158,15 +445,40 @@ void Simul::run() {
 		          << std::endl;
 		return;
 	}
+#ifndef NOVISU
+	if (!replay_fname.empty()) {
+		if (!runReplay()) {
+			status = SIMUL_RUN_FAILED;
+		}
+		return;
+	}
+#endif
+
+	// Pages of the large arrays, with fallback to normal pages
+	setHugePages(huge_pages);
+#ifdef USE_OPENMP
+	// Threads of the loops over the particles (before the states are
+	// built, which draw a random generator per thread)
+	omp_set_num_threads(n_threads);
+#endif
 
 	if (sim3d) {
 		// Initialize the state of the system
-		State3d state(len, n_parts, pot_strength, temperature, rot_dif,
+		State3d state(lens, n_parts, pot_strength, temperature, rot_dif,
 				      activity, dt, fac_boxes);
+		if (huge_pages != HUGE_PAGES_NONE) {
+			printHugePages(std::cout);
+		}
+		std::unique_ptr<TrajWriter> traj;
+		std::unique_ptr<TrajEncoder> traj_enc;
+		if (!openTraj(traj, traj_enc, 3, nullptr)) {
+			status = SIMUL_RUN_FAILED;
+			return;
+		}
 		
 		// Start thread for visualization
 #ifndef NOVISU
-		Visu3d visu(&state, len, n_parts);
+		Visu3d visu(&state, lens, n_parts);
 		std::thread thVisu(&Visu3d::run, &visu); 
 #endif
 
@@ -175,8 +487,19 @@ void Simul::run() {
 			state.evolve();
 		}
 		// Time evolution
+		long n_allocs = 0;
 		for (long t = 0 ; t < n_iters ; ++t) {
 			state.evolve();
+			if (t % traj_skip == 0) {
+				if (traj) {
+					traj->write(&state);
+				} else if (traj_enc) {
+					traj_enc->write(&state);
+				}
+			}
+			if (t == 0) {
+				n_allocs = heapAllocCount();
+			}
 #ifndef NOVISU
 			if (sleep > 0) {
 				std::this_thread::sleep_for(std::chrono::milliseconds(sleep));
@@ -184,31 +507,130 @@ void Simul::run() {
 #endif
 		}
 
+		printAllocs(n_allocs);
+		if (traj_enc) {
+			traj_enc->printStats(std::cout);
+		}
+
 #ifndef NOVISU
 		thVisu.join();
 #endif
 	} else {
-		// Initialize the state of the system
-		State state(len, n_parts, pot_strength, temperature, rot_dif, activity,
-					dt, fac_boxes, wca);
-		Observables obs(len, n_parts, step_r, n_div_angle, less_obs,
-				        cartesian);
+		// External fields, tabulated only if needed
+		std::unique_ptr<ExternalField> field;
+		if (activ_profile != ACTIV_UNIFORM || gravity != 0.0 || trap != 0.0) {
+			field.reset(new ExternalField(lens[0], lens[1], field_step,
+						                  activity, activ_profile, activ_amp,
+										  gravity, trap));
+		}
+
+		// Mesh for the long-range forces
+		std::unique_ptr<ParticleMesh> mesh;
+		if (long_range > 0.0) {
+			mesh.reset(new ParticleMesh(lens[0], lens[1], mesh_step,
+						                ewald_cutoff, long_range));
+		}
+
+		// Threads for the forces, placed on the NUMA nodes
+		std::unique_ptr<Workers> workers;
+		if (n_threads > 1 || pin) {
+			workers.reset(new Workers(n_threads, pin));
+			workers->printTopology(std::cout);
+		}
+
+		// Initialize the state of the system (the energy is also
+		// monitored by the automatic thermalization)
+		State state(lens[0], lens[1], n_parts, pot_strength, temperature,
+				    rot_dif, activity, dt, fac_boxes, wca, walls, field.get(),
+					align_strength, align_radius, nematic, mass, shear_rate,
+					mesh.get(), ghosts, workers.get(), energy || th_tol > 0.0);
+		if (cell_rebuild > 0) {
+			state.setCellRebuild(cell_rebuild);
+		}
+		state.setSortEvery(sort_every);
+		if (init_mode != INIT_RANDOM) {
+			initConfiguration(&state);
+		}
+		if (!init_fname.empty()) {
+			Configuration conf, rep;
+			int n_x, n_y;
+			if (!loadConfiguration(init_fname, init_frame, conf)
+				|| !replicateConfiguration(conf, lens[0], lens[1], n_parts,
+				                           rep, n_x, n_y)) {
+				status = SIMUL_RUN_FAILED;
+				return;
+			}
+			state.setConfiguration(rep.pos_x.data(), rep.pos_y.data(),
+			                       rep.angles.data());
+			std::cout << "# Initial configuration from " << init_fname;
+			if (n_x * n_y > 1) {
+				std::cout << ", replicated " << n_x << " x " << n_y;
+			}
+			std::cout << std::endl;
+		}
+		if (huge_pages != HUGE_PAGES_NONE) {
+			printHugePages(std::cout);
+		}
+		Observables obs(lens[0], lens[1], n_parts, step_r, n_div_angle,
+				        less_obs, cartesian, shear_rate != 0.0,
+						energy ? (n_iters + skip - 1) / skip : 0);
+		std::unique_ptr<TrajWriter> traj;
+		std::unique_ptr<TrajEncoder> traj_enc;
+		if (!openTraj(traj, traj_enc, 2, workers.get())) {
+			status = SIMUL_RUN_FAILED;
+			return;
+		}
+		// Exports during the run, written by another thread (which cannot
+		// share the pool of the forces)
+		long n_iters_th_done = n_iters_th;
+		std::unique_ptr<ObsWriter> obs_writer;
+		if (flush_every > 0) {
+			obs_writer.reset(new ObsWriter(&obs, output, flush_every,
+				[&](const std::string &fname, const ObsSums *snapshot,
+				    const long n_iters_done) {
+					obs.writeH5(fname, rho, n_parts, pot_strength, temperature,
+					            rot_dif, activity, dt, n_iters_done,
+								n_iters_th_done,
+								skip, h5_codec, h5_level, nullptr, snapshot);
+				}));
+		}
 		
 #ifndef NOVISU
 		// Start thread for visualization
-		Visu visu(&state, len, n_parts);
+		Visu visu(&state, lens[0], lens[1], n_parts);
 		std::thread thVisu(&Visu::run, &visu); 
 #endif
 
 		// Thermalization
-		for (long t = 0 ; t < n_iters_th ; ++t) {
-			state.evolve();
+		if (th_tol > 0.0) {
+			n_iters_th_done = thermalize(&state);
+		} else {
+			for (long t = 0 ; t < n_iters_th ; ++t) {
+				state.evolve();
+			}
 		}
 		// Time evolution
+		long n_allocs = 0;
 		for (long t = 0 ; t < n_iters ; ++t) {
+			if (energy && t % skip == 0) {
+				state.requestEnergy();
+			}
 			state.evolve();
 			if (t % skip == 0) {
 				obs.compute(&state);
+				if (obs_writer) {
+					obs_writer->sample(&obs, t + 1);
+				}
+			}
+			if (t % traj_skip == 0) {
+				if (traj) {
+					traj->write(&state);
+				} else if (traj_enc) {
+					traj_enc->write(&state);
+				}
+			}
+			if (t == 0) {
+				n_allocs = heapAllocCount();
 			}
 #ifndef NOVISU
 			if (sleep > 0) {
@@ -217,8 +639,25 @@ void Simul::run() {
 #endif
 		}
 
+		printAllocs(n_allocs);
+		if (traj_enc) {
+			traj_enc->printStats(std::cout);
+		}
+		if (obs_writer) {
+			obs_writer->finish();
+			std::cout << "# Exports of the observables during the run: "
+				<< obs_writer->getNWritten() << std::endl;
+		}
+
+		if (!save_fname.empty()
+			&& !saveConfiguration(save_fname, &state, lens[0], lens[1])) {
+			status = SIMUL_RUN_FAILED;
+		}
+
 		obs.writeH5(output, rho, n_parts, pot_strength, temperature, rot_dif,
-				    activity, dt, n_iters, n_iters_th, skip);
+				    activity, dt, n_iters, n_iters_th_done, skip, h5_codec,
+					h5_level,
+					workers.get());
 		//state.dump();
 
 #ifndef NOVISU
@@ -227,10 +666,157 @@ void Simul::run() {
 	}
 }
 
+/*!
+ * \brief Replace the random initial configuration by one without overlaps.
+ *
+ * FIRE keeps the particles out of the range of the potential, or
+ * a bit less than the spacing of the triangular lattice at high density,
+ * so that the first steps are not stiff.
+ *
+ * \param state State of the system
+ */
+void Simul::initConfiguration(State *state) const {
+	std::mt19937 rng(std::chrono::system_clock::now().time_since_epoch()
+	                 .count());
+	const double spacing = std::sqrt(2.0 / (std::sqrt(3.0) * rho));
+	const double sigma = std::min(wca ? TWOONESIXTH : 1.0, 0.95 * spacing);
+	Configuration conf;
+	std::cout << "# Initial configuration: " << init_mode_str;
+	if (init_mode == INIT_LATTICE) {
+		latticeConfiguration(lens[0], lens[1], n_parts, sigma, rng, conf);
+	} else {
+		long n_steps = fireConfiguration(lens[0], lens[1], n_parts, sigma,
+		                                 rng, conf);
+		std::cout << " (" << n_steps << " steps)";
+	}
+	std::cout << ", smallest distance " << minDistance(conf, sigma)
+		<< std::endl;
+	state->setConfiguration(conf.pos_x.data(), conf.pos_y.data(),
+	                        conf.angles.data());
+}
+
+/*!
+ * \brief Thermalize until the observables stop drifting.
+ *
+ * The average force along the orientation, the polarization and
+ * the interaction energy are sampled every skip iterations, for at most
+ * n_iters_th iterations.
+ *
+ * \param state State of the system
+ * \return Number of iterations of thermalization done
+ */
+long Simul::thermalize(State *state) const {
+	DriftDetector detector(3, th_block, th_tol);
+	// The polarization is about zero in the isotropic phase
+	detector.setAbsolute(1, 1.0);
+	double values[3];
+	long t = 0;
+	bool converged = false;
+	while (t < n_iters_th && !converged) {
+		if (t % skip == 0) {
+			state->requestEnergy();
+		}
+		state->evolve();
+		if (t % skip == 0) {
+			values[0] = state->avgFAlong();
+			values[1] = state->polarization();
+			values[2] = state->getEnergy() / n_parts;
+			converged = detector.add(values);
+		}
+		++t;
+	}
+	std::cout << "# Thermalization: " << t << " iterations, "
+		<< (converged ? "converged" : "not converged") << " (drift "
+		<< detector.getDrift() << ", tolerance " << th_tol << "; "
+		<< detector.getSignificance() << " standard errors)" << std::endl;
+	return t;
+}
+
+#ifndef NOVISU
+/*!
+ * \brief Play back a trajectory.
+ *
+ * The frames are read from the file while they are displayed,
+ * in 2d or 3d depending on the trajectory.
+ *
+ * \return False if the trajectory could not be read
+ */
+bool Simul::runReplay() const {
+	TrajReader traj(replay_fname);
+	if (!traj.isOpen()) {
+		return false;
+	}
+	if (traj.getNFrames() == 0) {
+		std::cerr << "Error: no frame in " << replay_fname << std::endl;
+		return false;
+	}
+
+	Replay replay(&traj);
+	std::cout << "# Keys: space pause, left/right step, down/up seek, "
+		"home/end first/last, +/- speed, " << (traj.getDim() == 3 ? "b" : "r")
+		<< " reverse" << std::endl;
+	if (traj.getDim() == 3) {
+		Visu3d visu(&replay);
+		visu.run();
+	} else {
+		Visu visu(&replay);
+		visu.run();
+	}
+	return true;
+}
+#endif
+
+/*!
+ * \brief Create the trajectory file if one is wanted.
+ *
+ * \param traj Writer of the raw trajectory (left empty if none)
+ * \param traj_enc Encoder of the lossy trajectory (left empty if none)
+ * \param dim Dimension
+ * \param workers Threads encoding the lossy trajectory (or nullptr)
+ * \return False if the file could not be created
+ */
+bool Simul::openTraj(std::unique_ptr<TrajWriter> &traj,
+                     std::unique_ptr<TrajEncoder> &traj_enc, const int dim,
+					 Workers *workers) const {
+	if (traj_fname.empty()) {
+		return true;
+	}
+	if (traj_codec == "lossy") {
+		traj_enc.reset(new TrajEncoder(traj_fname, dim, n_parts, lens,
+		                               dt * traj_skip, traj_error, keyframes,
+									   workers));
+		return traj_enc->isOpen();
+	}
+	traj.reset(new TrajWriter(traj_fname, dim, n_parts, lens, dt * traj_skip,
+	                          (n_iters + traj_skip - 1) / traj_skip));
+	return traj->isOpen();
+}
+
+/*!
+ * \brief Print the number of heap allocations of the time evolution
+ *
+ * Only in debug builds (COUNT_ALLOCS), to check that the steady state
+ * does not allocate memory.
+ *
+ * \param n_allocs Number of allocations after the first time step
+ */
+void Simul::printAllocs(const long n_allocs) const {
+#ifdef COUNT_ALLOCS
+	std::cout << "# Heap allocations after the first step: "
+		<< heapAllocCount() - n_allocs << std::endl;
+#else
+	(void) n_allocs;
+#endif
+}
+
 /*!
  * \brief Print the parameters of the simulation
  */
 void Simul::print() const {
+	if (!replay_fname.empty()) {
+		std::cout << "# Replay of " << replay_fname << std::endl;
+		return;
+	}
 	if (sim3d) {
 		std::cout << "# [3d] ";
 	} else {
@@ -240,7 +826,33 @@ void Simul::print() const {
 	          << ", pot_strength=" << pot_strength << ", temperature="
 			  << temperature << ", rot_dif=" << rot_dif << ", activity="
 			  << activity << ", dt=" << dt << ", n_iters=" << n_iters
-			  << ", n_iters_th=" << n_iters_th << ", skip=" << skip
-			  << ", wca=" << wca << "\n";
+			  << ", n_iters_th=" << n_iters_th << ", th_tol=" << th_tol
+			  << ", th_block=" << th_block << ", skip=" << skip
+			  << ", wca=" << wca << ", energy=" << energy << ", walls=" << walls_str
+			  << ", activ_profile=" << activ_profile_str << ", gravity="
+			  << gravity << ", trap=" << trap << ", align=" << align_strength
+			  << ", nematic=" << nematic << ", mass=" << mass << ", shear="
+			  << shear_rate << ", long_range=" << long_range << ", ghosts="
+			  << ghosts << ", cell_rebuild=" << cell_rebuild
+			  << ", threads=" << n_threads << ", sort_every=" << sort_every
+			  << ", pin=" << pin
+			  << ", huge_pages=" << huge_pages_str << ", h5_codec="
+			  << h5_codec_str << ", h5_level=" << h5_level << ", flush_every="
+			  << flush_every << ", traj=" << traj_fname
+			  << ", traj_skip=" << traj_skip << ", traj_codec=" << traj_codec;
+	if (!init_fname.empty()) {
+		std::cout << ", init=" << init_fname << ", init_frame=" << init_frame;
+	} else {
+		std::cout << ", init_mode=" << init_mode_str;
+	}
+	if (traj_codec == "lossy") {
+		std::cout << ", traj_error=" << traj_error << ", keyframes="
+			<< keyframes;
+	}
+	std::cout << ", len_x=" << lens[0] << ", len_y=" << lens[1];
+	if (sim3d) {
+		std::cout << ", len_z=" << lens[2];
+	}
+	std::cout << "\n";
 	std::cout << std::endl;
 }
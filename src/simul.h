@@ -29,13 +29,21 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 #define ACTIVEBROWNIAN_SIMUL_H_
 
 #include <string>
+#include <array>
 #include <iostream>
+#include <memory>
+#include "state.h"
+#include "trajectory.h"
+#include "trajCodec.h"
+#include "h5Chunks.h"
+#include "initConfig.h"
 
-//! State of the simulation after initialization
+//! State of the simulation after initialization (or after the run)
 enum SimulInitStatus {
 	SIMUL_INIT_SUCCESS, //!< Successful initialization
 	SIMUL_INIT_HELP, //!< Display help
-	SIMUL_INIT_FAILED //!< Failed initialization
+	SIMUL_INIT_FAILED, //!< Failed initialization
+	SIMUL_RUN_FAILED //!< Failure during the run (missing file...)
 };
 
 /*!
@@ -50,10 +58,24 @@ class Simul {
 		void run(); //!< Run the simulation
 		void print() const; //!< Print the parameters
 
-		//! Get initialization status
+		//! Get initialization status (or the status of the run)
 		SimulInitStatus getStatus() const { return status; }
 
 	private:
+		//! Print the number of heap allocations (debug builds)
+		void printAllocs(const long n_allocs) const;
+		//! Create the trajectory file if one is wanted
+		bool openTraj(std::unique_ptr<TrajWriter> &traj,
+		              std::unique_ptr<TrajEncoder> &traj_enc, const int dim,
+					  Workers *workers) const;
+		//! Replace the random initial configuration (2d)
+		void initConfiguration(State *state) const;
+		//! Thermalize until the observables stop drifting (2d)
+		long thermalize(State *state) const;
+#ifndef NOVISU
+		bool runReplay() const; //!< Play back a trajectory
+#endif
+
 		double rho; //!< Density
 		long n_parts; //!< Number of particles
 		double pot_strength; //!< Strength of interparticle potential
@@ -63,21 +85,67 @@ class Simul {
 		double dt; //!< Timestep
 		long n_iters; //!< Number of time iterations
 		long n_iters_th; //!< Number of time iterations of thermalization
+		double th_tol; //!< Tolerance on the drift (automatic thermalization)
+		long th_block; //!< Samples in a block (automatic thermalization)
 		long skip; //!< Iterations between two computation of observables
 		std::string output; //!< Name of the output file
+		std::string h5_codec_str; //!< Compression of the output (user input)
+		H5Codec h5_codec; //!< Compression of the output
+		int h5_level; //!< Level of compression of the output
+		long flush_every; //!< Samples between two exports during the run
+		std::string traj_fname; //!< Name of the trajectory file (or empty)
+		long traj_skip; //!< Iterations between two frames of the trajectory
+		std::string traj_codec; //!< Encoding of the trajectory (raw or lossy)
+		double traj_error; //!< Largest error on the positions (lossy)
+		long keyframes; //!< Frames between two keyframes (lossy)
+		std::string replay_fname; //!< Trajectory to play back (or empty)
+		std::string init_fname; //!< Initial configuration (or empty)
+		long init_frame; //!< Frame of the initial configuration
+		std::string save_fname; //!< File for the final configuration
+		std::string init_mode_str; //!< Initial configuration (user input)
+		InitMode init_mode; //!< Generator of the initial configuration
 		bool wca; //!< Use WCA potential
+		bool energy; //!< Output the interaction energy
 		bool sim3d; //!< Simulation in 3d instead of 2d
 		bool less_obs; //!< Output only (r, theta) correlations
 		bool cartesian; //!< Output correlations in cartesian coordinates
 		double step_r; //!< Spatial resolution for correlations
 		long n_div_angle; //!< Number of angular points for correlations
 		int fac_boxes; //!< Factor for the boxes
+		double aspect_y; //!< Ratio between the lengths along y and x
+		double aspect_z; //!< Ratio between the lengths along z and x
+		std::string walls_str; //!< Type of walls (as given by the user)
+		WallsType walls; //!< Type of confining walls
+		std::string activ_profile_str; //!< Profile of activity (user input)
+		ActivityProfile activ_profile; //!< Profile of activity
+		double activ_amp; //!< Relative amplitude of modulation of activity
+		double gravity; //!< Intensity of gravity (along -y)
+		double trap; //!< Stiffness of the harmonic trap
+		double field_step; //!< Spacing of the grid for the external fields
+		double align_strength; //!< Strength of the alignment torques
+		double align_radius; //!< Radius of alignment
+		bool nematic; //!< Nematic instead of polar alignment
+		double mass; //!< Mass of the particles (0 for overdamped dynamics)
+		double shear_rate; //!< Shear rate (Lees-Edwards)
+		double long_range; //!< Strength of the long-range interaction
+		double ewald_cutoff; //!< Cutoff of the real-space Ewald sum
+		double mesh_step; //!< Spacing of the mesh for long-range forces
+		bool ghosts; //!< Ghost copies of the particles at the boundaries
+		//! Steps between the full rebuilds of the boxes (0: at each step)
+		long cell_rebuild;
+		int n_threads; //!< Number of threads for the forces
+		//! Steps between the sorts of the particles by box (0: at the start)
+		long sort_every;
+		bool pin; //!< Pin the threads to their CPUs
+		//! Pages of the particle arrays (as given by the user)
+		std::string huge_pages_str;
+		HugePages huge_pages; //!< Pages of the particle arrays
 #ifndef NOVISU
 		int sleep; //!< Number of milliseconds to sleep for between iterations
 #endif
-		double len; //!< Length of the box
+		std::array<double, 3> lens; //!< Lengths of the box along each axis
 
-		SimulInitStatus status; //!< Status after initialization
+		SimulInitStatus status; //!< Status after initialization or run
 };
 
 /*!
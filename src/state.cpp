@@ -29,15 +29,18 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 #include <cmath>
 #include <chrono>
 #include <algorithm>
+#include <numeric>
 #include <iostream>
 #include "state.h"
+#include "ompPragma.h"
 
 /*!
  * \brief Constructor of State
  *
  * Initializes the state of the system: particles randomly placed in a 2d box.
  *
- * \param _len Length of the box
+ * \param _len_x Length of the box along x
+ * \param _len_y Length of the box along y
  * \param _n_parts Number of particles
  * \param _pot_strength Strength of the interparticle potential
  * \param _temperature Temperature
@@ -45,58 +48,204 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
  * \param _activity Activity
  * \param _dt Timestep
  * \param _fac_boxes Factor for the boxes
+ * \param _wca Use WCA potential instead of harmonic spheres
+ * \param _walls Type of confining walls
+ * \param _field External fields, which replace the uniform activity
+ * (nullptr if none)
+ * \param _align_strength Strength of the alignment torques
+ * \param _align_radius Radius within which the particles align
+ * \param _nematic Nematic instead of polar alignment
+ * \param _mass Mass of the particles (0 for overdamped dynamics)
+ * \param _shear_rate Shear rate (Lees-Edwards boundary conditions)
+ * \param _mesh Mesh for the long-range interactions (nullptr if none)
+ * \param _ghosts Use ghost copies of the boundary particles
+ * \param _workers Threads computing the forces (nullptr for a single thread)
+ * \param _with_energy Allow the computation of the interaction energy
  */
-State::State(const double _len, const long _n_parts,
+State::State(const double _len_x, const double _len_y, const long _n_parts,
 	         const double _pot_strength, const double _temperature,
 			 const double _rot_dif, const double _activity, const double _dt,
-			 const int _fac_boxes, const bool _wca) :
-	len(_len), n_parts(_n_parts), pot_strength(_pot_strength),
-	activity(_activity), dt(_dt), wca(_wca),
-	boxes(_len, _n_parts, (_wca ? TWOONESIXTH : 1.0), _fac_boxes),
+			 const int _fac_boxes, const bool _wca, const WallsType _walls,
+			 const ExternalField *_field, const double _align_strength,
+			 const double _align_radius, const bool _nematic,
+			 const double _mass, const double _shear_rate,
+			 ParticleMesh *_mesh, const bool _ghosts, Workers *_workers,
+			 const bool _with_energy) :
+	len_x(_len_x), len_y(_len_y), n_parts(_n_parts),
+	pot_strength(_pot_strength), activity(_activity), dt(_dt), wca(_wca),
+	walls(_walls), field(_field), align_strength(_align_strength),
+	align_radius_sq(_align_radius * _align_radius), nematic(_nematic),
+	mass(_mass), shear_rate(_shear_rate), shear_offset(0.), virial_xy(0.),
+	with_energy(_with_energy), energy_next(false), energy(0.), mesh(_mesh),
+	// The boxes should be larger than the range of all the interactions
+	boxes({_len_x, _len_y}, _n_parts,
+		  std::max({(_wca ? TWOONESIXTH : 1.0),
+			        (_align_strength > 0. ? _align_radius : 0.),
+					(_mesh ? _mesh->getCutoff() : 0.)}),
+		  _fac_boxes),
 #ifdef USE_MKL
 	stddev_temp(std::sqrt(2.0 * _temperature * dt)),
-	stddev_rot(std::sqrt(2.0 * _rot_dif * dt))
+	stddev_rot(std::sqrt(2.0 * _rot_dif * dt)),
+	stddev_vel(_mass > 0. ? std::sqrt(_temperature / _mass
+				           * (1. - std::exp(-2. * dt / _mass))) : 0.),
 #else
-	// We seed the RNG with the current time
-	rng(std::chrono::system_clock::now().time_since_epoch().count()),
-	// Gaussian noise from the temperature
-	noiseTemp(0.0, std::sqrt(2.0 * _temperature * dt)),
-	// Gaussian noise from the rotational diffusivity
-	noiseAngle(0.0, std::sqrt(2.0 * _rot_dif * dt))
+	// We seed the RNG with the current time, and take the Gaussian noises
+	// from the temperature, the rotational diffusivity and the Langevin
+	// thermostat (underdamped dynamics)
+	noise(1, NoiseStream(
+		std::chrono::system_clock::now().time_since_epoch().count(),
+		std::sqrt(2.0 * _temperature * dt), std::sqrt(2.0 * _rot_dif * dt),
+		_mass > 0. ? std::sqrt(_temperature / _mass
+				               * (1. - std::exp(-2. * dt / _mass))) : 1.)),
 #endif
+	damp_vel(_mass > 0. ? std::exp(-dt / _mass) : 0.),
+	workers(_workers), sort_every(0), steps_since_sort(0)
 {
-	positions[0].resize(n_parts);
-	positions[1].resize(n_parts);
+	// The memory is not written by resize()
+	for (int a = 0 ; a < 2 ; ++a) {
+		positions[a].resize(n_parts);
+		forces[a].resize(n_parts);
+		if (mass > 0.) {
+			velocities[a].resize(n_parts);
+		}
+		if (align_strength > 0.) {
+			orients[a].resize(n_parts);
+		}
+	}
 	angles.resize(n_parts);
-	forces[0].assign(n_parts, 0);
-	forces[1].assign(n_parts, 0);
-	f_along.assign(n_parts, 0);
-
+	f_along.resize(n_parts);
+	if (align_strength > 0.) {
+		torques.resize(n_parts);
+	}
+	if (with_energy) {
+		energies.resize(n_parts);
+	}
 #ifdef USE_MKL
 	aux_x.resize(n_parts);
 	aux_y.resize(n_parts);
 	aux_angle.resize(n_parts);
+#endif
+	if (workers) {
+		ids.resize(n_parts);
+		slots.resize(n_parts);
+		sort_order.resize(n_parts);
+		sort_tmp.resize(n_parts);
+		firstTouch();
+	}
+	std::fill(forces[0].begin(), forces[0].end(), 0.);
+	std::fill(forces[1].begin(), forces[1].end(), 0.);
+	std::fill(f_along.begin(), f_along.end(), 0.);
+	std::fill(torques.begin(), torques.end(), 0.);
+	std::fill(energies.begin(), energies.end(), 0.);
 
+#ifdef USE_MKL
 	vslNewStream(&stream, VSL_BRNG_SFMT19937,
 			std::chrono::system_clock::now().time_since_epoch().count());
 	vdRngUniform(VSL_RNG_METHOD_UNIFORM_STD, stream, n_parts,
-			     positions[0].data(), 0, len);
+			     positions[0].data(), 0, len_x);
 	vdRngUniform(VSL_RNG_METHOD_UNIFORM_STD, stream, n_parts,
-			     positions[1].data(), 0, len);
+			     positions[1].data(), 0, len_y);
 	vdRngUniform(VSL_RNG_METHOD_UNIFORM_STD, stream, n_parts,
 			     angles.data(), 0, 2.0 * M_PI);
 #else
-    std::uniform_real_distribution<double> rndPos(0, len);
+    std::uniform_real_distribution<double> rndPosX(0, len_x);
+    std::uniform_real_distribution<double> rndPosY(0, len_y);
     std::uniform_real_distribution<double> rndAngle(0, 2.0 * M_PI);
+	std::mt19937 &rng = noise[0].rng;
 
 	for (long i = 0 ; i < n_parts ; ++i) {
-		positions[0][i] = rndPos(rng);
-		positions[1][i] = rndPos(rng);
+		positions[0][i] = rndPosX(rng);
+		positions[1][i] = rndPosY(rng);
 		angles[i] = rndAngle(rng);
 		forces[0][i] = 0;
 		forces[1][i] = 0;
 	}
+	// One generator per OpenMP thread, seeded by the first one
+	for (int t = 1 ; t < ompMaxThreads() ; ++t) {
+		noise.push_back(NoiseStream(rng(), noise[0].noiseTemp.stddev(),
+		                            noise[0].noiseAngle.stddev(),
+									noise[0].noiseVel.stddev()));
+	}
 #endif
+
+	if (walls != WALLS_NONE) {
+		// The walls break the periodicity
+		boxes.setPeriodic({walls == WALLS_CHANNEL, false});
+		computeWallBoxes();
+		placeInsideWalls();
+	}
+
+	if (workers) {
+		// The classification is shared between the threads
+		boxes.setWorkers(workers);
+		// The slabs of particles of the threads match their slabs of boxes
+		sortByBox();
+		// The random particles are numbered once sorted
+		std::iota(ids.begin(), ids.end(), 0);
+		std::iota(slots.begin(), slots.end(), 0);
+	}
+
+	if (_ghosts) {
+		boxes.setGhosts(true);
+		reserveGhosts();
+	}
+
+	if (mass > 0.) {
+		// The particles start at rest
+		std::fill(velocities[0].begin(), velocities[0].end(), 0.);
+		std::fill(velocities[1].begin(), velocities[1].end(), 0.);
+		calcTotalForces();
+	}
+}
+
+/*!
+ * \brief Replace the random initial configuration.
+ *
+ * To be called before the first time step, for a system without walls
+ * (the particles are not checked to be inside them).
+ *
+ * \param pos_x Positions along x
+ * \param pos_y Positions along y
+ * \param _angles Orientations
+ */
+void State::setConfiguration(const double *pos_x, const double *pos_y,
+                             const double *_angles) {
+	for (long i = 0 ; i < n_parts ; ++i) {
+		positions[0][i] = pos_x[i];
+		positions[1][i] = pos_y[i];
+		angles[i] = _angles[i];
+		pbc(positions[0][i], len_x);
+		pbc(positions[1][i], len_y);
+		pbc(angles[i], 2.0 * M_PI);
+	}
+
+	if (workers) {
+		// The particles keep the numbering of the configuration
+		std::iota(ids.begin(), ids.end(), 0);
+		sortByBox();
+		steps_since_sort = 0;
+	}
+	if (boxes.hasGhosts()) {
+		reserveGhosts();
+	}
+	if (mass > 0.) {
+		std::fill(velocities[0].begin(), velocities[0].end(), 0.);
+		std::fill(velocities[1].begin(), velocities[1].end(), 0.);
+		calcTotalForces();
+	}
+}
+
+/*!
+ * \brief Reserve the memory for the forces on the ghosts, with some margin.
+ */
+void State::reserveGhosts() {
+	boxes.update(positions);
+	size_t bytes = 4 * (boxes.getNGhosts() + 1) * sizeof(double)
+	               + 2 * ARENA_ALIGN;
+	scratch.reserve(bytes);
+	for (auto &buf : thread_bufs) {
+		buf->scratch.reserve(bytes);
+	}
 }
 
 /*!
@@ -105,8 +254,26 @@ State::State(const double _len, const long _n_parts,
  * Evolve the system for one time step according to coupled Langevin equation.
  */
 void State::evolve() {
+	sortIfDue();
+	if (mass > 0.) {
+		evolveInertial();
+		return;
+	}
+
 	calcInternalForces();
 
+	if (shear_rate != 0.) {
+		// Advection by the linear flow profile (wrapped along x,
+		// where the external field is sampled next)
+		for (long i = 0 ; i < n_parts ; ++i) {
+			positions[0][i] += dt * shear_rate
+				               * (positions[1][i] - 0.5 * len_y);
+			pbc(positions[0][i], len_x);
+		}
+		shear_offset += shear_rate * len_y * dt;
+		pbcSym(shear_offset, len_x);
+	}
+
 #ifdef USE_MKL
 	vdSinCos(n_parts, angles.data(), aux_y.data(), aux_x.data());
 	// It doesn't look optimal to do it each time
@@ -115,8 +282,17 @@ void State::evolve() {
 		f_along[i] = forces[0][i] * aux_x[i] + forces[1][i] * aux_y[i];
 	}
 	// Activity and forces
-	cblas_daxpy(n_parts, activity, aux_x.data(), 1, forces[0].data(), 1);
-	cblas_daxpy(n_parts, activity, aux_y.data(), 1, forces[1].data(), 1);
+	if (field) {
+		double act, fx, fy;
+		for (long i = 0 ; i < n_parts ; ++i) {
+			field->sample(positions[0][i], positions[1][i], act, fx, fy);
+			forces[0][i] += act * aux_x[i] + fx;
+			forces[1][i] += act * aux_y[i] + fy;
+		}
+	} else {
+		cblas_daxpy(n_parts, activity, aux_x.data(), 1, forces[0].data(), 1);
+		cblas_daxpy(n_parts, activity, aux_y.data(), 1, forces[1].data(), 1);
+	}
 	cblas_daxpy(n_parts, dt, forces[0].data(), 1, positions[0].data(), 1);
 	cblas_daxpy(n_parts, dt, forces[1].data(), 1, positions[1].data(), 1);
 	// Diffusion and rotational diffusion
@@ -129,38 +305,167 @@ void State::evolve() {
 	vdAdd(n_parts, positions[0].data(), aux_x.data(), positions[0].data());
 	vdAdd(n_parts, positions[1].data(), aux_y.data(), positions[1].data());
 	vdAdd(n_parts, angles.data(), aux_angle.data(), angles.data());
+	if (align_strength > 0.) {
+		cblas_daxpy(n_parts, dt, torques.data(), 1, angles.data(), 1);
+	}
+#else
+	OMP_PRAGMA(omp parallel)
+	{
+		NoiseStream &ns = noise[ompThreadNum()];
+		double c, s;
+		// Local activity and external force
+		double act = activity, fx = 0., fy = 0.;
+		OMP_PRAGMA(omp for schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			// Computation of sin and cos
+		#ifdef __GNUC__
+			sincos(angles[i], &s, &c);
+		#else
+			s = std::sin(angles[i]);
+			c = std::cos(angles[i]);
+		#endif
+			if (field) {
+				field->sample(positions[0][i], positions[1][i], act, fx, fy);
+			}
+			f_along[i] = forces[0][i] * c + forces[1][i] * s;
+			// Internal forces +  Activity + External force + Gaussian noise
+			positions[0][i] += dt * (forces[0][i] + act * c + fx);
+			positions[1][i] += dt * (forces[1][i] + act * s + fy);
+			// Diffusion and rotational diffusion
+			positions[0][i] += ns.noiseTemp(ns.rng);
+			positions[1][i] += ns.noiseTemp(ns.rng); 
+			angles[i] += ns.noiseAngle(ns.rng);
+		}
+	}
+	if (align_strength > 0.) {
+		OMP_PRAGMA(omp parallel for simd schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			angles[i] += dt * torques[i];
+		}
+	}
+#endif
+
+	enforcePBC();
+}
+
+/*!
+ * \brief Do one time step of the underdamped dynamics
+ *
+ * The friction coefficient is 1, so that the Langevin equation reads
+ * m dv/dt = -v + F + sqrt(2 T) xi. We use the BAOAB splitting: half kick,
+ * half drift, exact Ornstein-Uhlenbeck step for the velocity, half drift,
+ * and half kick with the new forces. The forces of the end of a step
+ * are reused at the beginning of the next one, so that there is a
+ * single computation of the forces per step.
+ */
+void State::evolveInertial() {
+	const double half_kick = 0.5 * dt / mass;
+	const double half_dt = 0.5 * dt;
+
+#ifdef USE_MKL
+	vdRngGaussian(VSL_RNG_METHOD_GAUSSIAN_ICDF, stream, n_parts,
+			      aux_x.data(), 0, stddev_vel);
+	vdRngGaussian(VSL_RNG_METHOD_GAUSSIAN_ICDF, stream, n_parts,
+			      aux_y.data(), 0, stddev_vel);
+	vdRngGaussian(VSL_RNG_METHOD_GAUSSIAN_ICDF, stream, n_parts,
+			      aux_angle.data(), 0, stddev_rot);
+	for (int a = 0 ; a < 2 ; ++a) {
+		double *v = velocities[a].data();
+		double *x = positions[a].data();
+		const double *f = forces[a].data();
+		const double *xi = (a == 0) ? aux_x.data() : aux_y.data();
+		for (long i = 0 ; i < n_parts ; ++i) {
+			v[i] += half_kick * f[i];
+			x[i] += half_dt * v[i];
+			v[i] = damp_vel * v[i] + xi[i];
+			x[i] += half_dt * v[i];
+		}
+	}
+	vdAdd(n_parts, angles.data(), aux_angle.data(), angles.data());
 #else
+	OMP_PRAGMA(omp parallel)
+	{
+		NoiseStream &ns = noise[ompThreadNum()];
+		OMP_PRAGMA(omp for schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			for (int a = 0 ; a < 2 ; ++a) {
+				velocities[a][i] += half_kick * forces[a][i];
+				positions[a][i] += half_dt * velocities[a][i];
+				velocities[a][i] = damp_vel * velocities[a][i]
+				                   + ns.noiseVel(ns.rng);
+				positions[a][i] += half_dt * velocities[a][i];
+			}
+			angles[i] += ns.noiseAngle(ns.rng);
+		}
+	}
+#endif
+	if (align_strength > 0.) {
+		OMP_PRAGMA(omp parallel for simd schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			angles[i] += dt * torques[i];
+		}
+	}
+
+	enforcePBC();
+	calcTotalForces();
+
+	for (int a = 0 ; a < 2 ; ++a) {
+		OMP_PRAGMA(omp parallel for simd schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			velocities[a][i] += half_kick * forces[a][i];
+		}
+	}
+}
+
+/*!
+ * \brief Compute the total forces on the particles
+ *
+ * Internal forces, self-propulsion and external force.
+ * The force along the orientation only takes the internal forces
+ * into account.
+ */
+void State::calcTotalForces() {
+	calcInternalForces();
+
 	double c, s;
+	double act = activity, fx = 0., fy = 0.;
+	OMP_PRAGMA(omp parallel for schedule(static) private(c, s) \
+	           firstprivate(act, fx, fy))
 	for (long i = 0 ; i < n_parts ; ++i) {
-		// Computation of sin and cos
 	#ifdef __GNUC__
 		sincos(angles[i], &s, &c);
 	#else
 		s = std::sin(angles[i]);
 		c = std::cos(angles[i]);
 	#endif
+		if (field) {
+			field->sample(positions[0][i], positions[1][i], act, fx, fy);
+		}
 		f_along[i] = forces[0][i] * c + forces[1][i] * s;
-		// Internal forces +  Activity + Gaussian noise
-		positions[0][i] += dt * (forces[0][i] + activity * c);
-		positions[1][i] += dt * (forces[1][i] + activity * s);
-		// Diffusion and rotational diffusion
-		positions[0][i] += noiseTemp(rng);
-		positions[1][i] += noiseTemp(rng); 
-		angles[i] += noiseAngle(rng);
+		forces[0][i] += act * c + fx;
+		forces[1][i] += act * s + fy;
 	}
-#endif
-
-	enforcePBC();
 }
 
 double State::avgFAlong() const {
 	double f = 0.0;
+	OMP_PRAGMA(omp parallel for simd schedule(static) reduction(+:f))
 	for (long i = 0 ; i < n_parts ; ++i) {
 		f += f_along[i];
 	}
 	return f / n_parts;
 }
 
+double State::polarization() const {
+	double px = 0.0, py = 0.0;
+	OMP_PRAGMA(omp parallel for schedule(static) reduction(+:px, py))
+	for (long i = 0 ; i < n_parts ; ++i) {
+		px += std::cos(angles[i]);
+		py += std::sin(angles[i]);
+	}
+	return std::sqrt(px * px + py * py) / n_parts;
+}
+
 void State::dump() const {
 	for (long i = 0 ; i < n_parts ; ++i) {
 		std::cout << positions[0][i] << " "
@@ -169,105 +474,539 @@ void State::dump() const {
 	}
 }
 
+/* \brief Write the arrays of the particles first from their threads.
+ *
+ * A page of memory is placed on the NUMA node of the thread which first
+ * writes it: each thread writes the slab of particles it sums the forces
+ * of, and maps its own buffers (backed when it writes them).
+ */
+void State::firstTouch() {
+	thread_bufs.resize(workers->getNThreads());
+	box_split.resize(workers->getNThreads() + 1);
+
+	auto touch = [this](const int t) {
+		const long i0 = workers->splitBegin(n_parts, t);
+		const long i1 = workers->splitBegin(n_parts, t + 1);
+		std::vector<PartVector<double> *> arrays = {
+			&positions[0], &positions[1], &angles, &forces[0], &forces[1],
+			&f_along, &velocities[0], &velocities[1], &torques, &energies,
+			&orients[0], &orients[1]
+#ifdef USE_MKL
+			, &aux_x, &aux_y, &aux_angle
+#endif
+		};
+		for (auto v : arrays) {
+			if (!v->empty()) {
+				std::fill(v->begin() + i0, v->begin() + i1, 0.);
+			}
+		}
+		std::fill(sort_tmp.begin() + i0, sort_tmp.begin() + i1, 0.);
+		for (auto v : {&ids, &slots, &sort_order}) {
+			std::fill(v->begin() + i0, v->begin() + i1, 0);
+		}
+
+		std::unique_ptr<ThreadBuffers> buf(new ThreadBuffers);
+		buf->forces[0].assign(n_parts);
+		buf->forces[1].assign(n_parts);
+		if (align_strength > 0.) {
+			buf->torques.assign(n_parts);
+		}
+		if (with_energy) {
+			buf->energies.assign(n_parts);
+		}
+		buf->windows = {{{0, 0}, {0, 0}}};
+		buf->acc.fx = buf->forces[0].data();
+		buf->acc.fy = buf->forces[1].data();
+		buf->acc.torques = buf->torques.data();
+		buf->acc.energies = buf->energies.data();
+		thread_bufs[t] = std::move(buf);
+	};
+	workers->run(touch);
+}
+
+/* \brief Sort the particles by box.
+ *
+ * The boxes are numbered row by row, so that the particles of a slab
+ * of boxes are then mostly in the same slab of indices. All the arrays
+ * which are kept from a step to the next are permuted, each thread
+ * writing its slab, and the initial numbering is followed for the
+ * trajectories (see getSlots()). The buffers of the threads only contain
+ * zeros between the steps: their pages are given back, to be backed
+ * again around the new slabs.
+ */
+void State::sortByBox() {
+	boxes.update(positions);
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+	long k = 0;
+	for (long b = 0 ; b < boxes.getNBoxes() ; ++b) {
+		for (long i : parts_of_box[b]) {
+			sort_order[k++] = i;
+		}
+	}
+
+	const std::array<PartVector<double> *, 10> arrays = {
+		&positions[0], &positions[1], &angles, &forces[0], &forces[1],
+		&f_along, &velocities[0], &velocities[1], &torques, &energies
+	};
+	PartVector<double> *v = nullptr;
+	auto permute = [this, &v](const int t) {
+		const long k_end = workers->splitBegin(n_parts, t + 1);
+		for (long k = workers->splitBegin(n_parts, t) ; k < k_end ; ++k) {
+			sort_tmp[k] = (*v)[sort_order[k]];
+		}
+	};
+	for (auto a : arrays) {
+		if (!a->empty()) {
+			v = a;
+			workers->run(permute);
+			v->swap(sort_tmp);
+		}
+	}
+	auto renumber = [this](const int t) {
+		const long k_end = workers->splitBegin(n_parts, t + 1);
+		for (long k = workers->splitBegin(n_parts, t) ; k < k_end ; ++k) {
+			slots[k] = ids[sort_order[k]];
+		}
+	};
+	workers->run(renumber);
+	ids.swap(slots);
+	for (long k = 0 ; k < n_parts ; ++k) {
+		slots[ids[k]] = k;
+	}
+
+	for (auto &buf : thread_bufs) {
+		buf->forces[0].release();
+		buf->forces[1].release();
+		buf->torques.release();
+		buf->energies.release();
+	}
+	// The particles have been renumbered
+	boxes.forceRebuild();
+}
+
+/* \brief Sort the particles by box if it is time to.
+ *
+ * The particles diffuse away from the slabs they were sorted in,
+ * which widens the ranges of the buffers of the threads.
+ */
+void State::sortIfDue() {
+	if (workers && sort_every > 0 && ++steps_since_sort >= sort_every) {
+		sortByBox();
+		steps_since_sort = 0;
+	}
+}
+
 /* \brief Compute the forces between the particles.
  *
- * Implement harmonic spheres.
+ * Implement harmonic spheres or WCA, and the alignment torques
+ * if needed. The interaction energy is computed in the same loop
+ * only when it has been requested.
  */
 void State::calcInternalForces() {
-    for (long i = 0 ; i < n_parts ; ++i) {
-		forces[0][i] = 0;
-		forces[1][i] = 0;
-    }
-
 	// Recompute the boxes
 	boxes.update(positions);
-	const long n_boxes = boxes.getNBoxes();
-	const std::vector< std::vector<long> > &nbrs_pos = boxes.getNbrsPos();
-	const std::vector< std::vector<long> > &parts_of_box = \
-		boxes.getPartsOfBox();
 
-	/*for (long b1 = 0 ; b1 < n_boxes ; ++b1) {
-		std::cout << "-> " << b1 << ": ";
-		for (auto it_i = parts_of_box[b1].cbegin() ;
-			 it_i != parts_of_box[b1].cend() ; ++it_i) {
-			std::cout << *it_i << " ";
-		}
-		std::cout << std::endl;
-	}*/
-
-	if (wca) {
-		for (long b1 = 0 ; b1 < n_boxes ; ++b1) {
-			//std::cout << "-> " << b1 << "\n";
-			for (auto it_i = parts_of_box[b1].cbegin() ;
-				 it_i != parts_of_box[b1].cend() ; ++it_i) {
-				// Same box
-				for (auto it_j = parts_of_box[b1].cbegin() ;
-					 it_j != it_i ; ++it_j) {
-					calcInternalForceIJ_WCA(*it_i, *it_j);
-				}
-				// Neighboring boxes
-				for (long b2 : nbrs_pos[b1]) {
-					//std::cout << "[" << b1 << ", " << b2 << "]\n";
-					for (auto it_j = parts_of_box[b2].cbegin() ;
-						 it_j != parts_of_box[b2].cend() ; ++it_j) {
-						calcInternalForceIJ_WCA(*it_i, *it_j);
+	if (align_strength > 0.) {
+		for (long i = 0 ; i < n_parts ; ++i) {
+	#ifdef __GNUC__
+			sincos(angles[i], &orients[1][i], &orients[0][i]);
+	#else
+			orients[0][i] = std::cos(angles[i]);
+			orients[1][i] = std::sin(angles[i]);
+	#endif
+		}
+	}
+
+	const bool with_e = energy_next;
+	energy_next = false;
+	if (shear_rate != 0.) {
+		boxes.setShearOffset(shear_offset);
+		if (with_e) {
+			calcInternalForcesDispatch<true, true>();
+		} else {
+			calcInternalForcesDispatch<true, false>();
+		}
+	} else {
+		if (with_e) {
+			calcInternalForcesDispatch<false, true>();
+		} else {
+			calcInternalForcesDispatch<false, false>();
+		}
+	}
+
+	if (walls != WALLS_NONE) {
+		calcWallForces();
+	}
+
+	if (mesh) {
+		calcEwaldRealSpace();
+		mesh->addForces(positions, forces);
+	}
+}
+
+/* \brief Choose the loop over the pairs according to the interactions.
+ */
+template<bool SHEAR, bool ENERGY>
+void State::calcInternalForcesDispatch() {
+	if (align_strength > 0.) {
+		if (wca) {
+			calcInternalForcesRun<true, true, SHEAR, ENERGY>();
+		} else {
+			calcInternalForcesRun<false, true, SHEAR, ENERGY>();
+		}
+	} else {
+		if (wca) {
+			calcInternalForcesRun<true, false, SHEAR, ENERGY>();
+		} else {
+			calcInternalForcesRun<false, false, SHEAR, ENERGY>();
+		}
+	}
+}
+
+/* \brief Run the loop over the pairs on one or several threads.
+ *
+ * With several threads, each of them takes a slab of boxes and
+ * accumulates in its own buffers, which are then summed over slabs
+ * of particles (and cleared for the next step) by the same threads.
+ */
+template<bool WCA, bool ALIGN, bool SHEAR, bool ENERGY>
+void State::calcInternalForcesRun() {
+	if (!workers) {
+		PairAccum acc;
+		acc.fx = forces[0].data();
+		acc.fy = forces[1].data();
+		acc.torques = torques.data();
+		acc.energies = energies.data();
+		std::fill(forces[0].begin(), forces[0].end(), 0.);
+		std::fill(forces[1].begin(), forces[1].end(), 0.);
+		std::fill(torques.begin(), torques.end(), 0.);
+		if (ENERGY) {
+			std::fill(energies.begin(), energies.end(), 0.);
+		}
+		startAccum(acc, scratch);
+		calcInternalForcesLoop<WCA, ALIGN, SHEAR, ENERGY>(
+			0, boxes.getNBoxes(), acc);
+		foldGhostForces(0, boxes.getNBoxes(), acc);
+		virial_xy = acc.virial_xy;
+		if (ENERGY) {
+			energy = acc.energy;
+		}
+		return;
+	}
+
+	splitBoxes();
+	auto pairs = [this](const int t) {
+		ThreadBuffers &buf = *thread_bufs[t];
+		findWindows(box_split[t], box_split[t+1], buf);
+		startAccum(buf.acc, buf.scratch);
+		calcInternalForcesLoop<WCA, ALIGN, SHEAR, ENERGY>(
+			box_split[t], box_split[t+1], buf.acc);
+		foldGhostForces(box_split[t], box_split[t+1], buf.acc);
+	};
+	workers->run(pairs);
+
+	// Only the buffers whose windows meet the slab contribute to it
+	auto reduce = [this](const int t) {
+		const long i0 = workers->splitBegin(n_parts, t);
+		const long i1 = workers->splitBegin(n_parts, t + 1);
+		std::fill(forces[0].begin() + i0, forces[0].begin() + i1, 0.);
+		std::fill(forces[1].begin() + i0, forces[1].begin() + i1, 0.);
+		if (ALIGN) {
+			std::fill(torques.begin() + i0, torques.begin() + i1, 0.);
+		}
+		if (ENERGY) {
+			std::fill(energies.begin() + i0, energies.begin() + i1, 0.);
+		}
+		for (auto &buf : thread_bufs) {
+			for (const auto &w : buf->windows) {
+				const long i_end = std::min(i1, w[1]);
+				for (long i = std::max(i0, w[0]) ; i < i_end ; ++i) {
+					forces[0][i] += buf->forces[0][i];
+					forces[1][i] += buf->forces[1][i];
+					buf->forces[0][i] = 0.;
+					buf->forces[1][i] = 0.;
+					if (ALIGN) {
+						torques[i] += buf->torques[i];
+						buf->torques[i] = 0.;
+					}
+					if (ENERGY) {
+						energies[i] += buf->energies[i];
+						buf->energies[i] = 0.;
 					}
 				}
 			}
 		}
-	} else {
-		for (long b1 = 0 ; b1 < n_boxes ; ++b1) {
-			for (auto it_i = parts_of_box[b1].cbegin() ;
-				 it_i != parts_of_box[b1].cend() ; ++it_i) {
-				// Same box
-				for (auto it_j = parts_of_box[b1].cbegin() ;
-					 it_j != it_i ; ++it_j) {
-					calcInternalForceIJ_soft(*it_i, *it_j);
-				}
-				// Neighboring boxes
-				for (long b2 : nbrs_pos[b1]) {
-					for (auto it_j = parts_of_box[b2].cbegin() ;
-						 it_j != parts_of_box[b2].cend() ; ++it_j) {
-						calcInternalForceIJ_soft(*it_i, *it_j);
+	};
+	workers->run(reduce);
+
+	virial_xy = 0.;
+	for (auto &buf : thread_bufs) {
+		virial_xy += buf->acc.virial_xy;
+	}
+	if (ENERGY) {
+		energy = 0.;
+		for (auto &buf : thread_bufs) {
+			energy += buf->acc.energy;
+		}
+	}
+}
+
+/* \brief Allocate the forces on the ghosts and clear the accumulators.
+ *
+ * The number of ghosts changes at each step, so the memory is taken
+ * from an arena which is reset here.
+ */
+void State::startAccum(PairAccum &acc, Arena &mem) {
+	acc.virial_xy = 0.;
+	acc.energy = 0.;
+	acc.ghost_fx = acc.ghost_fy = nullptr;
+	if (boxes.hasGhosts()) {
+		const long n_ghosts = boxes.getNGhosts();
+		mem.reset();
+		acc.ghost_fx = mem.alloc<double>(n_ghosts);
+		acc.ghost_fy = mem.alloc<double>(n_ghosts);
+		std::fill(acc.ghost_fx, acc.ghost_fx + n_ghosts, 0.);
+		std::fill(acc.ghost_fy, acc.ghost_fy + n_ghosts, 0.);
+	}
+}
+
+/* \brief Add the forces on the ghosts to their owners.
+ *
+ * Only the halo boxes neighboring boxes b_begin to b_end - 1 are folded,
+ * so that a thread writes the owners of the ghosts it has seen. A halo
+ * box can neighbor several boxes: its forces are cleared once folded.
+ */
+void State::foldGhostForces(const long b_begin, const long b_end,
+                            PairAccum &acc) {
+	if (!boxes.hasGhosts()) {
+		return;
+	}
+	const long n_boxes = boxes.getNBoxes();
+	const std::vector< std::vector<long> > &nbrs = boxes.getNbrsGhost();
+	const PartsOfBoxes &parts_of_halo = boxes.getPartsOfHalo();
+	const long *owner = boxes.getGhostOwner();
+	for (long b = b_begin ; b < b_end ; ++b) {
+		for (long b2 : nbrs[b]) {
+			if (b2 < n_boxes) {
+				continue;
+			}
+			for (long g : parts_of_halo[b2 - n_boxes]) {
+				acc.fx[owner[g]] += acc.ghost_fx[g];
+				acc.fy[owner[g]] += acc.ghost_fy[g];
+				acc.ghost_fx[g] = 0.;
+				acc.ghost_fy[g] = 0.;
+			}
+		}
+	}
+}
+
+/* \brief Find the particles whose forces a thread writes.
+ *
+ * They are the particles of boxes b_begin to b_end - 1 and of their
+ * neighbors (the boxes copied in the halo boxes). The boxes are numbered
+ * row by row and the particles sorted by box, so that their indices
+ * span the slab and the rows around it, and the rows at the other end
+ * for the neighbors across the boundary along y: these are kept
+ * as a second range.
+ */
+void State::findWindows(const long b_begin, const long b_end,
+                        ThreadBuffers &buf) const {
+	const long n_boxes = boxes.getNBoxes();
+	const bool ghosts = boxes.hasGhosts();
+	const std::vector< std::vector<long> > &nbrs = ghosts ? \
+		boxes.getNbrsGhost() : boxes.getNbrsPos();
+	const std::vector<long> &halo_src = boxes.getHaloSrc();
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+
+	std::array<long, 2> lo = {n_parts, n_parts}, hi = {0, 0};
+	auto add = [&](const long b, const int w) {
+		for (long i : parts_of_box[b]) {
+			lo[w] = std::min(lo[w], i);
+			hi[w] = std::max(hi[w], i + 1);
+		}
+	};
+	for (long b = b_begin ; b < b_end ; ++b) {
+		add(b, 0);
+		for (long b2 : nbrs[b]) {
+			const long src = (b2 >= n_boxes) ? halo_src[b2 - n_boxes] : b2;
+			if (src < b_begin || src >= b_end) {
+				// Across the boundary along y if far in the numbering
+				add(src, (2 * std::abs(src - b) > n_boxes) ? 1 : 0);
+			}
+		}
+	}
+
+	for (int w = 0 ; w < 2 ; ++w) {
+		if (lo[w] >= hi[w]) {
+			lo[w] = hi[w] = 0;
+		}
+	}
+	if (lo[1] < hi[0] && lo[0] < hi[1]) {
+		// Overlapping ranges are merged
+		lo[0] = std::min(lo[0], lo[1]);
+		hi[0] = std::max(hi[0], hi[1]);
+		lo[1] = hi[1] = 0;
+	}
+	buf.windows[0] = {lo[0], hi[0]};
+	buf.windows[1] = {lo[1], hi[1]};
+}
+
+/* \brief Split the boxes between the threads.
+ *
+ * Each thread takes a contiguous slab of boxes (rows along y) with
+ * about the same number of particles, found by bisection on the
+ * starts of the boxes (the free slots of the incremental updates being
+ * proportional to the occupancy of the boxes).
+ */
+void State::splitBoxes() {
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+	const long n_boxes = boxes.getNBoxes();
+	const int n_threads = workers->getNThreads();
+	const long n_slots = parts_of_box.getStart(n_boxes);
+
+	box_split[0] = 0;
+	for (int t = 1 ; t < n_threads ; ++t) {
+		// First box starting after the first slot of thread t
+		const long target = workers->splitBegin(n_slots, t);
+		long lo = box_split[t-1], hi = n_boxes;
+		while (lo < hi) {
+			long mid = (lo + hi) / 2;
+			if (parts_of_box.getStart(mid) < target) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		box_split[t] = lo;
+	}
+	box_split[n_threads] = n_boxes;
+}
+
+/* \brief Loop over the pairs of particles in neighboring boxes.
+ *
+ * The forces and the torques are computed in the same pass,
+ * for the particles of boxes b_begin to b_end - 1 and their neighbors.
+ * The boxes give the shift of the nearest image of each neighboring box,
+ * so that no minimum image convention is needed for the pairs.
+ * With the ghosts, the images across the boundaries are halo boxes
+ * and the forces on the ghosts are stored separately.
+ */
+template<bool WCA, bool ALIGN, bool SHEAR, bool ENERGY>
+void State::calcInternalForcesLoop(const long b_begin, const long b_end,
+                                   PairAccum &acc) {
+	const long n_boxes = boxes.getNBoxes();
+	const bool ghosts = boxes.hasGhosts();
+	const std::vector< std::vector<long> > &nbrs_pos = ghosts ? \
+		boxes.getNbrsGhost() : boxes.getNbrsPos();
+	const std::vector< std::vector< std::array<double, 2> > > &nbrs_shift = \
+		boxes.getNbrsShift();
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+	const PartsOfBoxes &parts_of_halo = boxes.getPartsOfHalo();
+	const std::array<double *, 2> &ghost_pos = boxes.getGhostPos();
+	const long *ghost_owner = boxes.getGhostOwner();
+
+	auto pairForce = [&](const long i, const long j,
+			             const double dx, const double dy,
+						 double &fx_j, double &fy_j) {
+		if (WCA) {
+			calcInternalForceIJ_WCA<ALIGN, SHEAR, ENERGY>(acc, i, j, dx, dy,
+			                                              fx_j, fy_j);
+		} else {
+			calcInternalForceIJ_soft<ALIGN, SHEAR, ENERGY>(acc, i, j, dx, dy,
+			                                               fx_j, fy_j);
+		}
+	};
+
+	for (long b1 = b_begin ; b1 < b_end ; ++b1) {
+		for (auto it_i = parts_of_box[b1].cbegin() ;
+			 it_i != parts_of_box[b1].cend() ; ++it_i) {
+			const long i = *it_i;
+			const double xi = positions[0][i];
+			const double yi = positions[1][i];
+			// Same box
+			for (auto it_j = parts_of_box[b1].cbegin() ;
+				 it_j != it_i ; ++it_j) {
+				const long j = *it_j;
+				pairForce(i, j, xi - positions[0][j], yi - positions[1][j],
+				          acc.fx[j], acc.fy[j]);
+			}
+			// Neighboring boxes
+			for (size_t n = 0 ; n < nbrs_pos[b1].size() ; ++n) {
+				const long b2 = nbrs_pos[b1][n];
+				if (b2 >= n_boxes) {
+					// Halo box
+					for (long g : parts_of_halo[b2 - n_boxes]) {
+						pairForce(i, ghost_owner[g], xi - ghost_pos[0][g],
+						          yi - ghost_pos[1][g],
+								  acc.ghost_fx[g], acc.ghost_fy[g]);
 					}
+					continue;
+				}
+				// Shift of the nearest image of b2 (always zero here
+				// with the ghosts)
+				const double sx = nbrs_shift[b1][n][0];
+				const double sy = nbrs_shift[b1][n][1];
+				for (long j : parts_of_box[b2]) {
+					pairForce(i, j, xi - positions[0][j] - sx,
+					          yi - positions[1][j] - sy,
+							  acc.fx[j], acc.fy[j]);
 				}
 			}
 		}
 	}
 }
 
-//! Compute internal force between particles i and j (soft potential)
-void State::calcInternalForceIJ_soft(const long i, const long j) {
+/*! \brief Compute internal force between particles i and j (soft potential)
+ *
+ * (dx, dy) is the separation from j (or its image) to i, and the force
+ * on j is added to (fx_j, fy_j), which may belong to a ghost of j.
+ * The energy of the pair, eps (1 - r)^2 / 2, is split between i and j.
+ */
+template<bool ALIGN, bool SHEAR, bool ENERGY>
+void State::calcInternalForceIJ_soft(PairAccum &acc,
+                                     const long i, const long j,
+                                     const double dx, const double dy,
+                                     double &fx_j, double &fy_j) {
 	// std::cout << i << " " << j << "\n";
 
-	double dx = positions[0][i] - positions[0][j];
-	double dy = positions[1][i] - positions[1][j];
-	// We want the periodized interval to be centered in 0
-	pbcSym(dx, len);
-	pbcSym(dy, len);
 	double dr2 = dx * dx + dy * dy;
 
 	if(dr2 * (1. - dr2) > 0.) {
-		double u = pot_strength * (1.0 / std::sqrt(dr2) - 1.0);
+		double r = std::sqrt(dr2);
+		double u = pot_strength * (1.0 / r - 1.0);
 		double fx = u * dx;
 		double fy = u * dy;
 
-		forces[0][i] += fx;
-		forces[0][j] -= fx;
-		forces[1][i] += fy;
-		forces[1][j] -= fy;
+		acc.fx[i] += fx;
+		fx_j -= fx;
+		acc.fy[i] += fy;
+		fy_j -= fy;
+		if (SHEAR) {
+			acc.virial_xy += dx * fy;
+		}
+		if (ENERGY) {
+			double e = 0.5 * pot_strength * (1.0 - r) * (1.0 - r);
+			acc.energies[i] += 0.5 * e;
+			acc.energies[j] += 0.5 * e;
+			acc.energy += e;
+		}
+	}
+	if (ALIGN && dr2 < align_radius_sq) {
+		calcTorqueIJ(acc, i, j);
 	}
 }
 
 //! Compute internal force between particles i and j (WCA potential)
-void State::calcInternalForceIJ_WCA(const long i, const long j) {
+//! (same arguments as calcInternalForceIJ_soft)
+//! The energy of the pair is 4 eps (r^-12 - r^-6), shifted to vanish
+//! at the cutoff
+template<bool ALIGN, bool SHEAR, bool ENERGY>
+void State::calcInternalForceIJ_WCA(PairAccum &acc,
+                                     const long i, const long j,
+                                     const double dx, const double dy,
+                                     double &fx_j, double &fy_j) {
 	//std::cout << i << " " << j << "\n";
 
-	double dx = positions[0][i] - positions[0][j];
-	double dy = positions[1][i] - positions[1][j];
-	// We want the periodized interval to be centered in 0
-	pbcSym(dx, len);
-	pbcSym(dy, len);
 	double dr2 = dx * dx + dy * dy;
 
 	if(dr2 * (TWOONESIXTH - dr2) > 0.) {
@@ -276,42 +1015,342 @@ void State::calcInternalForceIJ_WCA(const long i, const long j) {
 		double fx = u * dx;
 		double fy = u * dy;
 
-		forces[0][i] += fx;
-		forces[0][j] -= fx;
-		forces[1][i] += fy;
-		forces[1][j] -= fy;
+		acc.fx[i] += fx;
+		fx_j -= fx;
+		acc.fy[i] += fy;
+		fy_j -= fy;
+		if (SHEAR) {
+			acc.virial_xy += dx * fy;
+		}
+		if (ENERGY) {
+			// Shifted to vanish at the cutoff, where r^2 = TWOONESIXTH
+			const double cut6 = 1. / (TWOONESIXTH * TWOONESIXTH
+			                          * TWOONESIXTH);
+			double inv6 = 1. / (dr2 * dr2 * dr2);
+			double e = 4. * pot_strength * (inv6 * (inv6 - 1.)
+			                                - cut6 * (cut6 - 1.));
+			acc.energies[i] += 0.5 * e;
+			acc.energies[j] += 0.5 * e;
+			acc.energy += e;
+		}
+	}
+	if (ALIGN && dr2 < align_radius_sq) {
+		calcTorqueIJ(acc, i, j);
+	}
+}
+
+/* \brief Compute the real-space part of the long-range forces.
+ *
+ * The short-range part of the 2d Coulomb potential, g E1(alpha^2 r^2) / 2,
+ * gives the force g exp(-alpha^2 r^2) / r. It is computed with the boxes,
+ * whose size is larger than the cutoff.
+ */
+void State::calcEwaldRealSpace() {
+	const long n_boxes = boxes.getNBoxes();
+	const std::vector< std::vector<long> > &nbrs_pos = boxes.getNbrsPos();
+	const std::vector< std::vector< std::array<double, 2> > > &nbrs_shift = \
+		boxes.getNbrsShift();
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+	const double alpha2 = mesh->getAlpha() * mesh->getAlpha();
+	const double cutoff2 = mesh->getCutoff() * mesh->getCutoff();
+	const double strength = mesh->getStrength();
+
+	auto pairForce = [&](const long i, const long j,
+	                     const double sx, const double sy) {
+		double dx = positions[0][i] - positions[0][j] - sx;
+		double dy = positions[1][i] - positions[1][j] - sy;
+		double dr2 = dx * dx + dy * dy;
+		if (dr2 < cutoff2) {
+			double u = strength * std::exp(-alpha2 * dr2) / dr2;
+			forces[0][i] += u * dx;
+			forces[0][j] -= u * dx;
+			forces[1][i] += u * dy;
+			forces[1][j] -= u * dy;
+		}
+	};
+
+	for (long b1 = 0 ; b1 < n_boxes ; ++b1) {
+		for (auto it_i = parts_of_box[b1].cbegin() ;
+			 it_i != parts_of_box[b1].cend() ; ++it_i) {
+			for (auto it_j = parts_of_box[b1].cbegin() ;
+				 it_j != it_i ; ++it_j) {
+				pairForce(*it_i, *it_j, 0, 0);
+			}
+			for (size_t n = 0 ; n < nbrs_pos[b1].size() ; ++n) {
+				for (long j : parts_of_box[nbrs_pos[b1][n]]) {
+					pairForce(*it_i, j, nbrs_shift[b1][n][0],
+					          nbrs_shift[b1][n][1]);
+				}
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Compute the alignment torque between particles i and j.
+ *
+ * The torque on i is g sin(theta_j - theta_i) for polar alignment
+ * and g sin(2 (theta_j - theta_i)) for nematic alignment. It is computed
+ * from the stored cosines and sines, and the opposite torque is exerted
+ * on j, as for the forces.
+ */
+inline void State::calcTorqueIJ(PairAccum &acc, const long i,
+                                const long j) {
+	// sin(theta_j - theta_i)
+	double sd = orients[1][j] * orients[0][i] - orients[0][j] * orients[1][i];
+	if (nematic) {
+		// sin(2 x) = 2 sin(x) cos(x)
+		sd *= 2. * (orients[0][j] * orients[0][i]
+				    + orients[1][j] * orients[1][i]);
+	}
+	acc.torques[i] += align_strength * sd;
+	acc.torques[j] -= align_strength * sd;
+}
+
+/*!
+ * \brief Force exerted by a WCA wall on a particle.
+ *
+ * \param h Distance between the particle and the wall
+ * \param eps Strength of the potential
+ * \return Norm of the force (directed away from the wall)
+ */
+inline double wallForceWCA(double h, const double eps) {
+	h = std::max(h, WALL_HMIN);
+	double s6 = std::pow(WALL_SIGMA / h, 6);
+	return eps * 24. * (2. * s6 * s6 - s6) / h;
+}
+
+/* \brief Compute the forces exerted by the walls.
+ *
+ * Only the particles in the boxes close to the walls are considered,
+ * so that the cost is proportional to the number of particles
+ * at the boundary. The force is capped so that a wall moves a particle
+ * by at most WALL_SIGMA over a step (the friction being 1, the impulse
+ * of a step moves it by dt times the force in total, whatever the mass):
+ * a particle pushed deep into a wall by the noise is brought back
+ * instead of being thrown across the system.
+ */
+void State::calcWallForces() {
+	const double range = TWOONESIXTH * WALL_SIGMA;
+	const double f_max = WALL_SIGMA / dt;
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+
+	if (walls == WALLS_CIRCLE) {
+		const double rad = 0.5 * std::min(len_x, len_y);
+		for (long b : wall_boxes) {
+			for (long i : parts_of_box[b]) {
+				double dx = positions[0][i] - 0.5 * len_x;
+				double dy = positions[1][i] - 0.5 * len_y;
+				double dr = std::sqrt(dx * dx + dy * dy);
+				double h = rad - dr;
+				if (h < range && dr > 0.) {
+					// Directed towards the center
+					double u = std::min(wallForceWCA(h, pot_strength),
+					                    f_max) / dr;
+					forces[0][i] -= u * dx;
+					forces[1][i] -= u * dy;
+				}
+			}
+		}
+	} else {
+		const int first_axis = (walls == WALLS_CHANNEL) ? 1 : 0;
+		const double lens[2] = {len_x, len_y};
+		for (long b : wall_boxes) {
+			for (long i : parts_of_box[b]) {
+				for (int a = first_axis ; a < 2 ; ++a) {
+					double h = positions[a][i];
+					if (h < range) {
+						forces[a][i] += std::min(
+							wallForceWCA(h, pot_strength), f_max);
+					}
+					h = lens[a] - positions[a][i];
+					if (h < range) {
+						forces[a][i] -= std::min(
+							wallForceWCA(h, pot_strength), f_max);
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+ * \brief Find the boxes which may contain particles feeling the walls.
+ *
+ * This is done only once. A box is kept if some of its points are
+ * within the range of the walls (or beyond the walls).
+ */
+void State::computeWallBoxes() {
+	const double range = TWOONESIXTH * WALL_SIGMA;
+	std::array<double, 2> lo, hi;
+
+	wall_boxes.clear();
+	for (long k = 0 ; k < boxes.getNBoxes() ; ++k) {
+		boxes.getBoxBounds(k, lo, hi);
+		bool close = false;
+		if (walls == WALLS_CIRCLE) {
+			// Farthest corner of the box from the center
+			const double rad = 0.5 * std::min(len_x, len_y);
+			double dx = std::max(std::abs(lo[0] - 0.5 * len_x),
+					             std::abs(hi[0] - 0.5 * len_x));
+			double dy = std::max(std::abs(lo[1] - 0.5 * len_y),
+					             std::abs(hi[1] - 0.5 * len_y));
+			close = (dx * dx + dy * dy > (rad - range) * (rad - range));
+		} else {
+			close = (lo[1] < range || hi[1] > len_y - range);
+			if (walls == WALLS_FLAT) {
+				close = close || lo[0] < range || hi[0] > len_x - range;
+			}
+		}
+		if (close) {
+			wall_boxes.push_back(k);
+		}
+	}
+}
+
+/*
+ * \brief Move the particles inside the walls.
+ *
+ * The initial positions are uniform in the box: they are mapped
+ * to uniform positions in the region allowed by the walls, at distance
+ * at least WALL_SIGMA from them.
+ */
+void State::placeInsideWalls() {
+	if (walls == WALLS_CIRCLE) {
+		const double rad = 0.5 * std::min(len_x, len_y) - WALL_SIGMA;
+		for (long i = 0 ; i < n_parts ; ++i) {
+			double r = rad * std::sqrt(positions[0][i] / len_x);
+			double phi = 2.0 * M_PI * positions[1][i] / len_y;
+			positions[0][i] = 0.5 * len_x + r * std::cos(phi);
+			positions[1][i] = 0.5 * len_y + r * std::sin(phi);
+		}
+	} else {
+		const double lens[2] = {len_x, len_y};
+		const int first_axis = (walls == WALLS_CHANNEL) ? 1 : 0;
+		for (int a = first_axis ; a < 2 ; ++a) {
+			double fac = (lens[a] - 2 * WALL_SIGMA) / lens[a];
+			for (long i = 0 ; i < n_parts ; ++i) {
+				positions[a][i] = WALL_SIGMA + fac * positions[a][i];
+			}
+		}
+	}
+}
+
+/*
+ * \brief Reflect the particles which crossed a wall.
+ *
+ * The noise can push a particle through a wall despite its repulsion:
+ * it is put back at its mirror image inside (and its velocity
+ * is reflected too with inertia).
+ */
+void State::reflectOnWalls() {
+	if (walls == WALLS_CIRCLE) {
+		const double rad = 0.5 * std::min(len_x, len_y);
+		OMP_PRAGMA(omp parallel for schedule(static))
+		for (long i = 0 ; i < n_parts ; ++i) {
+			double dx = positions[0][i] - 0.5 * len_x;
+			double dy = positions[1][i] - 0.5 * len_y;
+			double dr2 = dx * dx + dy * dy;
+			if (dr2 > rad * rad) {
+				double dr = std::sqrt(dr2);
+				// Far beyond the wall (a step larger than the system,
+				// which the capped wall force cannot cause): put back
+				// at distance WALL_SIGMA from it, as in placeInsideWalls
+				double r = 2.0 * rad - dr;
+				double fac = ((r >= WALL_SIGMA) ? r : rad - WALL_SIGMA) / dr;
+				positions[0][i] = 0.5 * len_x + fac * dx;
+				positions[1][i] = 0.5 * len_y + fac * dy;
+				if (mass > 0.) {
+					double vr = (velocities[0][i] * dx
+					             + velocities[1][i] * dy) / dr2;
+					if (vr > 0.) {
+						velocities[0][i] -= 2.0 * vr * dx;
+						velocities[1][i] -= 2.0 * vr * dy;
+					}
+				}
+			}
+		}
+	} else {
+		const double lens[2] = {len_x, len_y};
+		const int first_axis = (walls == WALLS_CHANNEL) ? 1 : 0;
+		for (int a = first_axis ; a < 2 ; ++a) {
+			const double x_max = std::nextafter(lens[a], 0.0);
+			OMP_PRAGMA(omp parallel for schedule(static))
+			for (long i = 0 ; i < n_parts ; ++i) {
+				double &x = positions[a][i];
+				if (x < 0.0 || x > x_max) {
+					const bool below = (x < 0.0);
+					x = below ? -x : 2.0 * lens[a] - x;
+					if (x < 0.0 || x > x_max) {
+						// Far beyond the wall (a step larger than the
+						// system, which the capped wall force cannot
+						// cause): put back at distance WALL_SIGMA from it
+						x = below ? WALL_SIGMA : lens[a] - WALL_SIGMA;
+					}
+					if (mass > 0.) {
+						velocities[a][i] = below ? std::abs(velocities[a][i])
+						                         : -std::abs(velocities[a][i]);
+					}
+				}
+			}
+		}
 	}
 }
 
 /* 
  * \brief Enforce periodic boundary conditions
+ *
+ * The axes closed by walls are not wrapped: the particles which
+ * crossed a wall are reflected instead.
  */
 void State::enforcePBC() {
+	if (shear_rate != 0.) {
+		// Lees-Edwards: crossing the boundary along y shifts x
+		for (long i = 0 ; i < n_parts ; ++i) {
+			double k = std::floor(positions[1][i] / len_y);
+			positions[1][i] -= k * len_y;
+			positions[0][i] -= k * shear_offset;
+		}
+	}
+
+	const bool periodic_x = (walls == WALLS_NONE || walls == WALLS_CHANNEL);
+	const bool periodic_y = (walls == WALLS_NONE);
 #ifdef USE_MKL
-	pbcMKL(positions[0], len, aux_x, n_parts);
-	pbcMKL(positions[1], len, aux_y, n_parts);
-	pbcMKL(angles, 2.0 * M_PI, aux_angle, n_parts);
+	if (periodic_x) {
+		pbcMKL(positions[0].data(), len_x, aux_x.data(), n_parts);
+	}
+	if (periodic_y) {
+		pbcMKL(positions[1].data(), len_y, aux_y.data(), n_parts);
+	}
+	pbcMKL(angles.data(), 2.0 * M_PI, aux_angle.data(), n_parts);
 #else
+	OMP_PRAGMA(omp parallel for schedule(static))
 	for (long i = 0 ; i < n_parts ; ++i) {
-		pbc(positions[0][i], len);
-		pbc(positions[1][i], len);
+		if (periodic_x) {
+			pbc(positions[0][i], len_x);
+		}
+		if (periodic_y) {
+			pbc(positions[1][i], len_y);
+		}
 		pbc(angles[i], 2.0 * M_PI);
 	}
 #endif
+
+	if (walls != WALLS_NONE) {
+		reflectOnWalls();
+	}
 }
 
 #ifdef USE_MKL
-void pbcMKL(std::vector<double> &v, const double L, std::vector<double> &aux,
-	        const long N) {
-	cblas_daxpby(N, 1.0 / L, v.data(), 1, 0.0, aux.data(), 1);
-	vdFloor(N, aux.data(), aux.data());
-	cblas_daxpy(N, -L, aux.data(), 1, v.data(), 1);
+void pbcMKL(double *v, const double L, double *aux, const long N) {
+	cblas_daxpby(N, 1.0 / L, v, 1, 0.0, aux, 1);
+	vdFloor(N, aux, aux);
+	cblas_daxpy(N, -L, aux, 1, v, 1);
 }	
 
-void pbcSymMKL(std::vector<double> &v, const double L,
-		       std::vector<double> &aux, const long N) {
-	cblas_daxpby(N, 1.0 / L, v.data(), 1, 0.0, aux.data(), 1);
-	vdRound(N, aux.data(), aux.data());
-	cblas_daxpy(N, -L, aux.data(), 1, v.data(), 1);
+void pbcSymMKL(double *v, const double L, double *aux, const long N) {
+	cblas_daxpby(N, 1.0 / L, v, 1, 0.0, aux, 1);
+	vdRound(N, aux, aux);
+	cblas_daxpy(N, -L, aux, 1, v, 1);
 }	
 #endif
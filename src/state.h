@@ -31,7 +31,12 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <vector>
 #include <array>
+#include <memory>
 #include "boxes.h"
+#include "partAllocator.h"
+#include "workers.h"
+#include "externalField.h"
+#include "particleMesh.h"
 
 #ifdef USE_MKL
 	#include "mkl.h"
@@ -42,6 +47,75 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 
 // 2^(1/6)
 #define TWOONESIXTH 1.12246204830937298143 
+// Diameter for the WCA interaction between a particle and a wall
+#define WALL_SIGMA 0.5
+// Smallest distance to a wall used for the force (avoids infinite forces)
+#define WALL_HMIN 0.25
+
+//! Type of confining walls
+enum WallsType {
+	WALLS_NONE, //!< No walls: fully periodic system
+	WALLS_FLAT, //!< Flat walls orthogonal to x and y (closed box)
+	WALLS_CHANNEL, //!< Flat walls orthogonal to y (channel along x)
+	WALLS_CIRCLE //!< Circular wall inscribed in the box
+};
+
+/*!
+ * \brief Accumulators of the loop over the pairs
+ *
+ * The forces, torques, virial and energies are accumulated there,
+ * so that each thread can use its own.
+ */
+struct PairAccum {
+	double *fx; //!< Forces along x
+	double *fy; //!< Forces along y
+	double *torques; //!< Alignment torques
+	double *ghost_fx; //!< Forces along x on the ghosts
+	double *ghost_fy; //!< Forces along y on the ghosts
+	double virial_xy; //!< Sum of dx * fy over the pairs (sheared system)
+	double *energies; //!< Interaction energies of the particles
+	double energy; //!< Total interaction energy
+};
+
+#ifndef USE_MKL
+/*!
+ * \brief Random numbers of a thread
+ *
+ * Each OpenMP thread draws the noise of its particles from its own
+ * generator (there is a single one without OpenMP).
+ */
+struct NoiseStream {
+	NoiseStream(const unsigned long seed, const double stddev_temp,
+	            const double stddev_rot, const double stddev_vel) :
+		rng(seed), noiseTemp(0.0, stddev_temp), noiseAngle(0.0, stddev_rot),
+		noiseVel(0.0, stddev_vel) {}
+
+	std::mt19937 rng; //!< Random number generator
+	//! Gaussian noise for temperature
+	std::normal_distribution<double> noiseTemp;
+	//! Gaussian noise for angle
+	std::normal_distribution<double> noiseAngle;
+	//! Gaussian noise for velocity (underdamped dynamics)
+	std::normal_distribution<double> noiseVel;
+};
+#endif
+
+/*!
+ * \brief Buffers of a thread for the computation of the forces
+ *
+ * They are indexed by particle but only backed where the thread writes
+ * them, by the thread itself: around its slab, on its NUMA node.
+ */
+struct ThreadBuffers {
+	std::array<ZeroParts, 2> forces; //!< Internal forces
+	ZeroParts torques; //!< Alignment torques
+	ZeroParts energies; //!< Interaction energies
+	//! Ranges [begin, end) of the particles written in the step
+	//! (disjoint, the second one being empty if not needed)
+	std::array<std::array<long, 2>, 2> windows;
+	Arena scratch; //!< Memory of the forces on the ghosts
+	PairAccum acc; //!< Accumulators pointing to the buffers
+};
 
 
 /*!
@@ -53,69 +127,201 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 class State {
 	public:
 		//! Constructor of State
-		State(const double _len, const long _n_parts,
+		State(const double _len_x, const double _len_y, const long _n_parts,
 		      const double _pot_strength, const double _temperature,
 			  const double _rot_dif, const double _activity, const double _dt,
-			  const int _fac_boxes, const bool _wca=false);
+			  const int _fac_boxes, const bool _wca=false,
+			  const WallsType _walls=WALLS_NONE,
+			  const ExternalField *_field=nullptr,
+			  const double _align_strength=0.0,
+			  const double _align_radius=1.0, const bool _nematic=false,
+			  const double _mass=0.0, const double _shear_rate=0.0,
+			  ParticleMesh *_mesh=nullptr, const bool _ghosts=false,
+			  Workers *_workers=nullptr, const bool _with_energy=false);
 		~State() {
 #ifdef USE_MKL
 			vslDeleteStream(&stream);
 #endif
 		}
 		void evolve(); //!< Do one time step
+		//! Replace the random initial configuration
+		void setConfiguration(const double *pos_x, const double *pos_y,
+		                      const double *_angles);
+		//! Update the boxes incrementally, with a full rebuild
+		//! every given number of steps (0 to rebuild at each step)
+		void setCellRebuild(const long every) {
+			boxes.setIncremental(every);
+		}
+		//! Sort the particles by box every given number of steps
+		//! with several threads (0 to only sort them at the start)
+		void setSortEvery(const long every) {
+			sort_every = every;
+		}
 
 		//! Get the x coordinate of the positions 
-		const std::vector<double> & getPosX() const {
+		const PartVector<double> & getPosX() const {
 			return positions[0];
 		}
 		//! Get the y coordinate of the positions 
-		const std::vector<double> & getPosY() const {
+		const PartVector<double> & getPosY() const {
 			return positions[1];
 		}
 
 		//! Get angle of particle i
-		const std::vector<double> & getAngles() const {
+		const PartVector<double> & getAngles() const {
 			return angles;
 		}
+		//! Get the index in the arrays of each particle, numbered as in
+		//! the initial configuration (nullptr if they are never sorted)
+		const long * getSlots() const {
+			return slots.empty() ? nullptr : slots.data();
+		}
+
+		//! Get the Lees-Edwards offset of the upper image along x
+		double getShearOffset() const {
+			return shear_offset;
+		}
+		//! Compute the interaction energy with the next forces
+		void requestEnergy() {
+			energy_next = with_energy;
+		}
+		//! Get the total interaction energy (last computed)
+		double getEnergy() const {
+			return energy;
+		}
+		//! Get the interaction energies of the particles (last computed)
+		const PartVector<double> & getEnergies() const {
+			return energies;
+		}
+		//! Get the xy component of the interaction stress (sheared system)
+		double getStressXY() const {
+			return -virial_xy / (len_x * len_y);
+		}
 
 		double avgFAlong() const; //! Average force along the orientation
+		double polarization() const; //!< Modulus of the average orientation
 		void dump() const; //!< Dump the positions and orientations
 
 
 	private:
+		void evolveInertial(); //!< Do one time step (underdamped)
+		//! Compute the total forces (internal, active and external)
+		void calcTotalForces();
 		void calcInternalForces(); //!< Compute internal forces
+		//! Choose the loop over the pairs according to the interactions
+		template<bool SHEAR, bool ENERGY>
+		void calcInternalForcesDispatch();
+		//! Run the loop over the pairs on one or several threads
+		template<bool WCA, bool ALIGN, bool SHEAR, bool ENERGY>
+		void calcInternalForcesRun();
+		//! Loop over the pairs of neighboring particles in some boxes
+		template<bool WCA, bool ALIGN, bool SHEAR, bool ENERGY>
+		void calcInternalForcesLoop(const long b_begin, const long b_end,
+		                            PairAccum &acc);
 		 //! Compute internal force between particles i and j (soft)
-		void calcInternalForceIJ_soft(const long i, const long j);
+		template<bool ALIGN, bool SHEAR, bool ENERGY>
+		void calcInternalForceIJ_soft(PairAccum &acc,
+		                              const long i, const long j,
+		                              const double dx, const double dy,
+		                              double &fx_j, double &fy_j);
 		 //! Compute internal force between particles i and j (WCA)
-		void calcInternalForceIJ_WCA(const long i, const long j);
+		template<bool ALIGN, bool SHEAR, bool ENERGY>
+		void calcInternalForceIJ_WCA(PairAccum &acc,
+		                              const long i, const long j,
+		                              const double dx, const double dy,
+		                              double &fx_j, double &fy_j);
+		//! Compute alignment torque between particles i and j
+		void calcTorqueIJ(PairAccum &acc, const long i, const long j);
+		//! Allocate the forces on the ghosts and clear the accumulators
+		void startAccum(PairAccum &acc, Arena &mem);
+		//! Add the forces on the ghosts of the halos of some boxes
+		//! to their owners
+		void foldGhostForces(const long b_begin, const long b_end,
+		                     PairAccum &acc);
+		//! Find the particles whose forces a thread writes
+		void findWindows(const long b_begin, const long b_end,
+		                 ThreadBuffers &buf) const;
+		//! Split the boxes between the threads
+		void splitBoxes();
+		//! Write the arrays of the particles first from their threads
+		void firstTouch();
+		void sortByBox(); //!< Sort the particles by box
+		//! Sort the particles by box if it is time to
+		void sortIfDue();
+		void reserveGhosts(); //!< Reserve the memory of the ghosts
+		//! Compute the real-space part of the long-range forces
+		void calcEwaldRealSpace();
+		void calcWallForces(); //!< Compute forces exerted by the walls
+		void computeWallBoxes(); //!< Find the boxes close to the walls
+		void placeInsideWalls(); //!< Move the particles inside the walls
+		void reflectOnWalls(); //!< Reflect the particles which crossed a wall
 		void enforcePBC(); //!< Enforce periodic boundary conditions
 
-		const double len; //!< Length of the box
+		const double len_x; //!< Length of the box along x
+		const double len_y; //!< Length of the box along y
 		const long n_parts; //!< Number of particles
 		const double pot_strength; //!< Strength of the interparticle potential
 		const double activity; //!< Activity
 		const double dt; //!< Timestep
 		const bool wca; //!< Use WCA potential
+		const WallsType walls; //!< Type of confining walls
+		//! External fields and activity landscape (nullptr if none)
+		const ExternalField *field;
+		const double align_strength; //!< Strength of the alignment
+		const double align_radius_sq; //!< Square of the radius of alignment
+		const bool nematic; //!< Nematic instead of polar alignment
+		const double mass; //!< Mass (0 for overdamped dynamics)
+		const double shear_rate; //!< Shear rate (Lees-Edwards)
+		//! Offset of the upper image along x, between -len_x/2 and len_x/2
+		double shear_offset;
+		double virial_xy; //!< Sum of dx * fy over the pairs (sheared system)
+		const bool with_energy; //!< The energy can be requested
+		bool energy_next; //!< Compute the energy with the next forces
+		double energy; //!< Total interaction energy (last computed)
+		//! Mesh for the long-range interactions (nullptr if none)
+		ParticleMesh *mesh;
 
 		Boxes<2> boxes; //!< Boxes for algorithm
+		//! Boxes containing the particles which can feel the walls
+		std::vector<long> wall_boxes;
 
 #ifdef USE_MKL
-		double stddev_temp, stddev_rot;
+		double stddev_temp, stddev_rot, stddev_vel;
 		VSLStreamStatePtr stream;
-		std::vector<double> aux_x, aux_y, aux_angle;
+		PartVector<double> aux_x, aux_y, aux_angle;
 #else
-		std::mt19937 rng; //!< Random number generator
-		//! Gaussian noise for temperature
-		std::normal_distribution<double> noiseTemp;
-		//! Gaussian noise for angle
-		std::normal_distribution<double> noiseAngle;
+		//! Random numbers of each thread (a single one without OpenMP)
+		std::vector<NoiseStream> noise;
 #endif
+		//! Damping of the velocity over a step (underdamped dynamics)
+		double damp_vel;
 
 		//! Positions of the particles
-		std::array<std::vector<double>, 2> positions;
-		std::vector<double> angles; //<! Angles
-		std::array<std::vector<double>, 2> forces;  //!< Internal forces
-		std::vector<double> f_along; //!< Internal forces along the orientation
+		std::array<PartVector<double>, 2> positions;
+		PartVector<double> angles; //<! Angles
+		std::array<PartVector<double>, 2> forces;  //!< Internal forces
+		Arena scratch; //!< Memory of the buffers of a time step
+		PartVector<double> f_along; //!< Internal forces along the orientation
+		//! Velocities of the particles (underdamped dynamics)
+		std::array<PartVector<double>, 2> velocities;
+		PartVector<double> torques; //!< Alignment torques
+		PartVector<double> energies; //!< Interaction energies (if requested)
+		//! Cosine and sine of the angles (only used for alignment)
+		std::array<PartVector<double>, 2> orients;
+
+		//! Threads computing the forces (nullptr for a single thread)
+		Workers *workers;
+		//! Buffers of each thread (parallel computation of the forces)
+		std::vector< std::unique_ptr<ThreadBuffers> > thread_bufs;
+		std::vector<long> box_split; //!< First box of each thread
+		//! Steps between the sorts by box (0: only at the start)
+		long sort_every;
+		long steps_since_sort; //!< Steps since the last sort by box
+		//! Particle in the initial numbering at each index (threads only)
+		PartVector<long> ids;
+		PartVector<long> slots; //!< Index of each particle (inverse of ids)
+		PartVector<long> sort_order; //!< Previous index at each index
+		PartVector<double> sort_tmp; //!< Array being sorted
 };
 
 /*! 
@@ -139,10 +345,8 @@ void pbc<double>(double &x, const double L) {
 }*/
 
 #ifdef USE_MKL
-void pbcMKL(std::vector<double> &v, const double L, std::vector<double> &aux,
-	        const long N);
-void pbcSymMKL(std::vector<double> &v, const double L,
-		       std::vector<double> &aux, const long N);
+void pbcMKL(double *v, const double L, double *aux, const long N);
+void pbcSymMKL(double *v, const double L, double *aux, const long N);
 #endif
 
 /*! 
@@ -158,18 +362,44 @@ inline void pbcSym(T &x, const T L) {
 	x -= L * std::round(x / L);
 }
 
-// Trick to avoid round ASSUMING LITTLE ENDIAN
-union i_cast {double d; int i[2];};
-#define double2int(i, d, t)  \
-    {volatile union i_cast u; u.d = (d) + 6755399441055744.0; \
-    (i) = (t)u.i[0];}
-
+/*! 
+ * \brief Periodic boundary conditions on a segment (symmetric, double)
+ * 
+ * Branchless version without rounding: a comparison gives the image
+ * to subtract. Contrary to the generic version, it ASSUMES that
+ * -3L/2 < x < 3L/2, which is the case for the difference between two
+ * positions in the box. It does not need any memory round-trip,
+ * so that the loops over the pairs can be vectorized.
+ *
+ * \param x Value
+ * \param L Length of the box
+ */
 template<>
 inline void pbcSym<double>(double &x, const double L) {
-	double d = x / L;
-	int i;
-	double2int(i, d, int);
-	x -= L * i;
+	const double h = 0.5 * L;
+	x -= L * (x > h);
+	x += L * (x < -h);
+}
+
+/*! 
+ * \brief Periodic boundary conditions with Lees-Edwards shift (symmetric)
+ * 
+ * Update (x, y) to be the nearest image, the images along y being
+ * shifted by offset along x (sliding bricks).
+ *
+ * \param x Value along x
+ * \param y Value along y
+ * \param Lx Length of the box along x
+ * \param Ly Length of the box along y
+ * \param offset Offset along x of the upper image
+ */
+inline void pbcSymLE(double &x, double &y, const double Lx, const double Ly,
+		             const double offset) {
+	// Same assumptions as pbcSym, the offset being less than Lx/2
+	const double k = (y > 0.5 * Ly) - (y < -0.5 * Ly);
+	y -= Ly * k;
+	x -= offset * k;
+	pbcSym(x, Lx);
 }
 
 /*! 
@@ -37,7 +37,7 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
  *
  * Initializes the state of the system: particles randomly placed in a 3d box.
  *
- * \param _len Length of the box
+ * \param _lens Lengths of the box along x, y and z
  * \param _n_parts Number of particles
  * \param _pot_strength Strength of the interparticle potential
  * \param _temperature Temperature
@@ -46,11 +46,11 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
  * \param _dt Timestep
  * \param _fac_boxes Factor for the boxes
  */
-State3d::State3d(const double _len, const long _n_parts,
+State3d::State3d(const std::array<double, 3> &_lens, const long _n_parts,
 	             const double _pot_strength, const double _temperature,
 			     const double _rot_dif, const double _activity,
 				 const double _dt, const int _fac_boxes) :
-	len(_len), n_parts(_n_parts), pot_strength(_pot_strength),
+	lens(_lens), n_parts(_n_parts), pot_strength(_pot_strength),
 	activity(_activity), dt(_dt),
 	// We seed the RNG with the current time
 	rng(std::chrono::system_clock::now().time_since_epoch().count()),
@@ -58,7 +58,7 @@ State3d::State3d(const double _len, const long _n_parts,
 	noiseTemp(0.0, std::sqrt(2.0 * _temperature * dt)),
 	// Standard deviation of gaussian noise from the rotational diffusivity
 	stddevOrient(std::sqrt(2.0 * _rot_dif * dt)),
-	boxes(_len, _n_parts, _fac_boxes)
+	boxes(_lens, _n_parts, 1.0, _fac_boxes)
 {
 	positions[0].resize(n_parts);
 	positions[1].resize(n_parts);
@@ -71,12 +71,14 @@ State3d::State3d(const double _len, const long _n_parts,
 	forces[1].resize(n_parts);
 	forces[2].resize(n_parts);
 
-    std::uniform_real_distribution<double> rndPos(0, len);
+    std::uniform_real_distribution<double> rndPosX(0, lens[0]);
+    std::uniform_real_distribution<double> rndPosY(0, lens[1]);
+    std::uniform_real_distribution<double> rndPosZ(0, lens[2]);
 
 	for (long i = 0 ; i < n_parts ; ++i) {
-		positions[0][i] = rndPos(rng);
-		positions[1][i] = rndPos(rng);
-		positions[2][i] = rndPos(rng);
+		positions[0][i] = rndPosX(rng);
+		positions[1][i] = rndPosY(rng);
+		positions[2][i] = rndPosZ(rng);
 		forces[0][i] = 0;
 		forces[1][i] = 0;
 		forces[2][i] = 0;
@@ -121,35 +123,46 @@ void State3d::calcInternalForces() {
 	boxes.update(positions);
 	const long n_boxes = boxes.getNBoxes();
 	const std::vector< std::vector<long> > &nbrs_pos = boxes.getNbrsPos();
-	const std::vector< std::vector<long> > &parts_of_box = \
-		boxes.getPartsOfBox();
+	const std::vector< std::vector< std::array<double, 3> > > &nbrs_shift = \
+		boxes.getNbrsShift();
+	const PartsOfBoxes &parts_of_box = boxes.getPartsOfBox();
+
+	// s is the shift of the nearest image of j given by the boxes
+	auto pairForce = [&](const long i, const long j,
+	                     const std::array<double, 3> &s) {
+		double dx = positions[0][i] - positions[0][j] - s[0];
+		double dy = positions[1][i] - positions[1][j] - s[1];
+		double dz = positions[2][i] - positions[2][j] - s[2];
+		double dr2 = dx * dx + dy * dy + dz * dz;
+
+		if(dr2 * (1. - dr2) > 0.) {
+			double u = pot_strength * (1.0 / std::sqrt(dr2) - 1.0);
+			double fx = u * dx;
+			double fy = u * dy;
+			double fz = u * dz;
+
+			forces[0][i] += fx;
+			forces[0][j] -= fx;
+			forces[1][i] += fy;
+			forces[1][j] -= fy;
+			forces[2][i] += fz;
+			forces[2][j] -= fz;
+		}
+	};
 
+	const std::array<double, 3> no_shift = {0, 0, 0};
 	for (long b1 = 0 ; b1 < n_boxes ; ++b1) {
-		for (long b2 : nbrs_pos[b1]) {
-			for (long i : parts_of_box[b1]) {
-				for (long j : parts_of_box[b2]) {
-					double dx = positions[0][i] - positions[0][j];
-					double dy = positions[1][i] - positions[1][j];
-					double dz = positions[2][i] - positions[2][j];
-					// We want the periodized interval to be centered in 0
-					pbcSym(dx, len);
-					pbcSym(dy, len);
-					pbcSym(dz, len);
-					double dr2 = dx * dx + dy * dy + dz * dz;
-
-					if(dr2 * (1. - dr2) > 0.) {
-						double u = pot_strength * (1.0 / std::sqrt(dr2) - 1.0);
-						double fx = u * dx;
-						double fy = u * dy;
-						double fz = u * dz;
-
-						forces[0][i] += fx;
-						forces[0][j] -= fx;
-						forces[1][i] += fy;
-						forces[1][j] -= fy;
-						forces[2][i] += fz;
-						forces[2][j] -= fz;
-					}
+		for (auto it_i = parts_of_box[b1].cbegin() ;
+			 it_i != parts_of_box[b1].cend() ; ++it_i) {
+			// Same box
+			for (auto it_j = parts_of_box[b1].cbegin() ;
+				 it_j != it_i ; ++it_j) {
+				pairForce(*it_i, *it_j, no_shift);
+			}
+			// Neighboring boxes
+			for (size_t n = 0 ; n < nbrs_pos[b1].size() ; ++n) {
+				for (long j : parts_of_box[nbrs_pos[b1][n]]) {
+					pairForce(*it_i, j, nbrs_shift[b1][n]);
 				}
 			}
 		}
@@ -161,8 +174,8 @@ void State3d::calcInternalForces() {
  */
 void State3d::enforcePBC() {
 	for (long i = 0 ; i < n_parts ; ++i) {
-		pbc(positions[0][i], len);
-		pbc(positions[1][i], len);
-		pbc(positions[2][i], len);
+		pbc(positions[0][i], lens[0]);
+		pbc(positions[1][i], lens[1]);
+		pbc(positions[2][i], lens[2]);
 	}
 }
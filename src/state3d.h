@@ -44,7 +44,7 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 class State3d {
 	public:
 		//! Constructor of State
-		State3d(const double _len, const long _n_parts,
+		State3d(const std::array<double, 3> &_lens, const long _n_parts,
 		        const double _pot_strength, const double _temperature,
 			    const double _rot_dif, const double _activity,
 				const double _dt, const int _fac_boxes);
@@ -73,7 +73,7 @@ class State3d {
 		void calcInternalForces(); //!< Compute internal forces
 		void enforcePBC(); //!< Enforce periodic boundary conditions
 
-		const double len; //!< Length of the box
+		const std::array<double, 3> lens; //!< Lengths of the box
 		const long n_parts; //!< Number of particles
 		const double pot_strength; //!< Strength of the interparticle potential
 		const double activity; //!< Activity
@@ -88,9 +88,9 @@ class State3d {
 		Boxes<3> boxes; //!< Boxes for algorithm
 
 		//! Positions of the particles
-		std::array<std::vector<double>, 3> positions;
+		std::array<PartVector<double>, 3> positions;
 		std::vector<PointOnSphere> orients; //<! Orientations
-		std::array<std::vector<double>, 3> forces;  //!< Internal forces
+		std::array<PartVector<double>, 3> forces;  //!< Internal forces
 };
 
 #endif // ACTIVEBROWNIAN_STATE3D_H_
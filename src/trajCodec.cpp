@@ -0,0 +1,460 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file trajCodec.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Compressed lossy trajectories
+ *
+ * Implementation of the methods of the classes TrajEncoder
+ * and TrajDecoder.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "trajCodec.h"
+
+// Largest number of bytes of a variable-length integer
+#define VARINT_MAX_BYTES 10
+
+/*!
+ * \brief Grids of the fields of a trajectory.
+ *
+ * \param dim Dimension (2 or 3)
+ * \param lens Lengths of the box
+ * \param pos_error Largest error on the positions
+ * \return Grid of each field
+ */
+std::vector<CodecGrid> codecGrids(const int dim,
+                                  const std::array<double, 3> &lens,
+                                  const double pos_error) {
+	std::vector<CodecGrid> grids;
+	// Positions from 0 to L included (walls)
+	for (int a = 0 ; a < dim ; ++a) {
+		double step = 2. * pos_error;
+		grids.push_back({0., step, (int64_t) std::ceil(lens[a] / step) + 1,
+		                 false});
+	}
+	if (dim == 2) {
+		grids.push_back({0., 2. * M_PI / CODEC_ANGLE_LEVELS,
+		                 CODEC_ANGLE_LEVELS, true});
+	} else {
+		// Polar angle from 0 to pi included, azimuth from -pi to pi
+		grids.push_back({0., M_PI / (CODEC_ANGLE_LEVELS - 1),
+		                 CODEC_ANGLE_LEVELS, false});
+		grids.push_back({-M_PI, 2. * M_PI / CODEC_ANGLE_LEVELS,
+		                 CODEC_ANGLE_LEVELS, true});
+	}
+	return grids;
+}
+
+/*!
+ * \brief Nearest point of the grid.
+ *
+ * \param g Grid
+ * \param v Value
+ * \return Index of the point
+ */
+static inline int64_t quantize(const CodecGrid &g, const double v) {
+	int64_t q = std::llround((v - g.offset) / g.step);
+	if (g.periodic) {
+		q %= g.levels;
+		return (q < 0) ? q + g.levels : q;
+	}
+	return std::max((int64_t) 0, std::min(q, g.levels - 1));
+}
+
+/*!
+ * \brief Write a signed integer with a variable length (zigzag).
+ *
+ * \param out Output
+ * \param d Integer
+ * \return Number of bytes written
+ */
+static inline size_t putVarint(unsigned char *out, const int64_t d) {
+	uint64_t z = ((uint64_t) d << 1) ^ (uint64_t) (d >> 63);
+	size_t n = 0;
+	while (z >= 0x80) {
+		out[n++] = (unsigned char) (z | 0x80);
+		z >>= 7;
+	}
+	out[n++] = (unsigned char) z;
+	return n;
+}
+
+/*!
+ * \brief Read a signed integer with a variable length (zigzag).
+ *
+ * \param in Input (advanced past the integer)
+ * \param end End of the input
+ * \return Integer
+ */
+static inline int64_t getVarint(const unsigned char *&in,
+                                const unsigned char *end) {
+	uint64_t z = 0;
+	int shift = 0;
+	while (in < end) {
+		unsigned char b = *in++;
+		z |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			break;
+		}
+		shift += 7;
+	}
+	return (int64_t) (z >> 1) ^ -(int64_t) (z & 1);
+}
+
+/*!
+ * \brief Constructor of TrajEncoder
+ *
+ * Create the file and write the header. On failure, an error message
+ * is printed and isOpen() returns false.
+ *
+ * \param fname Name of the file
+ * \param dim Dimension (2 or 3)
+ * \param _n_parts Number of particles
+ * \param lens Lengths of the box
+ * \param dt_frame Time between two frames
+ * \param pos_error Largest error on the positions
+ * \param _keyframes Number of frames between two keyframes
+ * \param _workers Threads encoding the chunks (nullptr for one thread)
+ * \param _level Level of compression of zlib (1 to 9)
+ */
+TrajEncoder::TrajEncoder(const std::string &fname, const int dim,
+                         const long _n_parts,
+						 const std::array<double, 3> &lens,
+						 const double dt_frame, const double pos_error,
+						 const long _keyframes, Workers *_workers,
+						 const int _level) :
+	file(fname, std::ios::binary), n_parts(_n_parts),
+	keyframes(std::max(_keyframes, 1L)), workers(_workers), level(_level),
+	n_chunks(_workers ? _workers->getNThreads() : 1),
+	grids(codecGrids(dim, lens, pos_error)), n_frames(0), n_bytes(0) {
+	if (!file.good()) {
+		std::cerr << "Error: cannot create the trajectory " << fname
+			<< std::endl;
+		return;
+	}
+
+	CodecHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, CODEC_MAGIC, 8);
+	header.byte_order = 1;
+	header.dim = dim;
+	header.n_parts = n_parts;
+	header.n_fields = grids.size();
+	header.keyframes = keyframes;
+	for (int a = 0 ; a < 3 ; ++a) {
+		header.lens[a] = lens[a];
+	}
+	header.dt_frame = dt_frame;
+	header.pos_error = pos_error;
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	n_bytes += sizeof(header);
+
+	// Buffers large enough for any frame, so that nothing is allocated
+	// when writing
+	prev.assign(grids.size() * n_parts, 0);
+	raw.resize(n_chunks);
+	comp.resize(n_chunks);
+	streams.resize(n_chunks);
+	sizes.resize(2 * n_chunks);
+	for (int c = 0 ; c < n_chunks ; ++c) {
+		long n = n_parts * (c + 1) / n_chunks - n_parts * c / n_chunks;
+		raw[c].resize(grids.size() * n * VARINT_MAX_BYTES + 1);
+		std::memset(&streams[c], 0, sizeof(z_stream));
+		deflateInit(&streams[c], level);
+		comp[c].resize(deflateBound(&streams[c], raw[c].size()));
+	}
+}
+
+/*!
+ * \brief Destructor of TrajEncoder
+ */
+TrajEncoder::~TrajEncoder() {
+	for (auto &strm : streams) {
+		deflateEnd(&strm);
+	}
+}
+
+/*!
+ * \brief Encode and write a frame.
+ *
+ * Each chunk of particles is quantized, turned into differences
+ * and compressed by its thread.
+ *
+ * \param value Function giving the value of field f for particle i
+ */
+template<typename F>
+void TrajEncoder::encode(const F &value) {
+	if (!file.good()) {
+		return;
+	}
+	const bool key = (n_frames % keyframes == 0);
+	const int n_fields = grids.size();
+
+	auto task = [&](const int c) {
+		const long i0 = n_parts * c / n_chunks;
+		const long i1 = n_parts * (c + 1) / n_chunks;
+		unsigned char *out = raw[c].data();
+		size_t len = 0;
+		for (int f = 0 ; f < n_fields ; ++f) {
+			const CodecGrid &g = grids[f];
+			int64_t *p = prev.data() + f * n_parts;
+			for (long i = i0 ; i < i1 ; ++i) {
+				int64_t q = quantize(g, value(f, i));
+				int64_t d = q;
+				if (!key) {
+					// Smallest difference modulo the size of the grid
+					d = q - p[i];
+					if (2 * d >= g.levels) {
+						d -= g.levels;
+					} else if (2 * d < -g.levels) {
+						d += g.levels;
+					}
+				}
+				p[i] = q;
+				len += putVarint(out + len, d);
+			}
+		}
+
+		z_stream &strm = streams[c];
+		deflateReset(&strm);
+		strm.next_in = out;
+		strm.avail_in = len;
+		strm.next_out = comp[c].data();
+		strm.avail_out = comp[c].size();
+		deflate(&strm, Z_FINISH);
+		sizes[2 * c] = strm.total_out;
+		sizes[2 * c + 1] = len;
+	};
+	if (workers) {
+		workers->run(task);
+	} else {
+		task(0);
+	}
+
+	CodecFrameHeader fh = {(uint32_t) key, (uint32_t) n_chunks};
+	file.write(reinterpret_cast<const char *>(&fh), sizeof(fh));
+	file.write(reinterpret_cast<const char *>(sizes.data()),
+	           sizes.size() * sizeof(uint64_t));
+	n_bytes += sizeof(fh) + sizes.size() * sizeof(uint64_t);
+	for (int c = 0 ; c < n_chunks ; ++c) {
+		file.write(reinterpret_cast<const char *>(comp[c].data()),
+		           sizes[2 * c]);
+		n_bytes += sizes[2 * c];
+	}
+	++n_frames;
+}
+
+/*!
+ * \brief Write a frame of a 2d system: x, y and angle.
+ *
+ * \param state State of the system
+ */
+void TrajEncoder::write(const State *state) {
+	const double *fields[3] = {state->getPosX().data(),
+	                           state->getPosY().data(),
+	                           state->getAngles().data()};
+	// The particles keep their initial numbering in the frames
+	const long *slots = state->getSlots();
+	encode([&](const int f, const long i) {
+		return fields[f][slots ? slots[i] : i];
+	});
+}
+
+/*!
+ * \brief Write a frame of a 3d system: position and orientation.
+ *
+ * \param state State of the system
+ */
+void TrajEncoder::write(const State3d *state) {
+	encode([&](const int f, const long i) {
+		switch (f) {
+			case 0:
+				return state->getPosX(i);
+			case 1:
+				return state->getPosY(i);
+			case 2:
+				return state->getPosZ(i);
+			case 3:
+				return state->getOrient(i)->getTheta();
+			default:
+				return state->getOrient(i)->getPhi();
+		}
+	});
+}
+
+/*!
+ * \brief Print the size of the trajectory compared to float32.
+ *
+ * \param out Output stream
+ */
+void TrajEncoder::printStats(std::ostream &out) const {
+	double raw_bytes = (double) n_frames * grids.size() * n_parts
+	                   * sizeof(float);
+	out << "# Trajectory: " << n_frames << " frames, " << n_bytes
+		<< " bytes (" << (n_bytes > 0 ? raw_bytes / n_bytes : 0.)
+		<< " times smaller than float32)" << std::endl;
+}
+
+/*!
+ * \brief Constructor of TrajDecoder
+ *
+ * Read the header and index the frames. On failure, an error message
+ * is printed and isOpen() returns false.
+ *
+ * \param fname Name of the file
+ */
+TrajDecoder::TrajDecoder(const std::string &fname) :
+	file(fname, std::ios::binary), last(-1) {
+	file.read(reinterpret_cast<char *>(&header), sizeof(header));
+	if (!file.good() || std::memcmp(header.magic, CODEC_MAGIC, 8) != 0
+		|| header.byte_order != 1 || (header.dim != 2 && header.dim != 3)) {
+		std::cerr << "Error: " << fname << " is not a compressed "
+			"trajectory (or was written on another architecture)"
+			<< std::endl;
+		return;
+	}
+
+	// Index of the complete frames
+	file.seekg(0, std::ios::end);
+	const std::streamoff file_len = file.tellg();
+	std::streamoff pos = sizeof(header);
+	while (true) {
+		file.seekg(pos);
+		CodecFrameHeader fh;
+		file.read(reinterpret_cast<char *>(&fh), sizeof(fh));
+		if (!file.good()) {
+			break;
+		}
+		std::vector<uint64_t> sizes(2 * fh.n_chunks);
+		file.read(reinterpret_cast<char *>(sizes.data()),
+		          sizes.size() * sizeof(uint64_t));
+		if (!file.good()) {
+			break;
+		}
+		std::streamoff next = pos + sizeof(fh)
+		                      + sizes.size() * sizeof(uint64_t);
+		for (uint32_t c = 0 ; c < fh.n_chunks ; ++c) {
+			next += sizes[2 * c];
+		}
+		if (next > file_len) {
+			break;
+		}
+		offsets.push_back(pos);
+		keys.push_back(fh.keyframe != 0);
+		pos = next;
+	}
+	file.clear();
+
+	grids = codecGrids(header.dim, {header.lens[0], header.lens[1],
+	                   header.lens[2]}, header.pos_error);
+	cur.assign(grids.size() * header.n_parts, 0);
+}
+
+/*!
+ * \brief Decode the frame at the current position of the file.
+ *
+ * \return False if the frame is corrupted
+ */
+bool TrajDecoder::decodeNext() {
+	const long n_parts = header.n_parts;
+	CodecFrameHeader fh;
+	file.read(reinterpret_cast<char *>(&fh), sizeof(fh));
+	std::vector<uint64_t> sizes(2 * fh.n_chunks);
+	file.read(reinterpret_cast<char *>(sizes.data()),
+	          sizes.size() * sizeof(uint64_t));
+
+	std::vector<unsigned char> comp, raw;
+	for (uint32_t c = 0 ; c < fh.n_chunks ; ++c) {
+		comp.resize(sizes[2 * c]);
+		raw.resize(sizes[2 * c + 1]);
+		file.read(reinterpret_cast<char *>(comp.data()), comp.size());
+		uLongf len = raw.size();
+		if (!file.good() || uncompress(raw.data(), &len, comp.data(),
+		                               comp.size()) != Z_OK) {
+			return false;
+		}
+
+		const unsigned char *in = raw.data(), *end = raw.data() + len;
+		const long i0 = n_parts * c / fh.n_chunks;
+		const long i1 = n_parts * (c + 1) / fh.n_chunks;
+		for (size_t f = 0 ; f < grids.size() ; ++f) {
+			const int64_t levels = grids[f].levels;
+			int64_t *q = cur.data() + f * n_parts;
+			for (long i = i0 ; i < i1 ; ++i) {
+				int64_t d = getVarint(in, end);
+				if (fh.keyframe) {
+					q[i] = d;
+				} else {
+					q[i] += d;
+					if (q[i] < 0) {
+						q[i] += levels;
+					} else if (q[i] >= levels) {
+						q[i] -= levels;
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+/*!
+ * \brief Read a frame.
+ *
+ * The frames are decoded from the last keyframe (or from the last frame
+ * read if it is closer).
+ *
+ * \param k Frame
+ * \param values Values of the fields: field f of particle i
+ * in values[f * n_parts + i]
+ * \return False if the frame does not exist or is corrupted
+ */
+bool TrajDecoder::read(const long k, std::vector<double> &values) {
+	if (!isOpen() || k < 0 || k >= getNFrames()) {
+		return false;
+	}
+	// Back to the last keyframe, or to the frame after the last one read
+	const long first = (last >= 0 && last < k) ? last + 1 : 0;
+	long start = k;
+	while (start > first && !keys[start]) {
+		--start;
+	}
+	file.seekg(offsets[start]);
+	for (long j = start ; j <= k ; ++j) {
+		if (!decodeNext()) {
+			last = -1;
+			return false;
+		}
+		last = j;
+	}
+
+	const long n_parts = header.n_parts;
+	values.resize(grids.size() * n_parts);
+	for (size_t f = 0 ; f < grids.size() ; ++f) {
+		for (long i = 0 ; i < n_parts ; ++i) {
+			values[f * n_parts + i] = grids[f].offset
+			                          + cur[f * n_parts + i] * grids[f].step;
+		}
+	}
+	return true;
+}
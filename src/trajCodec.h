@@ -0,0 +1,190 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file trajCodec.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Compressed lossy trajectories
+ *
+ * Header file for trajCodec.cpp.
+ * It defines the classes TrajEncoder and TrajDecoder.
+ *
+ * Each field is quantized on a grid: the positions with a step of twice
+ * the error bound (from 0 to the length of the box), the angles
+ * on 16 bits. The values are stored as differences with the previous
+ * frame, modulo the size of the grid, except for the keyframes which
+ * allow to seek. The differences are written as variable-length
+ * integers and compressed with zlib, by chunks of particles which are
+ * encoded in parallel.
+ *
+ * The fields are x, y, angle in 2d, and x, y, z, theta, phi
+ * (orientation) in 3d.
+ */
+
+#ifndef ACTIVEBROWNIAN_TRAJCODEC_H_
+#define ACTIVEBROWNIAN_TRAJCODEC_H_
+
+#include <string>
+#include <array>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <zlib.h>
+#include "state.h"
+#include "state3d.h"
+#include "workers.h"
+
+// Magic string at the beginning of the file
+#define CODEC_MAGIC "ABTRJZ01"
+// Number of levels of the angles (16 bits)
+#define CODEC_ANGLE_LEVELS 65536
+
+//! Header of a compressed trajectory
+struct CodecHeader {
+	char magic[8]; //!< CODEC_MAGIC
+	uint32_t byte_order; //!< 1 written in the native byte order
+	uint32_t dim; //!< Dimension (2 or 3)
+	uint64_t n_parts; //!< Number of particles
+	uint32_t n_fields; //!< Number of fields per particle
+	uint32_t keyframes; //!< Number of frames between two keyframes
+	double lens[3]; //!< Lengths of the box (0 for z in 2d)
+	double dt_frame; //!< Time between two frames
+	double pos_error; //!< Largest error on the positions
+};
+
+//! Header of a frame, followed by the sizes and the data of the chunks
+struct CodecFrameHeader {
+	uint32_t keyframe; //!< 1 if the values are not differences
+	uint32_t n_chunks; //!< Number of chunks of particles
+};
+
+//! Grid on which a field is quantized
+struct CodecGrid {
+	double offset; //!< Smallest value
+	double step; //!< Step of the grid
+	int64_t levels; //!< Number of points of the grid
+	bool periodic; //!< Values out of the grid are wrapped (or clamped)
+};
+
+//! Grids of the fields of a trajectory
+std::vector<CodecGrid> codecGrids(const int dim,
+                                  const std::array<double, 3> &lens,
+                                  const double pos_error);
+
+/*!
+ * \brief Class for writing a compressed trajectory
+ */
+class TrajEncoder {
+	public:
+		TrajEncoder(const std::string &fname, const int dim,
+		            const long _n_parts, const std::array<double, 3> &lens,
+					const double dt_frame, const double pos_error,
+					const long _keyframes=100, Workers *_workers=nullptr,
+					const int _level=1);
+		~TrajEncoder();
+		TrajEncoder(const TrajEncoder &) = delete;
+		TrajEncoder & operator=(const TrajEncoder &) = delete;
+
+		//! Whether the file could be created
+		bool isOpen() const {
+			return file.good();
+		}
+		void write(const State *state); //!< Write a frame (2d)
+		void write(const State3d *state); //!< Write a frame (3d)
+		//! Print the size of the trajectory compared to float32
+		void printStats(std::ostream &out) const;
+
+	private:
+		//! Encode and write a frame given by value(f, i)
+		template<typename F>
+		void encode(const F &value);
+
+		std::ofstream file; //!< Output file
+		const long n_parts; //!< Number of particles
+		const long keyframes; //!< Number of frames between two keyframes
+		Workers *workers; //!< Threads encoding the chunks (or nullptr)
+		const int level; //!< Level of compression of zlib
+		const int n_chunks; //!< Number of chunks of particles
+		std::vector<CodecGrid> grids; //!< Grids of the fields
+		std::vector<int64_t> prev; //!< Quantized values of the last frame
+		//! Variable-length integers of each chunk
+		std::vector< std::vector<unsigned char> > raw;
+		//! Compressed data of each chunk
+		std::vector< std::vector<unsigned char> > comp;
+		std::vector<z_stream> streams; //!< Compressor of each chunk
+		std::vector<uint64_t> sizes; //!< Compressed and raw size of chunks
+		long n_frames; //!< Number of frames written
+		uint64_t n_bytes; //!< Number of bytes written
+};
+
+/*!
+ * \brief Class for reading a compressed trajectory
+ *
+ * The frames are indexed when the file is opened, so that any frame
+ * can be read by decoding from the previous keyframe.
+ */
+class TrajDecoder {
+	public:
+		TrajDecoder(const std::string &fname);
+
+		//! Whether the file could be read
+		bool isOpen() const {
+			return !grids.empty();
+		}
+		//! Dimension (2 or 3)
+		int getDim() const {
+			return header.dim;
+		}
+		//! Number of particles
+		long getNParts() const {
+			return header.n_parts;
+		}
+		//! Number of fields per particle
+		int getNFields() const {
+			return header.n_fields;
+		}
+		//! Number of frames
+		long getNFrames() const {
+			return offsets.size();
+		}
+		//! Lengths of the box
+		std::array<double, 3> getLens() const {
+			return {header.lens[0], header.lens[1], header.lens[2]};
+		}
+		//! Time between two frames
+		double getDtFrame() const {
+			return header.dt_frame;
+		}
+		//! Read frame k: field f of particle i in values[f * n_parts + i]
+		bool read(const long k, std::vector<double> &values);
+
+	private:
+		bool decodeNext(); //!< Decode the frame at the current position
+
+		std::ifstream file; //!< Input file
+		CodecHeader header; //!< Header
+		std::vector<CodecGrid> grids; //!< Grids of the fields
+		std::vector<std::streamoff> offsets; //!< Position of each frame
+		std::vector<char> keys; //!< Whether each frame is a keyframe
+		std::vector<int64_t> cur; //!< Quantized values of the last frame
+		long last; //!< Last frame decoded (-1 if none)
+};
+
+#endif // ACTIVEBROWNIAN_TRAJCODEC_H_
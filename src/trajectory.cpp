@@ -0,0 +1,287 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file trajectory.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Raw binary trajectories, written and read through mmap
+ *
+ * Implementation of the methods of the classes TrajWriter and TrajReader.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trajectory.h"
+
+static_assert(sizeof(TrajHeader) <= TRAJ_HEADER_SIZE,
+              "The header of the trajectories is too large");
+
+/*!
+ * \brief Constructor of TrajWriter
+ *
+ * Create the file and write the header. On failure, an error message
+ * is printed and isOpen() returns false.
+ *
+ * \param fname Name of the file
+ * \param dim Dimension (2 or 3)
+ * \param _n_parts Number of particles
+ * \param lens Lengths of the box
+ * \param dt_frame Time between two frames
+ * \param n_frames_hint Expected number of frames
+ */
+TrajWriter::TrajWriter(const std::string &fname, const int dim,
+                       const long _n_parts, const std::array<double, 3> &lens,
+					   const double dt_frame, const long n_frames_hint) :
+	fd(-1), map(nullptr), map_len(0), header(nullptr), n_parts(_n_parts),
+	n_fields((dim == 3) ? 6 : 3), capacity(0) {
+	fd = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::cerr << "Error: cannot create the trajectory " << fname
+			<< ": " << std::strerror(errno) << std::endl;
+		return;
+	}
+	if (!resize(std::max(n_frames_hint, 1L))) {
+		std::cerr << "Error: cannot map the trajectory " << fname
+			<< ": " << std::strerror(errno) << std::endl;
+		return;
+	}
+
+	std::memcpy(header->magic, TRAJ_MAGIC, 8);
+	header->byte_order = 1;
+	header->dim = dim;
+	header->n_parts = n_parts;
+	header->n_fields = n_fields;
+	header->frame_bytes = header->n_fields * n_parts * sizeof(float);
+	header->n_frames = 0;
+	for (int a = 0 ; a < 3 ; ++a) {
+		header->lens[a] = lens[a];
+	}
+	header->dt_frame = dt_frame;
+}
+
+/*!
+ * \brief Destructor of TrajWriter
+ *
+ * Truncate the file to the frames actually written and close it.
+ */
+TrajWriter::~TrajWriter() {
+	if (map) {
+		off_t len = TRAJ_HEADER_SIZE + header->n_frames * header->frame_bytes;
+		munmap(map, map_len);
+		if (ftruncate(fd, len) != 0) {
+			std::cerr << "Warning: cannot truncate the trajectory" << std::endl;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+/*!
+ * \brief Enlarge the file and map it again.
+ *
+ * \param n_frames_cap Number of frames the file should hold
+ * \return True on success
+ */
+bool TrajWriter::resize(const uint64_t n_frames_cap) {
+	const size_t len = TRAJ_HEADER_SIZE
+	                   + n_frames_cap * n_fields * n_parts * sizeof(float);
+	if (map) {
+		munmap(map, map_len);
+		map = nullptr;
+		header = nullptr;
+	}
+	if (ftruncate(fd, len) != 0) {
+		return false;
+	}
+	void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	map = static_cast<char *>(p);
+	map_len = len;
+	header = reinterpret_cast<TrajHeader *>(map);
+	capacity = n_frames_cap;
+	return true;
+}
+
+/*!
+ * \brief Memory of the next frame, enlarging the file if needed.
+ *
+ * \return Beginning of the frame (nullptr on failure)
+ */
+float * TrajWriter::beginFrame() {
+	if (!map) {
+		return nullptr;
+	}
+	if (header->n_frames >= capacity) {
+		// The header is kept in the file
+		if (!resize(2 * capacity)) {
+			std::cerr << "Error: cannot enlarge the trajectory: "
+				<< std::strerror(errno) << std::endl;
+			return nullptr;
+		}
+	}
+	return reinterpret_cast<float *>(map + TRAJ_HEADER_SIZE
+	                                 + header->n_frames * header->frame_bytes);
+}
+
+/*!
+ * \brief Count the frame which was just filled.
+ */
+void TrajWriter::endFrame() {
+	++header->n_frames;
+}
+
+/*!
+ * \brief Write a frame of a 2d system: x, y and angle.
+ *
+ * \param state State of the system
+ */
+void TrajWriter::write(const State *state) {
+	float *frame = beginFrame();
+	if (!frame) {
+		return;
+	}
+	const PartVector<double> &pos_x = state->getPosX();
+	const PartVector<double> &pos_y = state->getPosY();
+	const PartVector<double> &angles = state->getAngles();
+	// The particles keep their initial numbering in the frames
+	const long *slots = state->getSlots();
+	for (long i = 0 ; i < n_parts ; ++i) {
+		const long k = slots ? slots[i] : i;
+		frame[i] = (float) pos_x[k];
+		frame[n_parts + i] = (float) pos_y[k];
+		frame[2 * n_parts + i] = (float) angles[k];
+	}
+	endFrame();
+}
+
+/*!
+ * \brief Write a frame of a 3d system: position and orientation.
+ *
+ * \param state State of the system
+ */
+void TrajWriter::write(const State3d *state) {
+	float *frame = beginFrame();
+	if (!frame) {
+		return;
+	}
+	for (long i = 0 ; i < n_parts ; ++i) {
+		const PointOnSphere *u = state->getOrient(i);
+		frame[i] = (float) state->getPosX(i);
+		frame[n_parts + i] = (float) state->getPosY(i);
+		frame[2 * n_parts + i] = (float) state->getPosZ(i);
+		frame[3 * n_parts + i] = (float) u->getX();
+		frame[4 * n_parts + i] = (float) u->getY();
+		frame[5 * n_parts + i] = (float) u->getZ();
+	}
+	endFrame();
+}
+
+/*!
+ * \brief Constructor of TrajReader
+ *
+ * Map the file read-only and check the header. On failure, an error
+ * message is printed and isOpen() returns false.
+ *
+ * \param fname Name of the file
+ */
+TrajReader::TrajReader(const std::string &fname) :
+	fd(-1), map(nullptr), map_len(0), header(nullptr), n_frames(0) {
+	fd = open(fname.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		std::cerr << "Error: cannot open the trajectory " << fname
+			<< ": " << std::strerror(errno) << std::endl;
+		return;
+	}
+	if (st.st_size < TRAJ_HEADER_SIZE) {
+		std::cerr << "Error: " << fname << " is not a trajectory"
+			<< std::endl;
+		return;
+	}
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		std::cerr << "Error: cannot map the trajectory " << fname
+			<< ": " << std::strerror(errno) << std::endl;
+		return;
+	}
+	map_len = st.st_size;
+	header = static_cast<const TrajHeader *>(p);
+
+	if (std::memcmp(header->magic, TRAJ_MAGIC, 8) != 0
+		|| header->byte_order != 1 || (header->dim != 2 && header->dim != 3)
+		|| header->frame_bytes
+		   != header->n_fields * header->n_parts * sizeof(float)) {
+		std::cerr << "Error: " << fname << " is not a trajectory "
+			"(or was written on another architecture)" << std::endl;
+		munmap(p, map_len);
+		header = nullptr;
+		return;
+	}
+	map = static_cast<const char *>(p);
+
+	// Only the complete frames (the file may still be written)
+	n_frames = header->n_frames;
+	if (header->frame_bytes > 0) {
+		n_frames = std::min(n_frames, (long) ((map_len - TRAJ_HEADER_SIZE)
+		                                      / header->frame_bytes));
+	}
+}
+
+/*!
+ * \brief Destructor of TrajReader
+ */
+TrajReader::~TrajReader() {
+	if (map) {
+		munmap(const_cast<char *>(map), map_len);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+/*!
+ * \brief Ask the system to read frames in advance.
+ *
+ * The pages are read in the background (readahead), so that playing
+ * a trajectory does not wait for the disk.
+ *
+ * \param k_begin First frame
+ * \param k_end Frame after the last one
+ */
+void TrajReader::prefetch(long k_begin, long k_end) const {
+	k_begin = std::max(k_begin, 0L);
+	k_end = std::min(k_end, n_frames);
+	if (!map || k_begin >= k_end) {
+		return;
+	}
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t begin = TRAJ_HEADER_SIZE + k_begin * header->frame_bytes;
+	size_t end = TRAJ_HEADER_SIZE + k_end * header->frame_bytes;
+	begin -= begin % page;
+	madvise(const_cast<char *>(map) + begin, end - begin, MADV_WILLNEED);
+}
@@ -0,0 +1,158 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file trajectory.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Raw binary trajectories, written and read through mmap
+ *
+ * Header file for trajectory.cpp.
+ * It defines the classes TrajWriter and TrajReader.
+ *
+ * A trajectory file is a header of TRAJ_HEADER_SIZE bytes followed by
+ * frames of fixed size. A frame stores each field for all the particles
+ * (structure of arrays) in float32 and in the native byte order:
+ * x, y, angle in 2d, and x, y, z, ux, uy, uz (orientation) in 3d.
+ * Frame k of field f thus starts at a known offset, without parsing.
+ */
+
+#ifndef ACTIVEBROWNIAN_TRAJECTORY_H_
+#define ACTIVEBROWNIAN_TRAJECTORY_H_
+
+#include <string>
+#include <array>
+#include <cstdint>
+#include "state.h"
+#include "state3d.h"
+
+// Size of the header (one page, so that the frames are page-aligned)
+#define TRAJ_HEADER_SIZE 4096
+// Magic string at the beginning of the file
+#define TRAJ_MAGIC "ABTRAJ01"
+
+//! Header of a trajectory file
+struct TrajHeader {
+	char magic[8]; //!< TRAJ_MAGIC
+	uint32_t byte_order; //!< 1 written in the native byte order
+	uint32_t dim; //!< Dimension (2 or 3)
+	uint64_t n_parts; //!< Number of particles
+	uint64_t n_fields; //!< Number of fields per particle
+	uint64_t frame_bytes; //!< Size of a frame in bytes
+	uint64_t n_frames; //!< Number of complete frames
+	double lens[3]; //!< Lengths of the box (0 for z in 2d)
+	double dt_frame; //!< Time between two frames
+};
+
+/*!
+ * \brief Class for writing a trajectory
+ *
+ * The file is mapped in memory and enlarged when needed, so that a frame
+ * is converted directly into the mapping. The number of frames
+ * in the header is updated after each frame: the file can be read
+ * while it is written.
+ */
+class TrajWriter {
+	public:
+		TrajWriter(const std::string &fname, const int dim,
+		           const long _n_parts, const std::array<double, 3> &lens,
+				   const double dt_frame, const long n_frames_hint=16);
+		~TrajWriter();
+		TrajWriter(const TrajWriter &) = delete;
+		TrajWriter & operator=(const TrajWriter &) = delete;
+
+		//! Whether the file could be created
+		bool isOpen() const {
+			return map != nullptr;
+		}
+		void write(const State *state); //!< Write a frame (2d)
+		void write(const State3d *state); //!< Write a frame (3d)
+
+	private:
+		float * beginFrame(); //!< Memory of the next frame
+		void endFrame(); //!< Count the frame in the header
+		bool resize(const uint64_t n_frames_cap); //!< Enlarge the file
+
+		int fd; //!< File descriptor
+		char *map; //!< Mapping of the file
+		size_t map_len; //!< Length of the mapping
+		TrajHeader *header; //!< Header (in the mapping)
+		const long n_parts; //!< Number of particles
+		const int n_fields; //!< Number of fields per particle
+		uint64_t capacity; //!< Number of frames the file can hold
+};
+
+/*!
+ * \brief Class for reading a trajectory
+ *
+ * The file is mapped read-only: any frame is accessed in O(1),
+ * the operating system reading the pages when they are used.
+ */
+class TrajReader {
+	public:
+		TrajReader(const std::string &fname);
+		~TrajReader();
+		TrajReader(const TrajReader &) = delete;
+		TrajReader & operator=(const TrajReader &) = delete;
+
+		//! Whether the file could be read
+		bool isOpen() const {
+			return map != nullptr;
+		}
+		//! Dimension (2 or 3)
+		int getDim() const {
+			return header->dim;
+		}
+		//! Number of particles
+		long getNParts() const {
+			return header->n_parts;
+		}
+		//! Number of fields per particle
+		int getNFields() const {
+			return header->n_fields;
+		}
+		//! Number of frames
+		long getNFrames() const {
+			return n_frames;
+		}
+		//! Lengths of the box
+		std::array<double, 3> getLens() const {
+			return {header->lens[0], header->lens[1], header->lens[2]};
+		}
+		//! Time between two frames
+		double getDtFrame() const {
+			return header->dt_frame;
+		}
+		//! Field f of frame k for all the particles
+		const float * getField(const long k, const int f) const {
+			return reinterpret_cast<const float *>(
+				map + TRAJ_HEADER_SIZE + k * header->frame_bytes
+				+ f * header->n_parts * sizeof(float));
+		}
+		//! Ask the system to read frames k_begin to k_end - 1 in advance
+		void prefetch(long k_begin, long k_end) const;
+
+	private:
+		int fd; //!< File descriptor
+		const char *map; //!< Mapping of the file
+		size_t map_len; //!< Length of the mapping
+		const TrajHeader *header; //!< Header (in the mapping)
+		long n_frames; //!< Number of complete frames in the file
+};
+
+#endif // ACTIVEBROWNIAN_TRAJECTORY_H_
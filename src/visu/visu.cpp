@@ -27,84 +27,176 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <sstream>
 #include "visu.h"
 
 /*!
  * \brief Constructor for visualization
  *
  * \param state Pointer to the state of the system
- * \param len Length of the box
+ * \param len_x Length of the box along x
+ * \param len_y Length of the box along y
  * \param n_parts Number of particles
  */
-Visu::Visu(const State *state, const double len, const long n_parts) :
-	state(state), len(len), n_parts(n_parts) {
+Visu::Visu(const State *state, const double len_x, const double len_y,
+		   const long n_parts) :
+	state(state), replay(nullptr), len_x(len_x), len_y(len_y),
+	n_parts(n_parts) {
+}
+
+/*!
+ * \brief Constructor for the play back of a trajectory
+ *
+ * \param replay Play back of a 2d trajectory
+ */
+Visu::Visu(Replay *replay) :
+	state(nullptr), replay(replay), len_x(replay->getTraj()->getLens()[0]),
+	len_y(replay->getTraj()->getLens()[1]),
+	n_parts(replay->getTraj()->getNParts()) {
 }
 
 /*!
  * \brief Thread for visualization.
  *
  * Open a window, draw the particles and update their
- * positions at a certain number of FPS while the simulation is runing.
+ * positions at a certain number of FPS while the simulation is runing,
+ * or as the trajectory is played back.
  */
 void Visu::run() {
 	sf::VideoMode mode = sf::VideoMode::getDesktopMode();
 	const float windowSize = std::min(mode.width, mode.height) * 9 / 10;
+	// The longest side of the box fills the window
+	scale = windowSize / std::max(len_x, len_y);
+	windowW = scale * len_x;
+	windowH = scale * len_y;
 
     sf::RenderWindow window;
-    window.create(sf::VideoMode(windowSize, windowSize),
+    window.create(sf::VideoMode(windowW, windowH),
 	              "Active Brownian Particles");
 
-	float scale = windowSize / len;
 	// We assume that the particles have diameter 1
-    sf::CircleShape circle(scale / 2.0);
+    circle.setRadius(scale / 2.0);
 	// Line for showing the orientation of the particles
-	sf::RectangleShape line(sf::Vector2f(scale / 2.0, 2.0));
+	line.setSize(sf::Vector2f(scale / 2.0, 2.0));
 	line.setFillColor(sf::Color::Black);
 
     window.setFramerateLimit(FPS);
 
-	const std::vector<double> & pos_x = state->getPosX();
-	const std::vector<double> & pos_y = state->getPosY();
-	const std::vector<double> & angles = state->getAngles();
-
     while (window.isOpen()) {
         sf::Event event;
         while (window.pollEvent(event)) {
             if (event.type == sf::Event::Closed)
                 window.close();
+			else if (replay && event.type == sf::Event::KeyPressed)
+				replayKey(event.key.code);
         }
 
         window.clear(sf::Color::White);
 
-		for (long i = 0 ; i < n_parts ; ++i) {
-			float x = pos_x[i] * scale; 
-			pbc(x, (float) windowSize);
-			float y = pos_y[i] * scale; 
-			pbc(y, (float) windowSize);
-
-			// Angle is coded both as color and as arrow
-			circle.setFillColor(colorFromAngle(angles[i]));
-			line.setRotation(angles[i] * 180.0 / M_PI);
-
-			// Draw multiple times if on the boundary
-			int per_x = (x > windowSize - scale);
-			int per_y = (y > windowSize - scale);
-
-			for (int px = 0 ; px <= per_x ; ++px) {
-				for (int py = 0 ; py <= per_y ; ++py) {
-					circle.setPosition(x - px * windowSize,
-					                   y - py * windowSize);
-					window.draw(circle);
-					line.setPosition(x - px * windowSize + scale / 2.0,
-					                 y - py * windowSize + scale / 2.0);
-					window.draw(line);
-				}
-			}
+		if (replay) {
+			const TrajReader *traj = replay->getTraj();
+			long k = replay->update();
+			draw(window, traj->getField(k, 0), traj->getField(k, 1),
+			     traj->getField(k, 2));
+			std::ostringstream title;
+			replay->printStatus(title);
+			window.setTitle(title.str());
+		} else {
+			draw(window, state->getPosX().data(), state->getPosY().data(),
+			     state->getAngles().data());
 		}
         window.display();
     }
 }
 
+/*!
+ * \brief Draw the particles.
+ *
+ * \param window Window
+ * \param pos_x Positions along x
+ * \param pos_y Positions along y
+ * \param angles Angles
+ */
+template<typename T>
+void Visu::draw(sf::RenderWindow &window, const T *pos_x, const T *pos_y,
+                const T *angles) {
+	for (long i = 0 ; i < n_parts ; ++i) {
+		float x = pos_x[i] * scale; 
+		pbc(x, windowW);
+		float y = pos_y[i] * scale; 
+		pbc(y, windowH);
+
+		// Angle is coded both as color and as arrow
+		circle.setFillColor(colorFromAngle(angles[i]));
+		line.setRotation(angles[i] * 180.0 / M_PI);
+
+		// Draw multiple times if on the boundary
+		int per_x = (x > windowW - scale);
+		int per_y = (y > windowH - scale);
+
+		for (int px = 0 ; px <= per_x ; ++px) {
+			for (int py = 0 ; py <= per_y ; ++py) {
+				circle.setPosition(x - px * windowW,
+				                   y - py * windowH);
+				window.draw(circle);
+				line.setPosition(x - px * windowW + scale / 2.0,
+				                 y - py * windowH + scale / 2.0);
+				window.draw(line);
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Handle a key in replay mode.
+ *
+ * Space: pause, Left/Right: previous/next frame, Down/Up: 10% of the
+ * trajectory backwards/forwards, Home/End: first/last frame,
+ * +/-: twice faster/slower, R: reverse.
+ *
+ * \param key Key pressed
+ */
+void Visu::replayKey(const sf::Keyboard::Key key) {
+	const long n_frames = replay->getTraj()->getNFrames();
+	switch (key) {
+		case sf::Keyboard::Space:
+			replay->togglePause();
+			break;
+		case sf::Keyboard::Right:
+			replay->step(1);
+			break;
+		case sf::Keyboard::Left:
+			replay->step(-1);
+			break;
+		case sf::Keyboard::Up:
+			replay->step(std::max(n_frames / 10, 1L));
+			break;
+		case sf::Keyboard::Down:
+			replay->step(-std::max(n_frames / 10, 1L));
+			break;
+		case sf::Keyboard::Home:
+			replay->seek(0);
+			break;
+		case sf::Keyboard::End:
+			replay->seek(n_frames - 1);
+			break;
+		case sf::Keyboard::Add:
+		case sf::Keyboard::Equal:
+			replay->faster();
+			break;
+		case sf::Keyboard::Subtract:
+		case sf::Keyboard::Dash:
+			replay->slower();
+			break;
+		case sf::Keyboard::R:
+			replay->reverse();
+			break;
+		default:
+			break;
+	}
+}
+
 /*!
  * \brief Associate a color to an angle
  *
@@ -32,20 +32,38 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <SFML/Graphics.hpp>
 #include "../state.h"
+#include "../replay.h"
 
 class Visu {
 	public:
-		Visu(const State *state, const double len, const long n_parts);
+		Visu(const State *state, const double len_x, const double len_y,
+			 const long n_parts);
+		Visu(Replay *replay); //!< Play back of a trajectory
 		void run();
 
 	private:
+		//! Draw the particles
+		template<typename T>
+		void draw(sf::RenderWindow &window, const T *pos_x, const T *pos_y,
+		          const T *angles);
+		//! Handle a key in replay mode
+		void replayKey(const sf::Keyboard::Key key);
+
 		// Constant variables for visualization
 		// const int windowSize = 600; //!< Size of the window
 		const int FPS = 24; //!< Number of frames per second
 
 		const State *state; //!< Pointer to the state of the system
-		const double len; //!< Length of the box
+		Replay *replay; //!< Play back of a trajectory (nullptr if live)
+		const double len_x; //!< Length of the box along x
+		const double len_y; //!< Length of the box along y
 		const long n_parts; //!< Number of particles
+
+		float scale; //!< Size of a unit length in pixels
+		float windowW; //!< Width of the window
+		float windowH; //!< Height of the window
+		sf::CircleShape circle; //!< Shape of a particle
+		sf::RectangleShape line; //!< Line showing the orientation
 };
 
 sf::Color colorFromAngle(const double angle);
@@ -27,6 +27,10 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <iostream>
 #include <vector>
+#include <string>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
 #include <vtkPolyDataMapper.h>
 #include <vtkActor.h>
 #include <vtkRenderWindow.h>
@@ -46,6 +50,43 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 template<typename T>
 using vSP = vtkSmartPointer<T>; // Shortcut
 
+/*!
+ * \brief Place the spheres and color them by orientation.
+ *
+ * \param sphereActors Actors of the spheres
+ * \param state State of the system (if live)
+ * \param replay Play back of a trajectory (nullptr if live)
+ * \param k Frame of the trajectory
+ */
+static void placeActors(std::vector< vSP<vtkActor> > &sphereActors,
+                        const State3d *state, const Replay *replay,
+						const long k) {
+	double r, g, b;
+	if (replay) {
+		const TrajReader *traj = replay->getTraj();
+		const float *pos[3], *u[3];
+		for (int a = 0 ; a < 3 ; ++a) {
+			pos[a] = traj->getField(k, a);
+			u[a] = traj->getField(k, 3 + a);
+		}
+		for (size_t i = 0 ; i < sphereActors.size() ; ++i) {
+			sphereActors[i]->SetPosition(pos[0][i], pos[1][i], pos[2][i]);
+			double uz = std::max(-1.0, std::min((double) u[2][i], 1.0));
+			colorFromAngles(r, g, b, std::acos(uz),
+			                std::atan2(u[1][i], u[0][i]));
+			sphereActors[i]->GetProperty()->SetColor(r, g, b);
+		}
+		return;
+	}
+	for (size_t i = 0 ; i < sphereActors.size() ; ++i) {
+		sphereActors[i]->SetPosition(state->getPosX(i), state->getPosY(i),
+		                             state->getPosZ(i));
+		colorFromAngles(r, g, b, state->getOrient(i)->getTheta(),
+		                state->getOrient(i)->getPhi()); 
+		sphereActors[i]->GetProperty()->SetColor(r, g, b);
+	}
+}
+
 struct Visu3dTimer : public vtkCommand {
 	public:
 		vtkTypeMacro(Visu3dTimer, vtkCommand);
@@ -59,15 +100,14 @@ struct Visu3dTimer : public vtkCommand {
 				static_cast<vtkRenderWindowInteractor*>(caller);
 
 			// Update the positions and the colors
-			double r, g, b;
-			for (size_t i = 0 ; i < sphereActors->size() ; ++i) {
-				(*sphereActors)[i]->SetPosition(state->getPosX(i),
-                                                state->getPosY(i),
-											    state->getPosZ(i));
-				colorFromAngles(r, g, b, state->getOrient(i)->getTheta(),
-								state->getOrient(i)->getPhi()); 
-				(*sphereActors)[i]->GetProperty()->SetColor(r, g, b);
+			long k = 0;
+			if (replay) {
+				k = replay->update();
+				std::ostringstream title;
+				replay->printStatus(title);
+				iren->GetRenderWindow()->SetWindowName(title.str().c_str());
 			}
+			placeActors(*sphereActors, state, replay, k);
 
 			iren->Render();
 		}
@@ -75,30 +115,89 @@ struct Visu3dTimer : public vtkCommand {
 	// Public attributes (this is dirty...)
 	std::vector< vSP<vtkActor> > *sphereActors;
 	const State3d *state;
+	Replay *replay;
+};
+
+/*!
+ * \brief Keys of the play back of a trajectory
+ *
+ * Space: pause, Left/Right: previous/next frame, Down/Up: 10% of the
+ * trajectory backwards/forwards, Home/End: first/last frame,
+ * +/-: twice faster/slower, B: reverse (R resets the camera).
+ */
+struct Visu3dKeys : public vtkCommand {
+	public:
+		vtkTypeMacro(Visu3dKeys, vtkCommand);
+		static Visu3dKeys *New() {
+			return new Visu3dKeys();
+		}
+
+		void Execute(vtkObject *caller, unsigned long vtkNotUsed(eventId),
+					   void *vtkNotUsed(callData)) {
+			vtkRenderWindowInteractor *iren =
+				static_cast<vtkRenderWindowInteractor*>(caller);
+			const std::string key = iren->GetKeySym() ? iren->GetKeySym() : "";
+			const long n_frames = replay->getTraj()->getNFrames();
+
+			if (key == "space") {
+				replay->togglePause();
+			} else if (key == "Right") {
+				replay->step(1);
+			} else if (key == "Left") {
+				replay->step(-1);
+			} else if (key == "Up") {
+				replay->step(std::max(n_frames / 10, 1L));
+			} else if (key == "Down") {
+				replay->step(-std::max(n_frames / 10, 1L));
+			} else if (key == "Home") {
+				replay->seek(0);
+			} else if (key == "End") {
+				replay->seek(n_frames - 1);
+			} else if (key == "plus" || key == "KP_Add") {
+				replay->faster();
+			} else if (key == "minus" || key == "KP_Subtract") {
+				replay->slower();
+			} else if (key == "b") {
+				replay->reverse();
+			}
+		}
+
+	Replay *replay;
 };
 
 /*!
  * \brief Constructor for visualization
  *
  * \param state Pointer to the state of the system
- * \param len Length of the box
+ * \param lens Lengths of the box
  * \param n_parts Number of particles
  */
-Visu3d::Visu3d(const State3d *state, const double len, const long n_parts) :
-	state(state), len(len), n_parts(n_parts) {
+Visu3d::Visu3d(const State3d *state, const std::array<double, 3> &lens,
+		       const long n_parts) :
+	state(state), replay(nullptr), lens(lens), n_parts(n_parts) {
+}
+
+/*!
+ * \brief Constructor for the play back of a trajectory
+ *
+ * \param replay Play back of a 3d trajectory
+ */
+Visu3d::Visu3d(Replay *replay) :
+	state(nullptr), replay(replay), lens(replay->getTraj()->getLens()),
+	n_parts(replay->getTraj()->getNParts()) {
 }
 
 /*!
  * \brief Thread for visualization.
  *
  * Open a window, draw the particles and update their
- * positions while the simulation is runing.
+ * positions while the simulation is runing, or as the trajectory
+ * is played back.
  */
 void Visu3d::run() {
 	std::vector< vSP<vtkSphereSource> > sphereSources;
 	std::vector< vSP<vtkPolyDataMapper> > sphereMappers;
 	std::vector< vSP<vtkActor> > sphereActors;
-	double r, g, b;
 
 	for (long i = 0 ; i < n_parts ; ++i) {
 		sphereSources.push_back(vSP<vtkSphereSource>::New());
@@ -113,21 +212,17 @@ void Visu3d::run() {
 		// create an actor
 		sphereActors.push_back(vSP<vtkActor>::New());
 		sphereActors[i]->SetMapper(sphereMappers[i]);
-		sphereActors[i]->SetPosition(state->getPosX(i), state->getPosY(i),
-				                     state->getPosZ(i));
-		colorFromAngles(r, g, b, state->getOrient(i)->getTheta(),
-				        state->getOrient(i)->getPhi()); 
-		sphereActors[i]->GetProperty()->SetColor(r, g, b);
 		sphereActors[i]->GetProperty()->SetOpacity(sphere_opa);
 
 	}
+	placeActors(sphereActors, state, replay, 0);
 
 	// Box
 	vSP<vtkCubeSource> cubeSource = vSP<vtkCubeSource>::New();
-	cubeSource->SetXLength(len);
-	cubeSource->SetYLength(len);
-	cubeSource->SetZLength(len);
-	cubeSource->SetCenter(len / 2., len / 2., len / 2.);
+	cubeSource->SetXLength(lens[0]);
+	cubeSource->SetYLength(lens[1]);
+	cubeSource->SetZLength(lens[2]);
+	cubeSource->SetCenter(lens[0] / 2., lens[1] / 2., lens[2] / 2.);
 	cubeSource->Update();
 	vSP<vtkPolyDataMapper> cubeMapper = vSP<vtkPolyDataMapper>::New();
 	cubeMapper->SetInputConnection(cubeSource->GetOutputPort());
@@ -166,7 +261,15 @@ void Visu3d::run() {
 		vtkSmartPointer<Visu3dTimer>::New();
 	timerCallback->sphereActors = &sphereActors;
 	timerCallback->state = state;
+	timerCallback->replay = replay;
 	renderWindowInteractor->AddObserver(vtkCommand::TimerEvent, timerCallback);
+	vtkSmartPointer<Visu3dKeys> keysCallback;
+	if (replay) {
+		keysCallback = vtkSmartPointer<Visu3dKeys>::New();
+		keysCallback->replay = replay;
+		renderWindowInteractor->AddObserver(vtkCommand::KeyPressEvent,
+		                                    keysCallback);
+	}
 
 	// Render and interact
 	renderWindow->Render();
@@ -29,10 +29,13 @@ along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
 #define ACTIVEBROWNIAN_VISU3D_H_
 
 #include "../state3d.h"
+#include "../replay.h"
 
 class Visu3d {
 	public:
-		Visu3d(const State3d *state, const double len, const long n_parts);
+		Visu3d(const State3d *state, const std::array<double, 3> &lens,
+			   const long n_parts);
+		Visu3d(Replay *replay); //!< Play back of a trajectory
 		void run();
 
 	private:
@@ -42,7 +45,8 @@ class Visu3d {
 		const double sphere_opa = 1.0; //!< Opacity of the spheres
 
 		const State3d *state; //!< Pointer to the state of the system
-		const double len; //!< Length of the box
+		Replay *replay; //!< Play back of a trajectory (nullptr if live)
+		const std::array<double, 3> lens; //!< Lengths of the box
 		const long n_parts; //!< Number of particles
 };
 
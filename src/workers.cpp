@@ -0,0 +1,287 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file workers.cpp
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Pool of threads for the computation of the forces
+ *
+ * Implementation of the methods of the class Workers.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include "workers.h"
+
+/*!
+ * \brief Parse a list of CPUs as in /sys (e.g. "0-3,8-11")
+ *
+ * \param list List of CPUs
+ * \return Numbers of the CPUs
+ */
+static std::vector<int> parseCpuList(const std::string &list) {
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ',')) {
+		size_t dash = range.find('-');
+		try {
+			int lo = std::stoi(range.substr(0, dash));
+			int hi = (dash == std::string::npos) ? lo
+			         : std::stoi(range.substr(dash + 1));
+			for (int c = lo ; c <= hi ; ++c) {
+				cpus.push_back(c);
+			}
+		} catch (std::exception &) {
+			// Empty or malformed range
+		}
+	}
+	return cpus;
+}
+
+/*!
+ * \brief Constructor of Workers
+ *
+ * Detect the topology, place the threads and start them.
+ *
+ * \param _n_threads Number of threads (including the calling thread)
+ * \param _pin Pin the threads to their CPUs
+ */
+Workers::Workers(const int _n_threads, const bool _pin) :
+	n_threads(std::max(_n_threads, 1)), pin(_pin), generation(0),
+	n_running(0), stop(false), task(nullptr), call(nullptr) {
+	detectTopology();
+
+	// Contiguous blocks of threads on each node, the k-th thread of a node
+	// taking its k-th CPU
+	const int n_nodes = std::min((int) node_cpus.size(), n_threads);
+	cpu_of.resize(n_threads);
+	node_of.resize(n_threads);
+	pinned.assign(n_threads, false);
+	for (int t = 0 ; t < n_threads ; ++t) {
+		int n = (t * n_nodes) / n_threads;
+		int first = (n * n_threads + n_nodes - 1) / n_nodes;
+		node_of[t] = n;
+		cpu_of[t] = node_cpus[n][(t - first) % node_cpus[n].size()];
+	}
+
+#ifdef USE_OPENMP
+	// The threads of OpenMP are kept from one parallel region to the next
+	if (pin) {
+		auto pinAll = [this](const int t) {
+			bool ok = pinThread(t);
+			std::lock_guard<std::mutex> lock(mtx);
+			pinned[t] = ok;
+		};
+		run(pinAll);
+	}
+#else
+	if (pin) {
+		pinned[0] = pinThread(0);
+	}
+	for (int t = 1 ; t < n_threads ; ++t) {
+		threads.push_back(std::thread(&Workers::loop, this, t));
+	}
+	// Wait for all the threads to be started (and pinned)
+	auto nothing = [](const int) {};
+	run(nothing);
+#endif
+}
+
+/*!
+ * \brief Destructor of Workers
+ *
+ * Tell the threads to exit and join them.
+ */
+Workers::~Workers() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv_start.notify_all();
+	for (auto &th : threads) {
+		th.join();
+	}
+}
+
+/*!
+ * \brief Read the NUMA nodes and their CPUs.
+ *
+ * Only the CPUs on which the process is allowed to run are kept.
+ * Without /sys/devices/system/node, all of them form a single node.
+ */
+void Workers::detectTopology() {
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		for (int c = 0 ; c < (int) std::thread::hardware_concurrency() ; ++c) {
+			CPU_SET(c, &allowed);
+		}
+	}
+
+	std::vector< std::pair<int, std::vector<int> > > nodes;
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir) {
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != nullptr) {
+			std::string name(ent->d_name);
+			if (name.compare(0, 4, "node") != 0 || name.size() == 4
+				|| name.find_first_not_of("0123456789", 4)
+				   != std::string::npos) {
+				continue;
+			}
+			std::ifstream file("/sys/devices/system/node/" + name
+			                   + "/cpulist");
+			std::string list;
+			std::getline(file, list);
+			std::vector<int> cpus;
+			for (int c : parseCpuList(list)) {
+				if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)) {
+					cpus.push_back(c);
+				}
+			}
+			if (!cpus.empty()) {
+				nodes.push_back({std::stoi(name.substr(4)), cpus});
+			}
+		}
+		closedir(dir);
+	}
+	std::sort(nodes.begin(), nodes.end());
+
+	if (nodes.empty()) {
+		std::vector<int> cpus;
+		for (int c = 0 ; c < CPU_SETSIZE ; ++c) {
+			if (CPU_ISSET(c, &allowed)) {
+				cpus.push_back(c);
+			}
+		}
+		if (cpus.empty()) {
+			cpus.push_back(0);
+		}
+		nodes.push_back({0, cpus});
+	}
+
+	for (const auto &n : nodes) {
+		node_ids.push_back(n.first);
+		node_cpus.push_back(n.second);
+	}
+}
+
+/*!
+ * \brief Pin the calling thread to the CPU of thread t.
+ *
+ * \param t Index of the thread
+ * \return True if the pinning succeeded
+ */
+bool Workers::pinThread(const int t) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu_of[t], &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/*!
+ * \brief Give a task to the threads, run it and wait for all of them.
+ *
+ * \param _task Task
+ * \param _call Function calling the task for a given thread
+ */
+void Workers::dispatch(void *_task, void (*_call)(void *, const int)) {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		task = _task;
+		call = _call;
+		n_running = n_threads - 1;
+		++generation;
+	}
+	cv_start.notify_all();
+
+	call(task, 0);
+
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_done.wait(lock, [this] { return n_running == 0; });
+}
+
+/*!
+ * \brief Loop of thread t: wait for a task, run it, and so on.
+ *
+ * \param t Index of the thread
+ */
+void Workers::loop(const int t) {
+	if (pin) {
+		bool ok = pinThread(t);
+		std::lock_guard<std::mutex> lock(mtx);
+		pinned[t] = ok;
+	}
+
+	long seen = 0;
+	while (true) {
+		void *my_task;
+		void (*my_call)(void *, const int);
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_start.wait(lock, [&] { return stop || generation != seen; });
+			if (stop) {
+				return;
+			}
+			seen = generation;
+			my_task = task;
+			my_call = call;
+		}
+
+		my_call(my_task, t);
+
+		std::lock_guard<std::mutex> lock(mtx);
+		if (--n_running == 0) {
+			cv_done.notify_one();
+		}
+	}
+}
+
+/*!
+ * \brief Print the topology and the placement of the threads.
+ *
+ * \param out Output stream
+ */
+void Workers::printTopology(std::ostream &out) const {
+	out << "# Topology: " << node_cpus.size() << " NUMA node(s)";
+	for (size_t n = 0 ; n < node_cpus.size() ; ++n) {
+		out << ", node " << node_ids[n] << ": " << node_cpus[n].size()
+			<< " CPU(s)";
+	}
+	out << "\n# Threads: " << n_threads;
+#ifdef USE_OPENMP
+	out << " (OpenMP)";
+#endif
+	out << (pin ? ", pinned" : ", not pinned");
+	for (int t = 0 ; t < n_threads ; ++t) {
+		out << (t == 0 ? "\n#   " : ", ") << t << " -> ";
+		if (pin) {
+			out << "CPU " << cpu_of[t] << (pinned[t] ? "" : " (failed)")
+				<< " on ";
+		}
+		out << "node " << node_ids[node_of[t]];
+	}
+	out << std::endl;
+}
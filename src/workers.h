@@ -0,0 +1,117 @@
+/*
+Copyright (C) Sorbonne Université (2018)
+Contributor: Alexis Poncet <aponcet@lptmc.jussieu.fr>
+
+This file is part of ActiveBrownian.
+
+ActiveBrownian is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+ActiveBrownian is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with ActiveBrownian.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*!
+ * \file workers.h
+ * \author Alexis Poncet <aponcet@lptmc.jussieu.fr>
+ * \brief Pool of threads for the computation of the forces
+ *
+ * Header file for workers.cpp.
+ * It defines the class Workers.
+ */
+
+#ifndef ACTIVEBROWNIAN_WORKERS_H_
+#define ACTIVEBROWNIAN_WORKERS_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include "ompPragma.h"
+
+/*!
+ * \brief Class for a pool of threads
+ *
+ * The threads are created once and wait for tasks. The calling thread
+ * is thread 0 and takes part in each task. The threads are spread over
+ * the NUMA nodes (read from /sys) by contiguous blocks, so that threads
+ * working on neighboring parts of the system share a node,
+ * and they are pinned to their CPU on demand.
+ * In the OpenMP variant (USE_OPENMP), the tasks are run by the threads
+ * of OpenMP instead of the pool.
+ */
+class Workers {
+	public:
+		Workers(const int _n_threads, const bool _pin);
+		~Workers();
+		Workers(const Workers &) = delete;
+		Workers & operator=(const Workers &) = delete;
+
+		//! Number of threads (including the calling thread)
+		int getNThreads() const {
+			return n_threads;
+		}
+		//! Run f(t) on every thread t and wait for the end
+		template<typename F>
+		void run(F &f) {
+			if (n_threads == 1) {
+				f(0);
+				return;
+			}
+#ifdef USE_OPENMP
+			// Fewer threads than asked for take several tasks
+			const int n = n_threads;
+			OMP_PRAGMA(omp parallel num_threads(n))
+			for (int t = ompThreadNum() ; t < n ; t += omp_get_num_threads()) {
+				f(t);
+			}
+#else
+			dispatch(static_cast<void *>(&f), &callTask<F>);
+#endif
+		}
+		//! First index of thread t when n items are split evenly
+		long splitBegin(const long n, const int t) const {
+			return (n * t) / n_threads;
+		}
+		//! Print the topology and the placement of the threads
+		void printTopology(std::ostream &out) const;
+
+	private:
+		//! Call a task of type F
+		template<typename F>
+		static void callTask(void *task, const int t) {
+			(*static_cast<F *>(task))(t);
+		}
+		//! Give a task to the threads and run it
+		void dispatch(void *_task, void (*_call)(void *, const int));
+		void loop(const int t); //!< Loop of the threads waiting for tasks
+		void detectTopology(); //!< Read the NUMA nodes and their CPUs
+		bool pinThread(const int t); //!< Pin the calling thread to its CPU
+
+		const int n_threads; //!< Number of threads
+		const bool pin; //!< Pin the threads to their CPUs
+		std::vector< std::vector<int> > node_cpus; //!< CPUs of each node
+		std::vector<int> node_ids; //!< System number of each node
+		std::vector<int> cpu_of; //!< CPU of each thread
+		std::vector<int> node_of; //!< Node of each thread
+		std::vector<bool> pinned; //!< Whether the pinning succeeded
+
+		std::vector<std::thread> threads; //!< Threads 1 to n_threads-1
+		std::mutex mtx; //!< Mutex for the tasks
+		std::condition_variable cv_start; //!< Signal of a new task
+		std::condition_variable cv_done; //!< Signal of the end of a task
+		long generation; //!< Number of tasks given
+		int n_running; //!< Number of threads still working on the task
+		bool stop; //!< Tell the threads to exit
+		void *task; //!< Current task
+		void (*call)(void *, const int); //!< Function calling the task
+};
+
+#endif // ACTIVEBROWNIAN_WORKERS_H_